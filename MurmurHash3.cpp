@@ -9,6 +9,13 @@
 
 #include "MurmurHash3.h"
 
+#include <string.h>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <immintrin.h>
+#define MURMUR_AVX2 1
+#endif
+
 //-----------------------------------------------------------------------------
 // Platform-specific functions and macros
 
@@ -148,6 +155,31 @@ extern "C" void MurmurHash3_x86_32 ( const void * key, int len,
 
 //-----------------------------------------------------------------------------
 
+// MurmurHash3_x86_32 of the 8-byte key { w0, w1 }: two blocks, no tail, and
+// len = 8 folded into the finalization. Returns what MurmurHash3_x86_32
+// would store to out.
+
+extern "C" uint32_t MurmurHash3_x86_32_u32x2 ( uint32_t w0, uint32_t w1,
+                                               uint32_t seed )
+{
+  const uint32_t c1 = 0xcc9e2d51;
+  const uint32_t c2 = 0x1b873593;
+
+  uint32_t h1 = seed;
+
+  w0 *= c1; w0 = ROTL32(w0,15); w0 *= c2;
+  h1 ^= w0; h1 = ROTL32(h1,13); h1 = h1*5+0xe6546b64;
+
+  w1 *= c1; w1 = ROTL32(w1,15); w1 *= c2;
+  h1 ^= w1; h1 = ROTL32(h1,13); h1 = h1*5+0xe6546b64;
+
+  h1 ^= 8;
+
+  return fmix(h1);
+}
+
+//-----------------------------------------------------------------------------
+
 extern "C" void MurmurHash3_x86_128 ( const void * key, const int len,
                            uint32_t seed, void * out )
 {
@@ -334,3 +366,95 @@ extern "C" void MurmurHash3_x64_128 ( const void * key, const int len,
 
 //-----------------------------------------------------------------------------
 
+// MurmurHash3_x86_32 of n consecutive 8-byte vnode keys: member, then
+// first + i, both little-endian. The member block is the same for every key,
+// so it is mixed in once; AVX2 then finishes eight keys per iteration.
+
+static void vnode_x86_32 ( uint32_t member, uint32_t replica, uint32_t seed,
+                           uint32_t * out )
+{
+  uint8_t key[8];
+  uint32_t w[2];
+
+  for(int i = 0; i < 4; i++)
+  {
+    key[i] = (uint8_t)(member >> (8 * i));
+    key[4 + i] = (uint8_t)(replica >> (8 * i));
+  }
+  memcpy(w,key,sizeof(w));
+  *out = MurmurHash3_x86_32_u32x2(w[0],w[1],seed);
+}
+
+#if defined(MURMUR_AVX2)
+
+#define VROTL32(x,r) \
+  _mm256_or_si256(_mm256_slli_epi32(x,r),_mm256_srli_epi32(x,32 - (r)))
+
+__attribute__((target("avx2")))
+static void vnodes_x86_32_avx2 ( uint32_t member, uint32_t first, uint32_t n,
+                                 uint32_t seed, uint32_t * out )
+{
+  const uint32_t c1 = 0xcc9e2d51;
+  const uint32_t c2 = 0x1b873593;
+
+  // First block: the member (x86 is little-endian)
+  uint32_t h1 = seed;
+  uint32_t k1 = member;
+
+  k1 *= c1; k1 = ROTL32(k1,15); k1 *= c2;
+  h1 ^= k1; h1 = ROTL32(h1,13); h1 = h1*5+0xe6546b64;
+
+  const __m256i lanes = _mm256_setr_epi32(0,1,2,3,4,5,6,7);
+  const __m256i vc1 = _mm256_set1_epi32((int)c1);
+  const __m256i vc2 = _mm256_set1_epi32((int)c2);
+  const __m256i vh1 = _mm256_set1_epi32((int)h1);
+  uint32_t i;
+
+  for(i = 0; n - i >= 8; i += 8)
+  {
+    // Second block: the replica
+    __m256i k = _mm256_add_epi32(_mm256_set1_epi32((int)(first + i)),lanes);
+
+    k = _mm256_mullo_epi32(k,vc1);
+    k = VROTL32(k,15);
+    k = _mm256_mullo_epi32(k,vc2);
+
+    __m256i h = _mm256_xor_si256(vh1,k);
+    h = VROTL32(h,13);
+    h = _mm256_add_epi32(_mm256_add_epi32(_mm256_slli_epi32(h,2),h),
+                         _mm256_set1_epi32((int)0xe6546b64));
+
+    // Finalization: len, then fmix
+    h = _mm256_xor_si256(h,_mm256_set1_epi32(8));
+    h = _mm256_xor_si256(h,_mm256_srli_epi32(h,16));
+    h = _mm256_mullo_epi32(h,_mm256_set1_epi32((int)0x85ebca6b));
+    h = _mm256_xor_si256(h,_mm256_srli_epi32(h,13));
+    h = _mm256_mullo_epi32(h,_mm256_set1_epi32((int)0xc2b2ae35));
+    h = _mm256_xor_si256(h,_mm256_srli_epi32(h,16));
+
+    _mm256_storeu_si256((__m256i *)&out[i],h);
+  }
+
+  for(; i < n; i++)
+    vnode_x86_32(member,first + i,seed,&out[i]);
+}
+
+#endif // defined(MURMUR_AVX2)
+
+extern "C" void MurmurHash3_x86_32_vnodes ( uint32_t member, uint32_t first,
+                                            uint32_t n, uint32_t seed,
+                                            uint32_t * out )
+{
+#if defined(MURMUR_AVX2)
+  if(__builtin_cpu_supports("avx2"))
+  {
+    vnodes_x86_32_avx2(member,first,n,seed,out);
+    return;
+  }
+#endif
+
+  for(uint32_t i = 0; i < n; i++)
+    vnode_x86_32(member,first + i,seed,&out[i]);
+}
+
+//-----------------------------------------------------------------------------
@@ -31,9 +31,16 @@ extern "C" {
 #endif
 void MurmurHash3_x86_32  ( const void * key, int len, uint32_t seed, void * out );
 
+// MurmurHash3_x86_32 of the 8-byte key { w0, w1 }, in host byte order
+uint32_t MurmurHash3_x86_32_u32x2 ( uint32_t w0, uint32_t w1, uint32_t seed );
+
 void MurmurHash3_x86_128 ( const void * key, int len, uint32_t seed, void * out );
 
 void MurmurHash3_x64_128 ( const void * key, int len, uint32_t seed, void * out );
+
+// MurmurHash3_x86_32 of the n 8-byte keys (member, first + i), little-endian
+void MurmurHash3_x86_32_vnodes ( uint32_t member, uint32_t first, uint32_t n,
+                                 uint32_t seed, uint32_t * out );
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,439 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Lookup benchmarks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "crc32c.h"
+#include "isi_hash.h"
+#include "MurmurHash3.h"
+
+#define NKEYS		(1024*1024)
+#define BATCH		1024
+#define NREPLICAS	256
+
+/*
+ * hash_ring_getn() in a loop vs. hash_ring_getn_batch(), over rings from 1K
+ * to 16M entries.
+ */
+void
+bench_getn_batch(void)
+{
+	uint32_t *keys, *out;
+	uint64_t t0, t1;
+	struct hash_ring hr;
+	const unsigned ns[] = { 1, 3 };
+
+	keys = malloc(NKEYS * sizeof *keys);
+	out = malloc(NKEYS * 3 * sizeof *out);
+	if (keys == NULL || out == NULL)
+		abort();
+	bench_fill_keys(keys, NKEYS, 1);
+
+	printf("vnodes\t\tn\tgetn ns/key\tbatch ns/key\tspeedup\n");
+	for (size_t nvnodes = 1024; nvnodes <= 16*1024*1024; nvnodes *= 4) {
+		uint32_t nmembers = nvnodes / NREPLICAS;
+
+		if (nmembers < 4)
+			nmembers = 4;
+
+		hash_ring_init(&hr, NULL, NULL, NREPLICAS);
+		bench_fill_ring(&hr, nvnodes, nmembers);
+
+		for (unsigned j = 0; j < NELEM(ns); j++) {
+			double single, batch;
+			unsigned n = ns[j];
+
+			t0 = bench_now();
+			for (size_t k = 0; k < NKEYS; k++)
+				if (hash_ring_getn(&hr, keys[k], n, &out[k*n]))
+					abort();
+			t1 = bench_now();
+			single = (double)(t1 - t0) / NKEYS;
+
+			t0 = bench_now();
+			for (size_t k = 0; k < NKEYS; k += BATCH)
+				if (hash_ring_getn_batch(&hr, &keys[k], BATCH,
+				    n, &out[k*n]))
+					abort();
+			t1 = bench_now();
+			batch = (double)(t1 - t0) / NKEYS;
+
+			printf("%-10zu\t%u\t%.1f\t\t%.1f\t\t%.2fx\n", nvnodes,
+			    n, single, batch, single / batch);
+		}
+
+		hash_ring_clean(&hr);
+	}
+
+	free(out);
+	free(keys);
+}
+
+static void
+index_any(struct hash_ring *hr, enum hr_lookup lookup)
+{
+	void *buf = NULL;
+	size_t sz = 0;
+
+	while ((sz = hash_ring_index(hr, lookup, buf, sz)) != 0) {
+		buf = malloc(sz);
+		if (buf == NULL)
+			abort();
+	}
+}
+
+/*
+ * Binary search vs. each lookup index, for getn() in a loop and for
+ * getn_batch().
+ */
+void
+bench_getn_index(void)
+{
+	const struct {
+		const char	*name;
+		enum hr_lookup	 lookup;
+	} lookups[] = {
+		{ "bsearch", HR_LOOKUP_BSEARCH },
+		{ "btree", HR_LOOKUP_BTREE },
+		{ "prefix", HR_LOOKUP_PREFIX },
+		{ "interp", HR_LOOKUP_INTERP },
+	};
+	uint32_t *keys, *out;
+	uint64_t t0, t1;
+	struct hash_ring hr;
+
+	keys = malloc(NKEYS * sizeof *keys);
+	out = malloc(NKEYS * sizeof *out);
+	if (keys == NULL || out == NULL)
+		abort();
+	bench_fill_keys(keys, NKEYS, 2);
+
+	printf("vnodes\t\tlookup\t\tgetn ns/key\tbatch ns/key\n");
+	for (size_t nvnodes = 1024; nvnodes <= 16*1024*1024; nvnodes *= 4) {
+		hash_ring_init(&hr, NULL, NULL, NREPLICAS);
+		bench_fill_ring(&hr, nvnodes, nvnodes / NREPLICAS + 4);
+
+		for (unsigned j = 0; j < NELEM(lookups); j++) {
+			double single, batch;
+
+			index_any(&hr, lookups[j].lookup);
+
+			t0 = bench_now();
+			for (size_t k = 0; k < NKEYS; k++)
+				if (hash_ring_getn(&hr, keys[k], 1, &out[k]))
+					abort();
+			t1 = bench_now();
+			single = (double)(t1 - t0) / NKEYS;
+
+			t0 = bench_now();
+			for (size_t k = 0; k < NKEYS; k += BATCH)
+				if (hash_ring_getn_batch(&hr, &keys[k], BATCH,
+				    1, &out[k]))
+					abort();
+			t1 = bench_now();
+			batch = (double)(t1 - t0) / NKEYS;
+
+			printf("%-10zu\t%s\t\t%.1f\t\t%.1f\n", nvnodes,
+			    lookups[j].name, single, batch);
+		}
+
+		hash_ring_clean(&hr);
+	}
+
+	free(out);
+	free(keys);
+}
+
+/*
+ * getn(n=3) with and without a successor table, for a handful of members
+ * with increasing numbers of replicas each.
+ */
+void
+bench_getn_succ(void)
+{
+	const uint32_t members[] = { 3, 5, 16, 64 };
+	const uint32_t replicas[] = { 64, 256, 1024, 4096 };
+	const unsigned n = 3;
+	uint32_t *keys, out[3];
+	uint64_t t0, t1;
+	struct hash_ring hr;
+
+	keys = malloc(NKEYS * sizeof *keys);
+	if (keys == NULL)
+		abort();
+	bench_fill_keys(keys, NKEYS, 3);
+
+	printf("members\treplicas\twalk ns/key\tsucc ns/key\tspeedup\n");
+	for (unsigned m = 0; m < NELEM(members); m++) {
+		for (unsigned r = 0; r < NELEM(replicas); r++) {
+			double walk, succ;
+			void *buf = NULL;
+			size_t sz = 0;
+
+			hash_ring_init(&hr, bench_hash, NULL, replicas[r]);
+			for (uint32_t i = 1; i <= members[m]; i++)
+				bench_add(&hr, i, 100);
+
+			t0 = bench_now();
+			for (size_t k = 0; k < NKEYS; k++)
+				if (hash_ring_getn(&hr, keys[k], n, out))
+					abort();
+			t1 = bench_now();
+			walk = (double)(t1 - t0) / NKEYS;
+
+			while ((sz = hash_ring_successors(&hr, buf, sz)) != 0) {
+				buf = malloc(sz);
+				if (buf == NULL)
+					abort();
+			}
+
+			t0 = bench_now();
+			for (size_t k = 0; k < NKEYS; k++)
+				if (hash_ring_getn(&hr, keys[k], n, out))
+					abort();
+			t1 = bench_now();
+			succ = (double)(t1 - t0) / NKEYS;
+
+			printf("%u\t%u\t\t%.1f\t\t%.1f\t\t%.2fx\n",
+			    (unsigned)members[m], (unsigned)replicas[r], walk,
+			    succ, walk / succ);
+
+			hash_ring_clean(&hr);
+		}
+	}
+
+	free(keys);
+}
+
+/*
+ * getn(n=3) walking the ring vs. from preference lists; and what the lists
+ * cost to build and store.
+ */
+void
+bench_getn_preflist(void)
+{
+	const uint32_t members[] = { 3, 16, 64, 1024, 16384 };
+	const unsigned n = 3;
+	uint32_t *keys, out[3];
+	uint64_t t0, t1;
+	struct hash_ring hr;
+
+	keys = malloc(NKEYS * sizeof *keys);
+	if (keys == NULL)
+		abort();
+	bench_fill_keys(keys, NKEYS, 4);
+
+	printf("members\tvnodes\t\tarcs\t\tbytes\t\tbuild ms\t"
+	    "walk ns/key\tlists ns/key\n");
+	for (unsigned m = 0; m < NELEM(members); m++) {
+		double walk, lists, build;
+		void *buf = NULL;
+		size_t sz = 0, bytes = 0;
+
+		hash_ring_init(&hr, NULL, NULL, NREPLICAS);
+		bench_fill_ring(&hr, (size_t)members[m] * NREPLICAS,
+		    members[m]);
+
+		t0 = bench_now();
+		for (size_t k = 0; k < NKEYS; k++)
+			if (hash_ring_getn(&hr, keys[k], n, out))
+				abort();
+		t1 = bench_now();
+		walk = (double)(t1 - t0) / NKEYS;
+
+		/* Includes sizing, as a caller would see it. */
+		t0 = bench_now();
+		while ((sz = hash_ring_preflist(&hr, n, buf, sz)) != 0) {
+			bytes = sz;
+			buf = malloc(sz);
+			if (buf == NULL)
+				abort();
+		}
+		t1 = bench_now();
+		build = (double)(t1 - t0) / 1e6;
+
+		t0 = bench_now();
+		for (size_t k = 0; k < NKEYS; k++)
+			if (hash_ring_getn(&hr, keys[k], n, out))
+				abort();
+		t1 = bench_now();
+		lists = (double)(t1 - t0) / NKEYS;
+
+		printf("%u\t%-10zu\t%-10zu\t%-10zu\t%.1f\t\t%.1f\t\t%.1f\n",
+		    (unsigned)members[m], hr.hr_ring_used,
+		    hr.hr_preflist.pl_runs, bytes, build, walk, lists);
+
+		hash_ring_clean(&hr);
+	}
+
+	free(keys);
+}
+
+static uint32_t
+isi32(const void *data, size_t len)
+{
+
+	return isi_hash32(data, len, 0);
+}
+
+static uint32_t
+mmh3_32(const void *data, size_t len)
+{
+	uint32_t res;
+
+	MurmurHash3_x86_32(data, (int)len, 0, &res);
+	return res;
+}
+
+static int
+cmp_u32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+#define LOOKUP_KEYS	(256*1024)
+#define LOOKUP_SPAN	32		/* lookups per latency sample */
+#define LOOKUP_ITEMS	(1024*1024)	/* key universe */
+
+/*
+ * Look up every key in @keys, print throughput and latency percentiles to
+ * finish the row.  @lat has room for LOOKUP_KEYS / LOOKUP_SPAN samples.
+ */
+static void
+lookup_run(const struct hash_ring *hr, hr_hasher_t hash, const uint32_t *keys,
+    unsigned n, uint32_t *lat)
+{
+	const double pcts[] = { 50, 90, 99, 99.9 };
+	const size_t nlat = LOOKUP_KEYS / LOOKUP_SPAN;
+	uint64_t t0, t1, start;
+	uint32_t out[3];
+	uint8_t key[8];
+
+	memset(key, 0, sizeof key);
+	start = t0 = bench_now();
+	for (size_t s = 0; s < nlat; s++) {
+		for (size_t i = s * LOOKUP_SPAN; i < (s + 1) * LOOKUP_SPAN;
+		    i++) {
+			memcpy(key, &keys[i], 4);
+			if (hash_ring_getn(hr, hash(key, sizeof key), n, out))
+				abort();
+		}
+		t1 = bench_now();
+		lat[s] = (uint32_t)((t1 - t0 + LOOKUP_SPAN / 2) / LOOKUP_SPAN);
+		t0 = t1;
+	}
+	qsort(lat, nlat, sizeof *lat, cmp_u32);
+
+	printf("\t%.2f", LOOKUP_KEYS * 1e3 / (double)(t0 - start));
+	for (unsigned q = 0; q < NELEM(pcts); q++)
+		printf("\t%u", (unsigned)lat[(size_t)(pcts[q] / 100 *
+		    (nlat - 1))]);
+	printf("\t%u\n", (unsigned)lat[nlat - 1]);
+}
+
+/*
+ * hash_ring_getn() of 8-byte keys, hashed as a caller would, swept over
+ * members x replicas x hasher x n x key pattern.  Reports throughput and
+ * latency percentiles, one tab-separated row per configuration under a
+ * header line, for scripts to diff between runs.
+ *
+ * clock_gettime() costs as much as a lookup, so latency is sampled over
+ * spans of LOOKUP_SPAN lookups; the percentiles are of per-lookup means
+ * within a span.  Keys are item numbers: random over the universe,
+ * sequential, or Zipfian (theta 0.99), so hot keys stay in cache as they
+ * would in a real workload.
+ */
+void
+bench_lookup(void)
+{
+	const uint32_t members[] = { 16, 256, 4096 };
+	const uint32_t replicas[] = { 16, 256 };
+	const unsigned ns[] = { 1, 3 };
+	const struct {
+		const char	*name;
+		hr_hasher_t	 hash;
+	} hashers[] = {
+		{ "fnv", bench_hash },
+		{ "isi32", isi32 },
+		{ "mmh3_32", mmh3_32 },
+		{ "crc32c", crc32c_hasher },
+	};
+	const char *patterns[] = { "random", "sequential", "zipfian" };
+	uint32_t *keys[NELEM(patterns)], *lat;
+	struct hr_member *mlist;
+	struct hash_ring hr;
+	void *buf;
+	size_t sz;
+
+	for (unsigned p = 0; p < NELEM(patterns); p++) {
+		keys[p] = malloc(LOOKUP_KEYS * sizeof *keys[p]);
+		if (keys[p] == NULL)
+			abort();
+	}
+	bench_fill_keys(keys[0], LOOKUP_KEYS, 5);
+	for (uint32_t i = 0; i < LOOKUP_KEYS; i++) {
+		keys[0][i] %= LOOKUP_ITEMS;
+		keys[1][i] = i;
+	}
+	bench_fill_zipf(keys[2], LOOKUP_KEYS, LOOKUP_ITEMS, 0.99, 6);
+
+	lat = malloc(LOOKUP_KEYS / LOOKUP_SPAN * sizeof *lat);
+	mlist = malloc(members[NELEM(members) - 1] * sizeof *mlist);
+	if (lat == NULL || mlist == NULL)
+		abort();
+	for (uint32_t i = 0; i < members[NELEM(members) - 1]; i++) {
+		mlist[i].hm_member = i + 1;
+		mlist[i].hm_weightpct = 100;
+	}
+
+	printf("members\treplicas\tvnodes\thasher\tn\tpattern\tmlookups_s"
+	    "\tp50_ns\tp90_ns\tp99_ns\tp999_ns\tmax_ns\n");
+	for (unsigned m = 0; m < NELEM(members); m++) {
+		for (unsigned r = 0; r < NELEM(replicas); r++) {
+			for (unsigned h = 0; h < NELEM(hashers); h++) {
+				hash_ring_init(&hr, hashers[h].hash, NULL,
+				    replicas[r]);
+				buf = NULL;
+				sz = 0;
+				while ((sz = hash_ring_build(&hr, mlist,
+				    members[m], buf, sz)) != 0) {
+					buf = malloc(sz);
+					if (buf == NULL)
+						abort();
+				}
+
+				for (unsigned j = 0; j < NELEM(ns); j++) {
+					for (unsigned p = 0; p < NELEM(patterns);
+					    p++) {
+						printf("%u\t%u\t%zu\t%s\t%u\t%s",
+						    (unsigned)members[m],
+						    (unsigned)replicas[r],
+						    hr.hr_ring_used,
+						    hashers[h].name, ns[j],
+						    patterns[p]);
+						lookup_run(&hr, hashers[h].hash,
+						    keys[p], ns[j], lat);
+					}
+				}
+
+				hash_ring_clean(&hr);
+			}
+		}
+	}
+
+	free(mlist);
+	free(lat);
+	for (unsigned p = 0; p < NELEM(patterns); p++)
+		free(keys[p]);
+}
@@ -0,0 +1,640 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Mutation benchmarks.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench.h"
+#include "crc32c.h"
+#include "isi_hash.h"
+#include "MurmurHash3.h"
+#include "siphash24.h"
+
+#define NREPLICAS	256
+
+/* Sequential adds take too long past this many ring entries. */
+#define MAX_SEQ_VNODES	(64*1024)
+
+static void
+build_any(struct hash_ring *hr, const struct hr_member *members, size_t n)
+{
+	void *buf = NULL;
+	size_t sz = 0;
+
+	while ((sz = hash_ring_build(hr, members, n, buf, sz)) != 0) {
+		buf = malloc(sz);
+		if (buf == NULL)
+			abort();
+	}
+}
+
+/*
+ * Building a ring from scratch with hash_ring_add() for each member vs.
+ * hash_ring_build().
+ */
+void
+bench_build(void)
+{
+	const uint32_t nmembers[] = { 16, 64, 256, 1024, 4096, 16384 };
+	struct hr_member *members;
+	struct hash_ring hr;
+	uint64_t t0, t1;
+
+	printf("members\tvnodes\t\tadd ms\t\tbuild ms\n");
+	for (unsigned m = 0; m < NELEM(nmembers); m++) {
+		members = malloc(nmembers[m] * sizeof *members);
+		if (members == NULL)
+			abort();
+		for (uint32_t i = 0; i < nmembers[m]; i++) {
+			members[i].hm_member = i + 1;
+			members[i].hm_weightpct = 100;
+		}
+
+		printf("%u\t%-10zu\t", (unsigned)nmembers[m],
+		    (size_t)nmembers[m] * NREPLICAS);
+
+		if ((size_t)nmembers[m] * NREPLICAS <= MAX_SEQ_VNODES) {
+			hash_ring_init(&hr, bench_hash, NULL, NREPLICAS);
+			t0 = bench_now();
+			for (uint32_t i = 0; i < nmembers[m]; i++)
+				bench_add(&hr, members[i].hm_member, 100);
+			t1 = bench_now();
+			hash_ring_clean(&hr);
+			printf("%.2f\t\t", (double)(t1 - t0) / 1e6);
+		} else
+			printf("-\t\t");
+
+		hash_ring_init(&hr, bench_hash, NULL, NREPLICAS);
+		t0 = bench_now();
+		build_any(&hr, members, nmembers[m]);
+		t1 = bench_now();
+		hash_ring_clean(&hr);
+		printf("%.2f\n", (double)(t1 - t0) / 1e6);
+
+		free(members);
+	}
+}
+
+/*
+ * Adding one more member to rings of increasing size. The buffer the add
+ * asks for is allocated outside the timing, but the add still copies the
+ * ring into it.
+ */
+void
+bench_add_one(void)
+{
+	const uint32_t nmembers[] = { 64, 256, 1024, 4096, 16384 };
+	struct hr_member *members;
+	struct hash_ring hr;
+	uint64_t t0, t1;
+	void *buf;
+	size_t sz;
+
+	printf("members\tvnodes\t\tadd ms\n");
+	for (unsigned m = 0; m < NELEM(nmembers); m++) {
+		members = malloc(nmembers[m] * sizeof *members);
+		if (members == NULL)
+			abort();
+		for (uint32_t i = 0; i < nmembers[m]; i++) {
+			members[i].hm_member = i + 1;
+			members[i].hm_weightpct = 100;
+		}
+
+		hash_ring_init(&hr, bench_hash, NULL, NREPLICAS);
+		build_any(&hr, members, nmembers[m]);
+
+		sz = hash_ring_add(&hr, nmembers[m] + 1, 100, NULL, 0);
+		buf = malloc(sz);
+		if (buf == NULL)
+			abort();
+
+		t0 = bench_now();
+		if (hash_ring_add(&hr, nmembers[m] + 1, 100, buf, sz) != 0)
+			abort();
+		t1 = bench_now();
+
+		printf("%u\t%-10zu\t%.3f\n", (unsigned)nmembers[m],
+		    hr.hr_ring_used, (double)(t1 - t0) / 1e6);
+
+		hash_ring_clean(&hr);
+		free(members);
+	}
+}
+
+/*
+ * Removing one member from rings of increasing size: restoring the entries it
+ * shadowed vs. the old rehash of the whole ring, which remove() still falls
+ * back to when its shadow table overflowed.
+ */
+void
+bench_remove_one(void)
+{
+	const uint32_t nmembers[] = { 64, 256, 1024, 4096, 16384 };
+	struct hr_member *members;
+	struct hash_ring hr;
+	uint64_t t0, t1;
+	void *aux;
+	size_t sz;
+
+	printf("members\tvnodes\t\tremove ms\trehash ms\n");
+	for (unsigned m = 0; m < NELEM(nmembers); m++) {
+		members = malloc(nmembers[m] * sizeof *members);
+		if (members == NULL)
+			abort();
+		for (uint32_t i = 0; i < nmembers[m]; i++) {
+			members[i].hm_member = i + 1;
+			members[i].hm_weightpct = 100;
+		}
+
+		printf("%u\t%-10zu\t", (unsigned)nmembers[m],
+		    (size_t)nmembers[m] * NREPLICAS);
+
+		for (int fallback = 0; fallback < 2; fallback++) {
+			hash_ring_init(&hr, bench_hash, NULL, NREPLICAS);
+			build_any(&hr, members, nmembers[m]);
+			hr.hr_shadow_overflow = fallback;
+
+			sz = hash_ring_remove(&hr, nmembers[m] / 2, 0, NULL,
+			    0);
+			aux = malloc(sz);
+			if (aux == NULL)
+				abort();
+
+			t0 = bench_now();
+			if (hash_ring_remove(&hr, nmembers[m] / 2, 0, aux,
+			    sz) != 0)
+				abort();
+			t1 = bench_now();
+
+			printf("%.3f%s", (double)(t1 - t0) / 1e6,
+			    fallback ? "" : "\t\t");
+			hash_ring_clean(&hr);
+		}
+		printf("\n");
+
+		free(members);
+	}
+}
+
+static uint32_t
+isi32(const void *data, size_t len)
+{
+
+	return isi_hash32(data, len, 0);
+}
+
+static void
+isi32_vnodes(uint32_t member, uint32_t first, uint32_t n, uint32_t *out)
+{
+
+	isi_hash32_vnodes(member, first, n, 0, out);
+}
+
+static uint32_t
+mmh3_32(const void *data, size_t len)
+{
+	uint32_t res;
+
+	MurmurHash3_x86_32(data, (int)len, 0, &res);
+	return res;
+}
+
+static void
+mmh3_32_vnodes(uint32_t member, uint32_t first, uint32_t n, uint32_t *out)
+{
+
+	MurmurHash3_x86_32_vnodes(member, first, n, 0, out);
+}
+
+/*
+ * Hashing every vnode of a ring, and building it, with a hasher called per
+ * vnode vs. its batch version.
+ */
+void
+bench_build_vnodes(void)
+{
+	const struct {
+		const char		*name;
+		hr_hasher_t		 hash;
+		hr_vnode_hasher_t	 vnodes;
+	} hashers[] = {
+		{ "isi32", isi32, isi32_vnodes },
+		{ "mmh3_32", mmh3_32, mmh3_32_vnodes },
+	};
+	const uint32_t nmembers[] = { 1024, 16384 };
+	struct hr_member *members;
+	struct hash_ring hr;
+	uint64_t t0, t1;
+	uint32_t *out, sum;
+	uint8_t key[8];
+	size_t nvnodes;
+
+	printf("hasher\tmembers\tvnodes\t\thash ms\t\tbatch\t\t"
+	    "build ms\tbatch\n");
+	for (unsigned m = 0; m < NELEM(nmembers); m++) {
+		nvnodes = (size_t)nmembers[m] * NREPLICAS;
+		members = malloc(nmembers[m] * sizeof *members);
+		out = malloc(NREPLICAS * sizeof *out);
+		if (members == NULL || out == NULL)
+			abort();
+		for (uint32_t i = 0; i < nmembers[m]; i++) {
+			members[i].hm_member = i + 1;
+			members[i].hm_weightpct = 100;
+		}
+
+		for (unsigned h = 0; h < NELEM(hashers); h++) {
+			printf("%s\t%u\t%-10zu\t", hashers[h].name,
+			    (unsigned)nmembers[m], nvnodes);
+
+			sum = 0;
+			t0 = bench_now();
+			for (uint32_t i = 0; i < nmembers[m]; i++) {
+				memcpy(key, &members[i].hm_member, 4);
+				for (uint32_t r = 0; r < NREPLICAS; r++) {
+					memcpy(&key[4], &r, 4);
+					sum += hashers[h].hash(key, sizeof key);
+				}
+			}
+			t1 = bench_now();
+			printf("%.2f\t\t", (double)(t1 - t0) / 1e6);
+
+			t0 = bench_now();
+			for (uint32_t i = 0; i < nmembers[m]; i++) {
+				hashers[h].vnodes(members[i].hm_member, 0,
+				    NREPLICAS, out);
+				sum -= out[0];
+			}
+			t1 = bench_now();
+			printf("%.2f\t\t", (double)(t1 - t0) / 1e6);
+			if (sum == 0x12345678)
+				printf("!");
+
+			for (int batch = 0; batch < 2; batch++) {
+				hash_ring_init(&hr, hashers[h].hash, NULL,
+				    NREPLICAS);
+				if (batch)
+					hash_ring_set_vnode_hasher(&hr,
+					    hashers[h].vnodes);
+				t0 = bench_now();
+				build_any(&hr, members, nmembers[m]);
+				t1 = bench_now();
+				hash_ring_clean(&hr);
+				printf("%.2f%s", (double)(t1 - t0) / 1e6,
+				    batch ? "\n" : "\t\t");
+			}
+		}
+
+		free(out);
+		free(members);
+	}
+}
+
+static const uint64_t sipkey[2] = {
+	0xe276920babca796dULL,
+	0x443ef008123a77ceULL,
+};
+
+static uint32_t
+isi32_u32x2(const void *data, size_t len)
+{
+	uint32_t w0, w1;
+
+	if (len != 8)
+		return isi_hash32(data, len, 0);
+	memcpy(&w0, data, 4);
+	memcpy(&w1, (const uint8_t *)data + 4, 4);
+	return isi_hash32_u32x2(w0, w1, 0);
+}
+
+static uint32_t
+mmh3_32_u32x2(const void *data, size_t len)
+{
+	uint32_t w0, w1;
+
+	if (len != 8)
+		return mmh3_32(data, len);
+	memcpy(&w0, data, 4);
+	memcpy(&w1, (const uint8_t *)data + 4, 4);
+	return MurmurHash3_x86_32_u32x2(w0, w1, 0);
+}
+
+static uint32_t
+sip(const void *data, size_t len)
+{
+
+	return (uint32_t)siphash24(data, len, sipkey);
+}
+
+static uint32_t
+sip_u32x2(const void *data, size_t len)
+{
+	uint32_t w0, w1;
+
+	if (len != 8)
+		return sip(data, len);
+	memcpy(&w0, data, 4);
+	memcpy(&w1, (const uint8_t *)data + 4, 4);
+	return (uint32_t)siphash24_u32x2(w0, w1, sipkey);
+}
+
+/*
+ * Ring-position (8-byte) hashes, and building a ring, with the generic
+ * length-driven hashers vs. their fixed-width *_u32x2 kernels.
+ */
+void
+bench_hash_u32x2(void)
+{
+	const struct {
+		const char	*name;
+		hr_hasher_t	 hash[2];
+	} hashers[] = {
+		{ "isi32", { isi32, isi32_u32x2 } },
+		{ "mmh3_32", { mmh3_32, mmh3_32_u32x2 } },
+		{ "siphash", { sip, sip_u32x2 } },
+	};
+	const uint32_t nmembers = 4096, nhashes = 1 << 24;
+	struct hr_member *members;
+	struct hash_ring hr;
+	uint64_t t0, t1;
+	uint32_t sum = 0;
+	uint8_t key[8];
+
+	members = malloc(nmembers * sizeof *members);
+	if (members == NULL)
+		abort();
+	for (uint32_t i = 0; i < nmembers; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+
+	printf("hasher\tns/hash\tu32x2\tbuild ms (%u members)\tu32x2\n",
+	    (unsigned)nmembers);
+	for (unsigned h = 0; h < NELEM(hashers); h++) {
+		printf("%s", hashers[h].name);
+		for (int fixed = 0; fixed < 2; fixed++) {
+			t0 = bench_now();
+			for (uint32_t i = 0; i < nhashes; i++) {
+				memcpy(key, &i, 4);
+				memcpy(&key[4], &h, 4);
+				sum += hashers[h].hash[fixed](key, sizeof key);
+			}
+			t1 = bench_now();
+			printf("\t%.2f", (double)(t1 - t0) / nhashes);
+		}
+		for (int fixed = 0; fixed < 2; fixed++) {
+			hash_ring_init(&hr, hashers[h].hash[fixed], NULL,
+			    NREPLICAS);
+			t0 = bench_now();
+			build_any(&hr, members, nmembers);
+			t1 = bench_now();
+			hash_ring_clean(&hr);
+			printf("\t%.2f%s", (double)(t1 - t0) / 1e6,
+			    fixed ? "\n" : "\t\t");
+		}
+	}
+	if (sum == 0x12345678)
+		printf("!\n");
+
+	free(members);
+}
+
+static uint32_t
+crc32c_table(const void *vdata, size_t len)
+{
+	const uint8_t *data = vdata;
+	uint32_t crc = ~(uint32_t)0;
+
+	for (size_t i = 0; i < len; i++)
+		CRC32C(crc, data[i]);
+	return __builtin_bswap32(crc);
+}
+
+static uint32_t
+crc32c_slice8(const void *data, size_t len)
+{
+
+	return __builtin_bswap32(crc32c_sw(~(uint32_t)0, data, len));
+}
+
+/*
+ * CRC32C a byte at a time through crc_c, slice-by-8, and crc32c_hasher()
+ * (SSE4.2 where available), and building a ring with each.
+ */
+void
+bench_crc32c(void)
+{
+	const struct {
+		const char	*name;
+		hr_hasher_t	 hash;
+	} hashers[] = {
+		{ "table", crc32c_table },
+		{ "slice8", crc32c_slice8 },
+		{ "hasher", crc32c_hasher },
+	};
+	const size_t lens[] = { 8, 64 };
+	const uint32_t nmembers = 4096, nhashes = 1 << 22;
+	struct hr_member *members;
+	struct hash_ring hr;
+	uint64_t t0, t1;
+	uint32_t sum = 0;
+	uint8_t key[64];
+
+	members = malloc(nmembers * sizeof *members);
+	if (members == NULL)
+		abort();
+	for (uint32_t i = 0; i < nmembers; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+	memset(key, 0x5a, sizeof key);
+
+	printf("crc32c\tns/8B\tns/64B\tbuild ms (%u members)\n",
+	    (unsigned)nmembers);
+	for (unsigned h = 0; h < NELEM(hashers); h++) {
+		printf("%s", hashers[h].name);
+		for (unsigned l = 0; l < NELEM(lens); l++) {
+			t0 = bench_now();
+			for (uint32_t i = 0; i < nhashes; i++) {
+				memcpy(key, &i, 4);
+				sum += hashers[h].hash(key, lens[l]);
+			}
+			t1 = bench_now();
+			printf("\t%.2f", (double)(t1 - t0) / nhashes);
+		}
+
+		hash_ring_init(&hr, hashers[h].hash, NULL, NREPLICAS);
+		t0 = bench_now();
+		build_any(&hr, members, nmembers);
+		t1 = bench_now();
+		hash_ring_clean(&hr);
+		printf("\t%.2f\n", (double)(t1 - t0) / 1e6);
+	}
+	if (sum == 0x12345678)
+		printf("!\n");
+
+	free(members);
+}
+
+/* What a ring asked of its allocator. */
+struct mutate_stats {
+	uint64_t	ms_allocs;
+	uint64_t	ms_bytes;	/* requested by alloc and realloc */
+	uint64_t	ms_moved;	/* old sizes of realloc'd blocks */
+};
+
+static void *
+mutate_alloc(void *ctx, size_t sz)
+{
+	struct mutate_stats *ms = ctx;
+
+	ms->ms_allocs++;
+	ms->ms_bytes += sz;
+	return malloc(sz);
+}
+
+static void *
+mutate_realloc(void *ctx, void *p, size_t oldsz, size_t sz)
+{
+	struct mutate_stats *ms = ctx;
+
+	ms->ms_allocs++;
+	ms->ms_bytes += sz;
+	ms->ms_moved += oldsz;
+	return realloc(p, sz);
+}
+
+static void
+mutate_free(void *ctx, void *p)
+{
+
+	(void)ctx;
+	free(p);
+}
+
+enum mutate_op {
+	MUT_ADD, MUT_REMOVE, MUT_WEIGHT_DOWN, MUT_WEIGHT_UP, MUT_COPY,
+	MUT_BULK_ADD, MUT_BULK_REMOVE, MUT_REHASH,
+};
+
+static const char *mutate_ops[] = {
+	"add", "remove", "weight_down", "weight_up", "copy", "bulk_add",
+	"bulk_remove", "rehash",
+};
+
+/*
+ * Run @op on @hr (@count times for the bulk ops), and print its row. Members
+ * 1..@nmembers are in the ring at full weight beforehand, and again after
+ * each op but MUT_REHASH.
+ */
+static void
+mutate_run(struct hash_ring *hr, struct mutate_stats *ms, uint32_t nmembers,
+    enum mutate_op op, uint32_t count)
+{
+	struct mutate_stats before = *ms;
+	struct hash_ring copy;
+	uint64_t t0, t1;
+	size_t rc = 0;
+
+	if (op != MUT_BULK_ADD && op != MUT_BULK_REMOVE)
+		count = 1;
+
+	t0 = bench_now();
+	switch (op) {
+	case MUT_ADD:
+		rc = hash_ring_add(hr, nmembers + 1, 100, NULL, 0);
+		break;
+	case MUT_REMOVE:
+		rc = hash_ring_remove(hr, nmembers + 1, 0, NULL, 0);
+		break;
+	case MUT_WEIGHT_DOWN:
+		rc = hash_ring_remove(hr, 1, 50, NULL, 0);
+		break;
+	case MUT_WEIGHT_UP:
+		rc = hash_ring_add(hr, 1, 100, NULL, 0);
+		break;
+	case MUT_COPY:
+		rc = hash_ring_copy(&copy, hr, NULL, 0);
+		break;
+	case MUT_BULK_ADD:
+		for (uint32_t i = 1; i <= count && rc == 0; i++)
+			rc = hash_ring_add(hr, nmembers + i, 100, NULL, 0);
+		break;
+	case MUT_BULK_REMOVE:
+		for (uint32_t i = 1; i <= count && rc == 0; i++)
+			rc = hash_ring_remove(hr, nmembers + i, 0, NULL, 0);
+		break;
+	case MUT_REHASH:
+		hr->hr_shadow_overflow = true;
+		rc = hash_ring_remove(hr, 1, 0, NULL, 0);
+		break;
+	}
+	t1 = bench_now();
+	if (rc != 0)
+		abort();
+	if (op == MUT_COPY)
+		hash_ring_clean(&copy);
+
+	printf("%u\t%u\t%zu\t%s\t%u\t%.4f\t%.2f\t%.0f\t%.0f\n",
+	    (unsigned)nmembers, (unsigned)hr->hr_nreplicas, hr->hr_ring_used,
+	    mutate_ops[op], (unsigned)count,
+	    (double)(t1 - t0) / 1e6 / count,
+	    (double)(ms->ms_allocs - before.ms_allocs) / count,
+	    (double)(ms->ms_bytes - before.ms_bytes) / count,
+	    (double)(ms->ms_moved - before.ms_moved) / count);
+}
+
+/*
+ * Single and bulk adds and removes, weight changes, copies and the rehash
+ * fallback of remove(), over member and replica counts, through a counting
+ * allocator. One tab-separated row per op: ms, allocations and bytes
+ * allocated per op, and the bytes realloc() may have had to move. Bulk ops
+ * add (then remove) 1% of the members, one at a time.
+ */
+void
+bench_mutate(void)
+{
+	const uint32_t nmembers[] = { 100, 1000, 10000 };
+	const uint32_t replicas[] = { 16, 256, 1024 };
+	struct mutate_stats ms;
+	const struct hr_allocator alloc = {
+		mutate_alloc, mutate_realloc, mutate_free, &ms
+	};
+	struct hr_member *members;
+	struct hash_ring hr;
+
+	members = malloc(nmembers[NELEM(nmembers) - 1] * sizeof *members);
+	if (members == NULL)
+		abort();
+	for (uint32_t i = 0; i < nmembers[NELEM(nmembers) - 1]; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+
+	printf("members\treplicas\tvnodes\top\tcount\tms_op\tallocs_op"
+	    "\tbytes_op\tmoved_op\n");
+	for (unsigned m = 0; m < NELEM(nmembers); m++) {
+		for (unsigned r = 0; r < NELEM(replicas); r++) {
+			hash_ring_init_alloc(&hr, bench_hash, &alloc,
+			    replicas[r]);
+			if (hash_ring_build(&hr, members, nmembers[m], NULL,
+			    0) != 0)
+				abort();
+
+			memset(&ms, 0, sizeof ms);
+			for (unsigned op = 0; op < NELEM(mutate_ops); op++)
+				mutate_run(&hr, &ms, nmembers[m], op,
+				    nmembers[m] / 100);
+
+			hash_ring_clean(&hr);
+		}
+	}
+
+	free(members);
+}
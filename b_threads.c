@@ -0,0 +1,420 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Multi-threaded lookup benchmarks.
+ */
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "bench.h"
+#include "hashring_numa.h"
+#include "hashring_pool.h"
+#include "hashring_rcu.h"
+#include "hashring_seq.h"
+
+#define NMEMBERS	256
+#define NREPLICAS	256
+#define RUN_NS		(200*1000*1000)
+#define WRITE_NS	(1000*1000)	/* between writer updates */
+
+enum scale_mode { SCALE_RWLOCK, SCALE_RCU, SCALE_SEQ };
+
+struct scale_run {
+	enum scale_mode		 sr_mode;
+	struct hash_ring	 sr_ring;	/* SCALE_RWLOCK */
+	pthread_rwlock_t	 sr_lock;
+	struct hash_ring_rcu	 sr_rcu;	/* SCALE_RCU */
+	struct hash_ring_seq	 sr_seq;	/* SCALE_SEQ */
+	volatile bool		 sr_stop;
+	unsigned long		 sr_lookups;
+	unsigned		 sr_writes;
+};
+
+static void *
+scale_reader(void *arg)
+{
+	struct scale_run *sr = arg;
+	struct hr_rcu_reader rd;
+	unsigned long lookups = 0;
+	uint64_t st = (uintptr_t)&rd | 1;
+	uint32_t out[3];
+
+	if (sr->sr_mode == SCALE_RCU)
+		hash_ring_rcu_register(&sr->sr_rcu, &rd);
+
+	while (!sr->sr_stop) {
+		for (unsigned i = 0; i < 256; i++) {
+			uint32_t hash = bench_rand(&st);
+
+			if (sr->sr_mode == SCALE_RCU) {
+				if (hash_ring_rcu_getn(&sr->sr_rcu, &rd, hash,
+				    3, out))
+					abort();
+			} else if (sr->sr_mode == SCALE_SEQ) {
+				if (hash_ring_seq_getn(&sr->sr_seq, hash, 3,
+				    out))
+					abort();
+			} else {
+				pthread_rwlock_rdlock(&sr->sr_lock);
+				if (hash_ring_getn(&sr->sr_ring, hash, 3, out))
+					abort();
+				pthread_rwlock_unlock(&sr->sr_lock);
+			}
+		}
+		lookups += 256;
+	}
+
+	if (sr->sr_mode == SCALE_RCU)
+		hash_ring_rcu_unregister(&sr->sr_rcu, &rd);
+	__atomic_add_fetch(&sr->sr_lookups, lookups, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* Adds and removes a member every WRITE_NS until told to stop. */
+static void *
+scale_writer(void *arg)
+{
+	struct scale_run *sr = arg;
+	const struct timespec ts = { 0, WRITE_NS };
+	uint32_t member = NMEMBERS + 1;
+	void *buf;
+	size_t sz;
+	bool add;
+
+	for (unsigned i = 0; !sr->sr_stop; i++) {
+		nanosleep(&ts, NULL);
+		add = (i % 2 == 0);
+
+		if (sr->sr_mode == SCALE_RCU) {
+			if ((add ? hash_ring_rcu_add(&sr->sr_rcu, member, 100) :
+			    hash_ring_rcu_remove(&sr->sr_rcu, member, 0)) != 0)
+				abort();
+		} else if (sr->sr_mode == SCALE_SEQ) {
+			if ((add ? hash_ring_seq_add(&sr->sr_seq, member, 100) :
+			    hash_ring_seq_remove(&sr->sr_seq, member, 0)) != 0)
+				abort();
+		} else {
+			/* Size the buffer outside the lock, as a caller would. */
+			sz = add ? hash_ring_add(&sr->sr_ring, member, 100,
+			    NULL, 0) : hash_ring_remove(&sr->sr_ring, member, 0,
+			    NULL, 0);
+			buf = sz != 0 ? malloc(sz) : NULL;
+			pthread_rwlock_wrlock(&sr->sr_lock);
+			if ((add ? hash_ring_add(&sr->sr_ring, member, 100, buf,
+			    sz) : hash_ring_remove(&sr->sr_ring, member, 0,
+			    buf, sz)) != 0)
+				abort();
+			pthread_rwlock_unlock(&sr->sr_lock);
+		}
+		sr->sr_writes++;
+	}
+	return NULL;
+}
+
+/* Million lookups per second from @nthreads readers, and how many writes. */
+static double
+scale_one(enum scale_mode mode, unsigned nthreads, bool writer,
+    const struct hr_member *members, unsigned *writes)
+{
+	struct scale_run *sr;
+	pthread_t *tids, wtid;
+	const struct timespec ts = { RUN_NS / 1000000000, RUN_NS % 1000000000 };
+	uint64_t t0, t1;
+	double mops;
+	void *buf;
+	size_t sz;
+
+	sr = calloc(1, sizeof *sr);
+	tids = malloc(nthreads * sizeof *tids);
+	if (sr == NULL || tids == NULL)
+		abort();
+	sr->sr_mode = mode;
+	if (mode == SCALE_RCU) {
+		if (hash_ring_rcu_init(&sr->sr_rcu, bench_hash, NREPLICAS) ||
+		    hash_ring_rcu_build(&sr->sr_rcu, members, NMEMBERS))
+			abort();
+	} else if (mode == SCALE_SEQ) {
+		/* Room for the writer's member, so it never grows the ring. */
+		if (hash_ring_seq_init(&sr->sr_seq, bench_hash, NREPLICAS) ||
+		    hash_ring_seq_reserve(&sr->sr_seq, NMEMBERS + 1) ||
+		    hash_ring_seq_build(&sr->sr_seq, members, NMEMBERS))
+			abort();
+	} else {
+		hash_ring_init(&sr->sr_ring, bench_hash, NULL, NREPLICAS);
+		sz = hash_ring_build(&sr->sr_ring, members, NMEMBERS, NULL, 0);
+		buf = malloc(sz);
+		if (buf == NULL || hash_ring_build(&sr->sr_ring, members,
+		    NMEMBERS, buf, sz) != 0)
+			abort();
+		pthread_rwlock_init(&sr->sr_lock, NULL);
+	}
+
+	t0 = bench_now();
+	for (unsigned i = 0; i < nthreads; i++)
+		if (pthread_create(&tids[i], NULL, scale_reader, sr) != 0)
+			abort();
+	if (writer && pthread_create(&wtid, NULL, scale_writer, sr) != 0)
+		abort();
+	nanosleep(&ts, NULL);
+	sr->sr_stop = true;
+	for (unsigned i = 0; i < nthreads; i++)
+		pthread_join(tids[i], NULL);
+	if (writer)
+		pthread_join(wtid, NULL);
+	t1 = bench_now();
+
+	mops = sr->sr_lookups * 1e3 / (double)(t1 - t0);
+	*writes = sr->sr_writes;
+
+	if (mode == SCALE_RCU)
+		hash_ring_rcu_clean(&sr->sr_rcu);
+	else if (mode == SCALE_SEQ)
+		hash_ring_seq_clean(&sr->sr_seq);
+	else {
+		hash_ring_clean(&sr->sr_ring);
+		pthread_rwlock_destroy(&sr->sr_lock);
+	}
+	free(tids);
+	free(sr);
+	return mops;
+}
+
+/*
+ * getn(n=3) from 1 to (online CPUs) reader threads, under a pthread rwlock
+ * vs. from RCU snapshots vs. under a sequence lock, with and without a writer
+ * updating the ring every millisecond. Tab-separated, one row per
+ * configuration.
+ */
+void
+bench_rcu_scaling(void)
+{
+	const char *modes[] = { "rwlock", "rcu", "seqlock" };
+	struct hr_member *members;
+	unsigned ncpu, writes;
+	double mops;
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	ncpu = n > 0 ? (unsigned)n : 1;
+
+	members = malloc(NMEMBERS * sizeof *members);
+	if (members == NULL)
+		abort();
+	for (uint32_t i = 0; i < NMEMBERS; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+
+	printf("mode\tthreads\twriter\tmlookups_s\tper_thread\twrites\n");
+	for (unsigned t = 1; ; t = (t * 2 > ncpu && t < ncpu) ? ncpu : t * 2) {
+		for (int w = 0; w < 2; w++) {
+			for (unsigned m = 0; m < NELEM(modes); m++) {
+				mops = scale_one(m, t, w, members, &writes);
+				printf("%s\t%u\t%d\t%.2f\t%.2f\t%u\n", modes[m],
+				    t, w, mops, mops / t, writes);
+			}
+		}
+		if (t >= ncpu)
+			break;
+	}
+
+	free(members);
+}
+
+static void *
+par_alloc(void *ctx, size_t sz)
+{
+
+	(void)ctx;
+	return malloc(sz);
+}
+
+static void
+par_free(void *ctx, void *p)
+{
+
+	(void)ctx;
+	free(p);
+}
+
+static const struct hr_allocator par_allocator = {
+	par_alloc, NULL, par_free, NULL
+};
+
+/*
+ * hash_ring_build() of large rings, serially and with 2 to (online CPUs)
+ * workers; at least 2, so that the parallel path is measured even on one CPU.
+ * Tab-separated, one row per configuration.
+ */
+void
+bench_build_parallel(void)
+{
+	const uint32_t nmembers[] = { 5000, 50000 };
+	const uint32_t nreplicas = 512;
+	struct hash_ring_pool pool;
+	struct hr_member *members;
+	struct hash_ring hr;
+	unsigned ncpu, maxw;
+	uint64_t t0, t1;
+	double ms, serial = 0;
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	ncpu = n > 0 ? (unsigned)n : 1;
+	maxw = ncpu < 2 ? 2 : ncpu;
+
+	printf("members\treplicas\tentries\tworkers\tms\tspeedup\n");
+	for (unsigned m = 0; m < NELEM(nmembers); m++) {
+		members = malloc(nmembers[m] * sizeof *members);
+		if (members == NULL)
+			abort();
+		for (uint32_t i = 0; i < nmembers[m]; i++) {
+			members[i].hm_member = i + 1;
+			members[i].hm_weightpct = 100;
+		}
+
+		for (unsigned w = 1; ; w = (w * 2 > maxw && w < maxw) ?
+		    maxw : w * 2) {
+			if (hash_ring_pool_init(&pool, w) != 0)
+				abort();
+			hash_ring_init_alloc(&hr, bench_hash, &par_allocator,
+			    nreplicas);
+			hash_ring_set_workers(&hr, hash_ring_pool_workers(&pool));
+
+			t0 = bench_now();
+			if (hash_ring_build(&hr, members, nmembers[m], NULL,
+			    0) != 0)
+				abort();
+			t1 = bench_now();
+
+			ms = (double)(t1 - t0) / 1e6;
+			if (w == 1)
+				serial = ms;
+			printf("%u\t%u\t%zu\t%u\t%.1f\t%.2f\n",
+			    (unsigned)nmembers[m], nreplicas,
+			    (size_t)nmembers[m] * nreplicas, w, ms, serial / ms);
+
+			hash_ring_clean(&hr);
+			hash_ring_pool_clean(&pool);
+			if (w >= maxw)
+				break;
+		}
+		free(members);
+	}
+}
+
+#define NUMA_MEMBERS	4096	/* 8 MB of ring, so lookups miss in cache */
+
+struct numa_run {
+	struct hash_ring_numa	*nr_ring;
+	bool			 nr_shared;	/* Everyone reads node 0's */
+	volatile bool		 nr_stop;
+	unsigned		 nr_next;	/* Node for the next reader */
+	unsigned long		 nr_lookups;
+};
+
+static void *
+numa_reader(void *arg)
+{
+	struct numa_run *nr = arg;
+	struct hr_numa_reader rd;
+	unsigned long lookups = 0;
+	uint64_t st = (uintptr_t)&rd | 1;
+	uint32_t out[3];
+	unsigned node;
+
+	node = __atomic_fetch_add(&nr->nr_next, 1, __ATOMIC_RELAXED) %
+	    hash_ring_numa_nnodes(nr->nr_ring);
+	if (hash_ring_numa_bind(nr->nr_ring, node) != 0)
+		abort();
+	hash_ring_numa_register(nr->nr_ring, &rd, nr->nr_shared ? 0 :
+	    hash_ring_numa_node(nr->nr_ring));
+
+	while (!nr->nr_stop) {
+		for (unsigned i = 0; i < 256; i++)
+			if (hash_ring_numa_getn(nr->nr_ring, &rd,
+			    bench_rand(&st), 3, out) != 0)
+				abort();
+		lookups += 256;
+	}
+
+	hash_ring_numa_unregister(nr->nr_ring, &rd);
+	__atomic_add_fetch(&nr->nr_lookups, lookups, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/*
+ * getn(n=3) from 1 to (online CPUs) reader threads, bound to NUMA nodes in
+ * turn, all reading one copy of the ring (node 0's) vs. each reading its own
+ * node's. Tab-separated, one row per configuration. With one node, both read
+ * the same memory.
+ */
+void
+bench_numa(void)
+{
+	const char *modes[] = { "shared", "replicated" };
+	const struct timespec ts = { RUN_NS / 1000000000, RUN_NS % 1000000000 };
+	struct hash_ring_numa ring;
+	struct hr_member *members;
+	struct numa_run *nr;
+	pthread_t *tids;
+	unsigned ncpu;
+	uint64_t t0, t1;
+	double mops;
+	long n;
+
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+	ncpu = n > 0 ? (unsigned)n : 1;
+
+	members = malloc(NUMA_MEMBERS * sizeof *members);
+	tids = malloc(ncpu * sizeof *tids);
+	nr = calloc(1, sizeof *nr);
+	if (members == NULL || tids == NULL || nr == NULL)
+		abort();
+	for (uint32_t i = 0; i < NUMA_MEMBERS; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+	if (hash_ring_numa_init(&ring, bench_hash, NREPLICAS, 0) != 0 ||
+	    hash_ring_numa_build(&ring, members, NUMA_MEMBERS) != 0)
+		abort();
+
+	printf("mode\tthreads\tnodes\tmlookups_s\tper_thread\n");
+	for (unsigned t = 1; ; t = (t * 2 > ncpu && t < ncpu) ? ncpu : t * 2) {
+		for (unsigned m = 0; m < NELEM(modes); m++) {
+			nr->nr_ring = &ring;
+			nr->nr_shared = (m == 0);
+			nr->nr_stop = false;
+			nr->nr_next = 0;
+			nr->nr_lookups = 0;
+
+			t0 = bench_now();
+			for (unsigned i = 0; i < t; i++)
+				if (pthread_create(&tids[i], NULL, numa_reader,
+				    nr) != 0)
+					abort();
+			nanosleep(&ts, NULL);
+			nr->nr_stop = true;
+			for (unsigned i = 0; i < t; i++)
+				pthread_join(tids[i], NULL);
+			t1 = bench_now();
+
+			mops = nr->nr_lookups * 1e3 / (double)(t1 - t0);
+			printf("%s\t%u\t%u\t%.2f\t%.2f\n", modes[m], t,
+			    hash_ring_numa_nnodes(&ring), mops, mops / t);
+		}
+		if (t >= ncpu)
+			break;
+	}
+
+	hash_ring_numa_clean(&ring);
+	free(nr);
+	free(tids);
+	free(members);
+}
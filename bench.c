@@ -0,0 +1,177 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Microbenchmark driver. Run all benchmarks, or only those named on the
+ * command line.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "bench.h"
+
+static const struct bench {
+	const char	*name;
+	void		(*fn)(void);
+} benchmarks[] = {
+	{ "getn_batch", bench_getn_batch },
+	{ "getn_index", bench_getn_index },
+	{ "getn_succ", bench_getn_succ },
+	{ "getn_preflist", bench_getn_preflist },
+	{ "lookup", bench_lookup },
+	{ "build", bench_build },
+	{ "add_one", bench_add_one },
+	{ "remove_one", bench_remove_one },
+	{ "build_vnodes", bench_build_vnodes },
+	{ "hash_u32x2", bench_hash_u32x2 },
+	{ "crc32c", bench_crc32c },
+	{ "mutate", bench_mutate },
+	{ "rcu_scaling", bench_rcu_scaling },
+	{ "build_parallel", bench_build_parallel },
+	{ "numa", bench_numa },
+};
+
+uint64_t
+bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+uint32_t
+bench_rand(uint64_t *state)
+{
+	uint64_t x = *state;
+
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*state = x;
+	return (x * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+void
+bench_fill_keys(uint32_t *keys, size_t nkeys, uint64_t seed)
+{
+	uint64_t st = seed | 1;
+
+	for (size_t i = 0; i < nkeys; i++)
+		keys[i] = bench_rand(&st);
+}
+
+void
+bench_fill_zipf(uint32_t *keys, size_t nkeys, uint32_t nitems, double theta,
+    uint64_t seed)
+{
+	uint64_t st = seed | 1;
+	double zetan = 0, zeta2, alpha, eta, u, uz;
+
+	/* Gray et al., "Quickly Generating Billion-Record Synthetic Databases" */
+	for (uint32_t i = 1; i <= nitems; i++)
+		zetan += 1 / pow(i, theta);
+	zeta2 = 1 + 1 / pow(2, theta);
+	alpha = 1 / (1 - theta);
+	eta = (1 - pow(2.0 / nitems, 1 - theta)) / (1 - zeta2 / zetan);
+
+	for (size_t i = 0; i < nkeys; i++) {
+		u = (double)bench_rand(&st) / ((double)UINT32_MAX + 1);
+		uz = u * zetan;
+		if (uz < 1)
+			keys[i] = 0;
+		else if (uz < zeta2)
+			keys[i] = 1;
+		else
+			keys[i] = (uint32_t)(nitems *
+			    pow(eta * u - eta + 1, alpha));
+		if (keys[i] >= nitems)
+			keys[i] = nitems - 1;
+	}
+}
+
+void
+bench_fill_ring(struct hash_ring *h, size_t nvnodes, uint32_t nmembers)
+{
+	uint64_t st = 0x9e3779b97f4a7c15ULL, step;
+	bool *seen;
+
+	h->hr_ring_hash = malloc(nvnodes * 2 * sizeof h->hr_ring_hash[0]);
+	if (h->hr_ring_hash == NULL)
+		abort();
+	h->hr_ring_value = &h->hr_ring_hash[nvnodes];
+	h->hr_ring_used = h->hr_ring_capacity = nvnodes;
+
+	/* One entry at a random offset in each of nvnodes equal arcs. */
+	step = ((uint64_t)UINT32_MAX + 1) / nvnodes;
+	seen = calloc(nmembers + 1, 1);
+	if (seen == NULL)
+		abort();
+	for (size_t i = 0; i < nvnodes; i++) {
+		uint32_t m = bench_rand(&st) % nmembers + 1;
+
+		h->hr_ring_hash[i] = i * step + bench_rand(&st) % step;
+		h->hr_ring_value[i] = (100U << 24) | m;
+		if (!seen[m])
+			h->hr_nmembers++;
+		seen[m] = true;
+	}
+	free(seen);
+}
+
+uint32_t
+bench_hash(const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint32_t h = 2166136261U;
+
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ p[i]) * 16777619U;
+
+	h ^= h >> 16;
+	h *= 0x85ebca6b;
+	h ^= h >> 13;
+	h *= 0xc2b2ae35;
+	h ^= h >> 16;
+	return h;
+}
+
+void
+bench_add(struct hash_ring *h, uint32_t member, unsigned weightpct)
+{
+	void *buf = NULL;
+	size_t sz = 0;
+
+	while ((sz = hash_ring_add(h, member, weightpct, buf, sz)) != 0) {
+		buf = malloc(sz);
+		if (buf == NULL)
+			abort();
+	}
+}
+
+int
+main(int argc, char **argv)
+{
+
+	for (unsigned i = 0; i < NELEM(benchmarks); i++) {
+		bool run = (argc < 2);
+
+		for (int a = 1; a < argc; a++)
+			if (strcmp(argv[a], benchmarks[i].name) == 0)
+				run = true;
+		if (!run)
+			continue;
+
+		printf("== %s\n", benchmarks[i].name);
+		benchmarks[i].fn();
+		printf("\n");
+	}
+
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,60 @@
+#ifndef _BENCH_H
+#define _BENCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "hashring.h"
+
+#define NELEM(a) ((sizeof(a))/(sizeof((a)[0])))
+
+/* Monotonic time in nanoseconds. */
+uint64_t	bench_now(void);
+
+/* xorshift64*; fast enough that key generation doesn't skew timings. */
+uint32_t	bench_rand(uint64_t *state);
+void		bench_fill_keys(uint32_t *keys, size_t nkeys, uint64_t seed);
+
+/*
+ * Fill @keys with item numbers in [0, @nitems), Zipf-distributed with
+ * skew @theta (0 < @theta < 1; YCSB uses 0.99). Item 0 is the hottest.
+ */
+void		bench_fill_zipf(uint32_t *keys, size_t nkeys, uint32_t nitems,
+				double theta, uint64_t seed);
+
+/*
+ * Fill an initialized, empty @h with @nvnodes uniformly distributed ring
+ * entries belonging to @nmembers members, without paying for @nvnodes
+ * hash_ring_add() insertions.
+ */
+void		bench_fill_ring(struct hash_ring *h, size_t nvnodes,
+				uint32_t nmembers);
+
+/*
+ * A quick, well-mixed hasher (FNV-1a with a murmur finalizer), for benchmarks
+ * which build rings with hash_ring_add().
+ */
+uint32_t	bench_hash(const void *data, size_t len);
+
+/* hash_ring_add(), allocating as needed; aborts on failure. */
+void		bench_add(struct hash_ring *h, uint32_t member,
+			  unsigned weightpct);
+
+/* Individual benchmarks */
+void	bench_getn_batch(void);
+void	bench_getn_index(void);
+void	bench_getn_succ(void);
+void	bench_getn_preflist(void);
+void	bench_lookup(void);
+void	bench_build(void);
+void	bench_add_one(void);
+void	bench_remove_one(void);
+void	bench_build_vnodes(void);
+void	bench_hash_u32x2(void);
+void	bench_crc32c(void);
+void	bench_mutate(void);
+void	bench_rcu_scaling(void);
+void	bench_build_parallel(void);
+void	bench_numa(void);
+
+#endif
@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * CRC32C (Castagnoli), with the SSE4.2 crc32 instruction where the CPU has
+ * it and slice-by-8 tables where it doesn't.
+ */
+
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "crc32c.h"
+
+#if defined(__GNUC__) && defined(__x86_64__)
+# include <immintrin.h>
+# define CRC32C_SSE42	1
+#endif
+
+/*
+ * crc_c8[k][b] is the CRC of byte b followed by k zero bytes, so eight
+ * lookups advance the CRC over eight bytes at once.  crc_c8[0] is crc_c.
+ */
+static uint32_t crc_c8[8][256];
+static pthread_once_t crc_c8_once = PTHREAD_ONCE_INIT;
+
+static void
+crc32c_init_tables(void)
+{
+	uint32_t crc;
+
+	for (unsigned b = 0; b < 256; b++) {
+		crc = crc_c[b];
+		crc_c8[0][b] = crc;
+		for (unsigned k = 1; k < 8; k++) {
+			crc = (crc >> 8) ^ crc_c[crc & 0xff];
+			crc_c8[k][b] = crc;
+		}
+	}
+}
+
+static inline uint64_t
+le64load(const uint8_t *p)
+{
+
+	return (uint64_t)p[0] | (uint64_t)p[1] << 8 |
+	    (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24 |
+	    (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 |
+	    (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+/**
+ * Slice-by-8 CRC32C.  Same contract as crc32c().
+ */
+uint32_t
+crc32c_sw(uint32_t crc, const void *data, size_t len)
+{
+	const uint8_t *p = data;
+	uint64_t w;
+
+	pthread_once(&crc_c8_once, crc32c_init_tables);
+
+	for (; len >= 8; p += 8, len -= 8) {
+		w = le64load(p) ^ crc;
+		crc = crc_c8[7][w & 0xff] ^
+		    crc_c8[6][(w >> 8) & 0xff] ^
+		    crc_c8[5][(w >> 16) & 0xff] ^
+		    crc_c8[4][(w >> 24) & 0xff] ^
+		    crc_c8[3][(w >> 32) & 0xff] ^
+		    crc_c8[2][(w >> 40) & 0xff] ^
+		    crc_c8[1][(w >> 48) & 0xff] ^
+		    crc_c8[0][w >> 56];
+	}
+	for (; len > 0; p++, len--)
+		CRC32C(crc, *p);
+
+	return crc;
+}
+
+#ifdef CRC32C_SSE42
+__attribute__((__target__("sse4.2")))
+static uint32_t
+crc32c_sse42(uint32_t crc, const uint8_t *p, size_t len)
+{
+	uint64_t crc64 = crc, w;
+
+	for (; len >= 8; p += 8, len -= 8) {
+		memcpy(&w, p, sizeof w);
+		crc64 = _mm_crc32_u64(crc64, w);
+	}
+	crc = (uint32_t)crc64;
+	if (len >= 4) {
+		uint32_t w32;
+
+		memcpy(&w32, p, sizeof w32);
+		crc = _mm_crc32_u32(crc, w32);
+		p += 4;
+		len -= 4;
+	}
+	for (; len > 0; p++, len--)
+		crc = _mm_crc32_u8(crc, *p);
+
+	return crc;
+}
+
+/*
+ * Ring keys are written as two 4-byte stores; an 8-byte load of them can't
+ * be store-forwarded and stalls, so hash them as two words instead.
+ */
+__attribute__((__target__("sse4.2")))
+static uint32_t
+crc32c_sse42_u32x2(uint32_t crc, const uint8_t *p)
+{
+	uint32_t w0, w1;
+
+	memcpy(&w0, p, sizeof w0);
+	memcpy(&w1, p + 4, sizeof w1);
+	return _mm_crc32_u32(_mm_crc32_u32(crc, w0), w1);
+}
+#endif /* CRC32C_SSE42 */
+
+/**
+ * Advance @crc over @len bytes of @data, as repeated CRC32C() would: no
+ * initial or final inversion, which is left to the caller.
+ *
+ * @param crc		the CRC so far
+ * @param data		the bytes to add
+ * @param len		the number of bytes
+ */
+uint32_t
+crc32c(uint32_t crc, const void *data, size_t len)
+{
+
+#ifdef CRC32C_SSE42
+	if (__builtin_cpu_supports("sse4.2"))
+		return crc32c_sse42(crc, data, len);
+#endif
+
+	return crc32c_sw(crc, data, len);
+}
+
+/**
+ * CRC32C of @data as an hr_hasher_t: starts from ~0, is not inverted at the
+ * end and is returned byte-swapped, so that rings hash identically to ones
+ * built with the byte-at-a-time CRC32C() loop.
+ */
+uint32_t
+crc32c_hasher(const void *data, size_t len)
+{
+
+#ifdef CRC32C_SSE42
+	if (len == 8 && __builtin_cpu_supports("sse4.2"))
+		return __builtin_bswap32(crc32c_sse42_u32x2(~(uint32_t)0,
+		    data));
+#endif
+
+	return __builtin_bswap32(crc32c(~(uint32_t)0, data, len));
+}
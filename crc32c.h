@@ -1,6 +1,9 @@
 #ifndef _CRC32C_H
 #define _CRC32C_H
 
+#include <stddef.h>
+#include <stdint.h>
+
 #define CRC32C_POLY (0x1EDC6F41)
 #define CRC32C(c,d) (c=(c>>8)^crc_c[(c^(d))&0xFF])
 /* * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * * */
@@ -89,4 +92,9 @@ static const uint32_t crc_c[256] = {
 	0xBE2DA0A5, 0x4C4623A6, 0x5F16D052, 0xAD7D5351,
 };
 
+/* CRC32C with SSE4.2 where available; see crc32c.c */
+uint32_t	crc32c(uint32_t crc, const void *data, size_t len);
+uint32_t	crc32c_sw(uint32_t crc, const void *data, size_t len);
+uint32_t	crc32c_hasher(const void *data, size_t len);
+
 #endif
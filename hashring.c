@@ -29,6 +29,13 @@
 # include <stdlib.h>
 # include <string.h>
 
+/* Userspace x86 builds get vectorized search kernels, chosen at runtime. */
+# if defined(__GNUC__) && defined(__x86_64__)
+#  include <immintrin.h>
+#  define HR_SIMD_X86		1
+#  define HR_TARGET(isa)	__attribute__((__target__(isa)))
+# endif
+
 # ifndef __FreeBSD__
 static inline void
 le32enc(void *vp, uint32_t val)
@@ -51,26 +58,123 @@ struct malloc_type;
 
 #include "hashring.h"
 
-/* Extract weight, value from combined field in hr_kv_pair */
+/* Bytes per ring entry: a hash, and a value in the parallel array */
+#define HR_ENTRY_SIZE		(2 * sizeof(uint32_t))
+
+/* Extract weight, value from combined field in hr_ring_value */
 #define HR_VAL_BITS		24
 #define HR_VAL_MASK		((1U << HR_VAL_BITS) - 1)
 #define HR_VAL(u32val)		((u32val) & HR_VAL_MASK)
 #define HR_WEIGHT(u32val)	((u32val) >> HR_VAL_BITS)
 
-/* Combine weight and 24-bit value into combined kv_value */
+/* Combine weight and 24-bit value into combined hr_ring_value entry */
 #define HR_MK_VAL(u32wt, u32member) \
 	(((u32wt) << HR_VAL_BITS) | HR_VAL(u32member))
 
+/* add_ring_item() didn't displace another member; also a dead ring entry */
+#define HR_NO_MEMBER		UINT32_MAX
+
+/*
+ * Marks, during remove_restoring(), the entries at hashes a member keeps. No
+ * weight (at most 100) reaches the value's top bit.
+ */
+#define HR_KEPT			(1U << 31)
+
+/* Shadow entries kept for a ring of the given capacity */
+#define HR_SHADOW_CAP(cap)	((cap) / 64 + 16)
+
+/* Interpolation probes before HR_LOOKUP_INTERP falls back to bsearch */
+#define HR_INTERP_PROBES	6
+
+/* Vnode hashes computed at a time by loops over a member's replicas */
+#define HR_VNODE_CHUNK		32
+
+/* Keys searched in lockstep by hash_ring_getn_batch() */
+#define HR_BATCH		16
+
+/* Ring entries below which build() doesn't bother with workers */
+#define HR_PAR_MIN		(1 << 16)
+/* Most hashing tasks a parallel build() splits members into */
+#define HR_PAR_TASKS		64
+/* Parallel build() sorts buckets of entries with the same top hash bits */
+#define HR_PAR_BITS		8
+#define HR_PAR_BUCKETS		(1U << HR_PAR_BITS)
+
+#ifdef __GNUC__
+# define HR_PREFETCH(p)		__builtin_prefetch(p)
+# define HR_ALWAYS_INLINE	inline __attribute__((__always_inline__))
+#else
+# define HR_PREFETCH(p)		((void)(p))
+# define HR_ALWAYS_INLINE	inline
+#endif
+
 static void	*bsearch_or_next(const void *key, const void *base,
 				 size_t nmemb, size_t size,
 				 int (*cmp)(const void *, const void *));
-static int	 hr_kv_cmp(const void *a, const void *b);
-
-static void	 add_ring_item(struct hash_ring *, uint32_t hash,
+static int	 hr_hash_cmp(const void *a, const void *b);
+
+static uint32_t	 ring_search(const struct hash_ring *, uint32_t hash);
+static uint32_t	 keys_search(const struct hash_ring *, const uint32_t *keys,
+			     size_t nkeys, uint32_t hash);
+static void	 ring_search_batch(const struct hash_ring *,
+				   const uint32_t *hashes, size_t count,
+				   uint32_t *idx);
+static int	 ring_walk(const struct hash_ring *, uint32_t i, unsigned n,
+			   uint32_t *memb_out);
+static int	 ring_walk_succ(const struct hash_ring *, uint32_t i,
+				unsigned n, uint32_t *memb_out);
+
+static void	 ring_vnodes(const struct hash_ring *, uint32_t member,
+			     uint32_t first, uint32_t n, uint32_t *out);
+static uint32_t	 add_ring_item(struct hash_ring *, uint32_t hash,
+			       uint32_t member);
+static bool	 ring_has_member(const struct hash_ring *, uint32_t member);
+static bool	 ring_owns_any(const struct hash_ring *, uint32_t member,
+			       uint32_t reps);
+static void	 ring_sort(uint32_t *hash, uint32_t *value, size_t n);
+static bool	 ring_build_par(struct hash_ring *,
+				const struct hr_member *members,
+				size_t nmembers, size_t n);
+static void	 ring_merge(struct hash_ring *, size_t off, size_t n);
+static void	 remove_restoring(struct hash_ring *, uint32_t member,
+				  uint32_t reps);
+static void	 ring_compact(struct hash_ring *);
+
+static void	 hr_free(const struct hash_ring *, void *);
+static void	*ring_buf(const struct hash_ring *, void *buf, size_t *sz,
+			  size_t need);
+static bool	 ring_realloc(struct hash_ring *, size_t capacity);
+
+static size_t	 ring_bytes(size_t capacity);
+static size_t	 ring_capacity(size_t sz);
+static size_t	 ring_grow(const struct hash_ring *, size_t want);
+static size_t	 ring_shrink(const struct hash_ring *);
+static void	 ring_adopt(struct hash_ring *, void *buf, size_t sz);
+static size_t	 shadow_find(const struct hash_ring *, uint32_t hash);
+static void	 shadow_add(struct hash_ring *, uint32_t hash, uint32_t value);
+static uint32_t	 shadow_take(struct hash_ring *, uint32_t hash);
+static void	 shadow_forget(struct hash_ring *, uint32_t hash,
 			       uint32_t member);
-static void	 remove_ring_item(struct hash_ring *, uint32_t hash,
-				  uint32_t member);
 
+static size_t	 btree_size(size_t nkeys, struct hr_btree *bt);
+static void	 btree_build(struct hr_btree *, const uint32_t *ring,
+			     size_t nkeys);
+static size_t	 prefix_size(size_t nkeys, struct hr_prefix *pf);
+static void	 prefix_build(struct hr_prefix *, const uint32_t *ring,
+			      size_t nkeys);
+static void	 ring_index_discard(struct hash_ring *);
+static void	 succ_build(uint32_t *succ, const uint32_t *value,
+			    size_t nkeys);
+static void	 ring_succ_discard(struct hash_ring *);
+static size_t	 preflist_build(const struct hash_ring *, unsigned len,
+				struct hr_preflist *);
+static int	 preflist_get(const struct hash_ring *, uint32_t hash,
+			      unsigned n, uint32_t *memb_out);
+static void	 ring_preflist_discard(struct hash_ring *);
+
+static enum hr_simd	 hr_simd_detect(void);
+
+static size_t	 rehash_slots(const struct hash_ring *);
 static void	 rehash(struct hash_ring *, uint32_t *memb);
 static void	 ring_fixup_weights(struct hash_ring*, uint32_t mempair);
 
@@ -86,24 +190,75 @@ hash_ring_init(struct hash_ring *h, hr_hasher_t hash, struct malloc_type *mt,
 {
 
 	h->hr_hash_fn = hash;
+	h->hr_vnode_fn = NULL;
 	h->hr_mtype = mt;
+	h->hr_alloc = NULL;
+	h->hr_workers = NULL;
 	h->hr_nreplicas = nreplicas;
 
-	h->hr_ring = NULL;
+	h->hr_ring_hash = NULL;
+	h->hr_ring_value = NULL;
 	h->hr_ring_used = 0;
 	h->hr_ring_capacity = 0;
+	h->hr_ring_reserved = 0;
+	h->hr_nmembers = 0;
+
+	h->hr_shadow = NULL;
+	h->hr_shadow_used = 0;
+	h->hr_shadow_capacity = 0;
+	h->hr_shadow_overflow = false;
+
+	h->hr_lookup = HR_LOOKUP_BSEARCH;
+	h->hr_index = NULL;
+	h->hr_simd = hr_simd_detect();
+	h->hr_succ = NULL;
+	h->hr_preflist.pl_hash = NULL;
 
 #ifdef INVARIANTS
 	h->hr_initialized = true;
 #endif
 }
 
+void
+hash_ring_init_alloc(struct hash_ring *h, hr_hasher_t hash,
+    const struct hr_allocator *alloc, uint32_t nreplicas)
+{
+
+	hash_ring_init(h, hash, NULL, nreplicas);
+	h->hr_alloc = alloc;
+}
+
+void
+hash_ring_set_vnode_hasher(struct hash_ring *h, hr_vnode_hasher_t fn)
+{
+
+#ifdef INVARIANTS
+	ASSERT(h->hr_initialized);
+#endif
+
+	h->hr_vnode_fn = fn;
+}
+
+void
+hash_ring_set_workers(struct hash_ring *h, const struct hr_workers *w)
+{
+
+#ifdef INVARIANTS
+	ASSERT(h->hr_initialized);
+#endif
+
+	h->hr_workers = w;
+}
+
 void
 hash_ring_clean(struct hash_ring *h)
 {
 
-	if (h->hr_ring != NULL)
-		free(h->hr_ring, h->hr_mtype);
+	ring_index_discard(h);
+	ring_succ_discard(h);
+	ring_preflist_discard(h);
+	if (h->hr_ring_hash != NULL)
+		hr_free(h, h->hr_ring_hash);
 	memset(h, 0, sizeof *h);
 
 #ifdef INVARIANTS
@@ -115,9 +270,9 @@ size_t
 hash_ring_add(struct hash_ring *h, uint32_t member, unsigned weightpct,
     void *newmemb, size_t sz)
 {
-	uint8_t hashdata[8];
-	uint32_t reps;
-	size_t need;
+	uint32_t reps, *runh, *runv;
+	size_t want;
+	bool present;
 
 #ifdef INVARIANTS
 	ASSERT(h->hr_initialized);
@@ -125,46 +280,147 @@ hash_ring_add(struct hash_ring *h, uint32_t member, unsigned weightpct,
 	ASSERT(weightpct > 0 && weightpct <= 100);
 	ASSERT(HR_WEIGHT(member) == 0);
 
-	need = (h->hr_ring_used + h->hr_nreplicas) * sizeof(h->hr_ring[0]);
+	reps = weightpct * h->hr_nreplicas / 100;
+	if (reps == 0)
+		reps = 1;
+
+	/* Room for the new entries, and to sort them before merging. */
+	want = h->hr_ring_used + 2 * (size_t)reps;
+	if (want > h->hr_ring_capacity && !ring_realloc(h, ring_grow(h, want)))
+		newmemb = ring_buf(h, newmemb, &sz,
+		    ring_bytes(ring_grow(h, want)));
 
-	if (need <= h->hr_ring_capacity) {
+	if (want <= h->hr_ring_capacity) {
 		if (newmemb != NULL)
-			free(newmemb, h->hr_mtype);
-	} else if (need <= sz) {
-		if (h->hr_ring_used > 0) {
-			memcpy(newmemb, h->hr_ring,
-			    h->hr_ring_used*sizeof(h->hr_ring[0]));
-		}
-		if (h->hr_ring != NULL)
-			free(h->hr_ring, h->hr_mtype);
-		h->hr_ring = newmemb;
-		h->hr_ring_capacity = sz / sizeof(h->hr_ring[0]);
+			hr_free(h, newmemb);
+	} else if (ring_bytes(want) <= sz) {
+		ring_adopt(h, newmemb, sz);
 	} else {
 		if (newmemb != NULL)
-			free(newmemb, h->hr_mtype);
-		return need;
+			hr_free(h, newmemb);
+		return ring_bytes(ring_grow(h, want));
 	}
 
-	le32enc(hashdata, member);
+	ring_index_discard(h);
+	ring_succ_discard(h);
+	ring_preflist_discard(h);
 
-	reps = weightpct * h->hr_nreplicas / 100;
-	if (reps == 0)
-		reps = 1;
+	present = ring_has_member(h, member);
 
-	for (uint32_t i = 0; i < reps; i++) {
-		uint32_t rhash;
+	runh = &h->hr_ring_hash[h->hr_ring_used + reps];
+	runv = &h->hr_ring_value[h->hr_ring_used + reps];
 
-		le32enc(&hashdata[4], i);
-		rhash = h->hr_hash_fn(hashdata, sizeof hashdata);
+	ring_vnodes(h, member, 0, reps, runh);
+	for (uint32_t i = 0; i < reps; i++)
+		runv[i] = member;
 
-		add_ring_item(h, rhash, member);
-	}
+	ring_sort(runh, runv, reps);
+	ring_merge(h, reps, reps);
+
+	/* Or this one may have lost every collision. */
+	if (!present && ring_has_member(h, member))
+		h->hr_nmembers++;
 
 	ring_fixup_weights(h, HR_MK_VAL(weightpct, member));
 
 	return 0;
 }
 
+size_t
+hash_ring_build(struct hash_ring *h, const struct hr_member *members,
+    size_t nmembers, void *buf, size_t sz)
+{
+	uint32_t *hash, *value, reps, member;
+	size_t need, n, i, j;
+
+#ifdef INVARIANTS
+	ASSERT(h->hr_initialized);
+#endif
+
+	n = 0;
+	for (i = 0; i < nmembers; i++) {
+		ASSERT(members[i].hm_weightpct > 0 &&
+		    members[i].hm_weightpct <= 100);
+		ASSERT(HR_WEIGHT(members[i].hm_member) == 0);
+
+		reps = members[i].hm_weightpct * h->hr_nreplicas / 100;
+		n += (reps == 0) ? 1 : reps;
+	}
+	need = n;
+	if (need < h->hr_ring_reserved && need > 0)
+		need = h->hr_ring_reserved;
+	need = (need == 0) ? 0 : ring_bytes(need);
+	buf = ring_buf(h, buf, &sz, need);
+
+	if (need > sz || need == 0) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		if (need > sz)
+			return need;
+		buf = NULL;
+	}
+
+	ring_index_discard(h);
+	ring_succ_discard(h);
+	ring_preflist_discard(h);
+
+	h->hr_ring_used = 0;
+	h->hr_shadow_used = 0;
+	h->hr_shadow_overflow = false;
+	if (buf != NULL) {
+		ring_adopt(h, buf, sz);
+	} else {
+		if (h->hr_ring_hash != NULL)
+			hr_free(h, h->hr_ring_hash);
+		h->hr_ring_hash = h->hr_ring_value = NULL;
+		h->hr_ring_capacity = 0;
+		h->hr_shadow = NULL;
+		h->hr_shadow_capacity = 0;
+	}
+	hash = h->hr_ring_hash;
+	value = h->hr_ring_value;
+
+	/* Every vnode, weight and all, in order... */
+	if (!ring_build_par(h, members, nmembers, n)) {
+		for (i = j = 0; i < nmembers; i++) {
+			member = members[i].hm_member;
+			reps = members[i].hm_weightpct * h->hr_nreplicas / 100;
+			if (reps == 0)
+				reps = 1;
+
+			ring_vnodes(h, member, 0, reps, &hash[j]);
+			for (uint32_t r = 0; r < reps; r++)
+				value[j++] = HR_MK_VAL(
+				    members[i].hm_weightpct, member);
+		}
+		ring_sort(hash, value, n);
+	}
+
+	/* ... keeping the lowest member of each colliding hash. */
+	for (i = j = 0; i < n; i++) {
+		if (j > 0 && hash[j - 1] == hash[i]) {
+			if (HR_VAL(value[i]) != HR_VAL(value[j - 1]))
+				shadow_add(h, hash[i], value[i]);
+			continue;
+		}
+		hash[j] = hash[i];
+		value[j] = value[i];
+		j++;
+	}
+	h->hr_ring_used = j;
+
+	/* Members which lost every collision aren't in the ring. */
+	h->hr_nmembers = 0;
+	for (i = 0; i < nmembers; i++) {
+		reps = members[i].hm_weightpct * h->hr_nreplicas / 100;
+		if (ring_owns_any(h, members[i].hm_member,
+		    (reps == 0) ? 1 : reps))
+			h->hr_nmembers++;
+	}
+
+	return 0;
+}
+
 /*
  * Caller must preallocate member buffer in case we need to rehash.
  *
@@ -174,10 +430,11 @@ size_t
 hash_ring_remove(struct hash_ring *h, uint32_t member, unsigned weightpct,
     void *aux, size_t auxsz)
 {
-	uint8_t hashdata[8];
 	size_t hr_used,
-	       memb_exp;
-	uint32_t reps, i;
+	       memb_exp,
+	       shrink;
+	uint32_t reps;
+	bool overflow;
 
 #ifdef INVARIANTS
 	ASSERT(h->hr_initialized);
@@ -185,44 +442,89 @@ hash_ring_remove(struct hash_ring *h, uint32_t member, unsigned weightpct,
 	ASSERT(weightpct < 100);
 	ASSERT(HR_WEIGHT(member) == 0);
 
-	memb_exp = 0;
-	if (h->hr_nreplicas > 0)
-		memb_exp = (h->hr_ring_used + (h->hr_nreplicas - 1)) / h->hr_nreplicas;
-
-	memb_exp *= sizeof(uint32_t);
+	/* Room for rehash()'s member set, and then maybe for the ring. */
+	memb_exp = rehash_slots(h) * sizeof(uint32_t);
+	shrink = ring_shrink(h);
+	if (shrink > 0 && ring_bytes(shrink) > memb_exp)
+		memb_exp = ring_bytes(shrink);
+	if (h->hr_alloc != NULL && shrink == 0 && !h->hr_shadow_overflow)
+		memb_exp = 0;
+	aux = ring_buf(h, aux, &auxsz, memb_exp);
 	if (auxsz < memb_exp) {
 		if (aux != NULL)
-			free(aux, h->hr_mtype);
+			hr_free(h, aux);
 		return memb_exp;
 	}
 
-	hr_used = h->hr_ring_used;
+	ring_index_discard(h);
+	ring_succ_discard(h);
+	ring_preflist_discard(h);
 
-	le32enc(hashdata, member);
+	hr_used = h->hr_ring_used;
 
 	reps = weightpct * h->hr_nreplicas / 100;
 	if (reps == 0 && weightpct > 0)
 		reps = 1;
 
-	for (i = h->hr_nreplicas - 1; i >= reps && i < UINT32_MAX; i--) {
-		uint32_t rhash;
+	/*
+	 * If some losers were forgotten, only a rehash finds them all; it
+	 * rebuilds the shadows too.
+	 */
+	overflow = h->hr_shadow_overflow;
+	if (overflow)
+		h->hr_shadow_used = 0;
+
+	remove_restoring(h, member, reps);
+	ring_fixup_weights(h, HR_MK_VAL(weightpct, member));
 
-		le32enc(&hashdata[4], i);
-		rhash = h->hr_hash_fn(hashdata, sizeof hashdata);
+	if (overflow && hr_used != h->hr_ring_used)
+		rehash(h, aux);
 
-		remove_ring_item(h, rhash, member);
+	/* The member set is done with; aux can take the ring. */
+	if (shrink > 0 && ring_capacity(auxsz) < h->hr_ring_capacity) {
+		ring_adopt(h, aux, auxsz);
+		aux = NULL;
 	}
 
-	ring_fixup_weights(h, HR_MK_VAL(weightpct, member));
+	if (aux != NULL)
+		hr_free(h, aux);
 
-	/* TODO: possibly shrink h->hr_ring at this point if underfull */
+	return 0;
+}
 
-	if (hr_used != h->hr_ring_used)
-		rehash(h, aux);
+size_t
+hash_ring_reserve(struct hash_ring *h, uint32_t nmembers, void *buf, size_t sz)
+{
+	size_t want;
 
-	if (aux != NULL)
-		free(aux, h->hr_mtype);
+#ifdef INVARIANTS
+	ASSERT(h->hr_initialized);
+#endif
+
+	/* Adding the last member takes room to sort its vnodes, too. */
+	want = ((size_t)nmembers + 1) * h->hr_nreplicas;
+	if (want < h->hr_ring_used)
+		want = h->hr_ring_used;
+	h->hr_ring_reserved = want;
+
+	if (want <= h->hr_ring_capacity) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		return 0;
+	}
+	if (ring_realloc(h, want)) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		return 0;
+	}
+	buf = ring_buf(h, buf, &sz, ring_bytes(want));
+	if (ring_bytes(want) > sz) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		return ring_bytes(want);
+	}
 
+	ring_adopt(h, buf, sz);
 	return 0;
 }
 
@@ -230,71 +532,216 @@ int
 hash_ring_getn(const struct hash_ring *h, uint32_t hash, unsigned n,
     uint32_t *memb_out)
 {
-	int error = EINVAL;
-	uint32_t i, found, walked;
-	struct hr_kv_pair *bucket, pairkey;
 
 #ifdef INVARIANTS
 	ASSERT(h->hr_initialized);
 #endif
 
 	if (n == 0)
-		goto out;
+		return EINVAL;
+	if (n > h->hr_nmembers)
+		return ENOENT;
 
-	error = 0;
+	if (h->hr_preflist.pl_hash != NULL && n <= h->hr_preflist.pl_maxn)
+		return preflist_get(h, hash, n, memb_out);
 
-	/*
-	 * Find the smallest 'i' for which ring[i]->kv_hash > hash.
-	 */
-	pairkey.kv_hash = hash;
+	return ring_walk(h, ring_search(h, hash), n, memb_out);
+}
 
-	bucket = bsearch_or_next(&pairkey, h->hr_ring, h->hr_ring_used,
-	    sizeof pairkey, hr_kv_cmp);
-	i = bucket - h->hr_ring;
+int
+hash_ring_getn_batch(const struct hash_ring *h, const uint32_t *hashes,
+    size_t count, unsigned n, uint32_t *memb_out)
+{
+	uint32_t idx[HR_BATCH];
+	size_t k, nk;
+	int error;
 
-	if (i == h->hr_ring_used)
-		i = 0;
+#ifdef INVARIANTS
+	ASSERT(h->hr_initialized);
+#endif
 
-	/*
-	 * We start with hr_ring[i], walking until we find enough distinct
-	 * items
-	 */
-	walked = 0;
-	for (found = 0; n > found; i = (i + 1) % h->hr_ring_used) {
-		bool already_found = false;
+	if (n == 0)
+		return EINVAL;
+	if (n > h->hr_nmembers)
+		return ENOENT;
+
+	if (h->hr_preflist.pl_hash != NULL && n <= h->hr_preflist.pl_maxn) {
+		for (k = 0; k < count; k++) {
+			error = preflist_get(h, hashes[k], n, &memb_out[k * n]);
+			if (error != 0)
+				return error;
+		}
+		return 0;
+	}
 
-		/*
-		 * Since we no longer have a reliable hash member count, error
-		 * out if we walk the whole ring and don't have enough members
-		 * to satisfy the request.
-		 *
-		 * Since this may be expensive (O(N) instead of amortized
-		 * O(1)), callers are advised to only call getn() with N <= the
-		 * number of members they have inserted. This is often easy for
-		 * the user to track.
-		 */
-		if (walked >= h->hr_ring_used) {
-			error = ENOENT;
-			goto out;
+	for (k = 0; k < count; k += nk) {
+		nk = count - k;
+		if (nk > HR_BATCH)
+			nk = HR_BATCH;
+
+		ring_search_batch(h, &hashes[k], nk, idx);
+
+		for (size_t b = 0; b < nk; b++) {
+			error = ring_walk(h, idx[b], n, &memb_out[(k + b) * n]);
+			if (error != 0)
+				return error;
 		}
-		walked++;
+	}
 
-		for (unsigned j = 0; j < found; j++) {
-			if (memb_out[j] == HR_VAL(h->hr_ring[i].kv_value)) {
-				already_found = true;
-				break;
-			}
+	return 0;
+}
+
+size_t
+hash_ring_index(struct hash_ring *h, enum hr_lookup lookup, void *buf,
+    size_t sz)
+{
+	struct hr_btree bt;
+	struct hr_prefix pf;
+	size_t need;
+
+#ifdef INVARIANTS
+	ASSERT(h->hr_initialized);
+#endif
+
+	need = 0;
+	if (h->hr_ring_used > 0) {
+		switch (lookup) {
+		case HR_LOOKUP_BTREE:
+			need = btree_size(h->hr_ring_used, &bt);
+			break;
+		case HR_LOOKUP_PREFIX:
+			need = prefix_size(h->hr_ring_used, &pf);
+			break;
+		default:
+			break;
 		}
+	}
 
-		if (already_found)
-			continue;
+	buf = ring_buf(h, buf, &sz, need);
+	if (need > sz) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		return need;
+	}
 
-		memb_out[found] = HR_VAL(h->hr_ring[i].kv_value);
-		found++;
+	ring_index_discard(h);
+
+	if (need == 0) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		h->hr_lookup = (lookup == HR_LOOKUP_INTERP) ? lookup :
+		    HR_LOOKUP_BSEARCH;
+		return 0;
+	}
+
+	switch (lookup) {
+	case HR_LOOKUP_BTREE:
+		/* Nodes are cacheline-aligned; btree_size() allowed for this. */
+		bt.bt_keys = (uint32_t *)(((uintptr_t)buf + HR_BT_KEYS * 4 - 1) &
+		    ~(uintptr_t)(HR_BT_KEYS * 4 - 1));
+		btree_build(&bt, h->hr_ring_hash, h->hr_ring_used);
+		h->hr_btree = bt;
+		break;
+	case HR_LOOKUP_PREFIX:
+		pf.pf_start = buf;
+		prefix_build(&pf, h->hr_ring_hash, h->hr_ring_used);
+		h->hr_prefix = pf;
+		break;
+	default:
+		break;
+	}
+
+	h->hr_index = buf;
+	h->hr_lookup = lookup;
+	return 0;
+}
+
+size_t
+hash_ring_successors(struct hash_ring *h, void *buf, size_t sz)
+{
+	size_t need;
+
+#ifdef INVARIANTS
+	ASSERT(h->hr_initialized);
+#endif
+
+	need = h->hr_ring_used * sizeof(uint32_t);
+	buf = ring_buf(h, buf, &sz, need);
+	if (need > sz) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		return need;
+	}
+
+	ring_succ_discard(h);
+
+	if (need == 0) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		return 0;
+	}
+
+	succ_build(buf, h->hr_ring_value, h->hr_ring_used);
+	h->hr_succ = buf;
+	return 0;
+}
+
+size_t
+hash_ring_preflist(struct hash_ring *h, unsigned maxn, void *buf, size_t sz)
+{
+	struct hr_preflist pl;
+	size_t runs, need;
+	unsigned len;
+
+#ifdef INVARIANTS
+	ASSERT(h->hr_initialized);
+#endif
+	ASSERT(maxn <= HR_PREFLIST_MAXN);
+
+	/* Lists are as long as maxn, or as the number of members. */
+	len = maxn;
+	if (len > h->hr_nmembers)
+		len = h->hr_nmembers;
+
+	runs = 0;
+	if (len > 0)
+		runs = preflist_build(h, len, NULL);
+	need = runs * (1 + len) * sizeof(uint32_t);
+
+	buf = ring_buf(h, buf, &sz, need);
+	if (need > sz) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		return need;
+	}
+
+	ring_preflist_discard(h);
+
+	if (need == 0) {
+		if (buf != NULL)
+			hr_free(h, buf);
+		return 0;
 	}
 
-out:
-	return error;
+	pl.pl_hash = buf;
+	pl.pl_memb = &pl.pl_hash[runs];
+	pl.pl_runs = runs;
+	pl.pl_len = len;
+	pl.pl_maxn = maxn;
+	preflist_build(h, len, &pl);
+	h->hr_preflist = pl;
+	return 0;
+}
+
+uint32_t
+hash_ring_nmembers(const struct hash_ring *h)
+{
+
+#ifdef INVARIANTS
+	ASSERT(h->hr_initialized);
+#endif
+
+	return h->hr_nmembers;
 }
 
 /*
@@ -307,29 +754,57 @@ out:
 size_t
 hash_ring_copy(struct hash_ring *dst, struct hash_ring *src, void *m, size_t sz)
 {
-	size_t ring_size;
+	size_t capacity, ring_size;
 
 #ifdef INVARIANTS
 	ASSERT(src->hr_initialized);
 #endif
 
-	ring_size = src->hr_ring_used * sizeof(struct hr_kv_pair);
+	/*
+	 * The copy is exactly full, with the usual room for shadows; unless
+	 * the source has more shadows than that, and then it is as big.
+	 */
+	capacity = src->hr_ring_used;
+	if (src->hr_shadow_used > HR_SHADOW_CAP(capacity))
+		capacity = src->hr_ring_capacity;
+	ring_size = (capacity > 0) ? ring_bytes(capacity) : 0;
 
+	m = ring_buf(src, m, &sz, ring_size);
 	if (sz < ring_size) {
 		if (m != NULL)
-			free(m, src->hr_mtype);
+			hr_free(src, m);
 		return ring_size;
 	}
 
 	memcpy(dst, src, sizeof *dst);
+	dst->hr_lookup = HR_LOOKUP_BSEARCH;
+	dst->hr_index = NULL;
+	dst->hr_succ = NULL;
+	dst->hr_preflist.pl_hash = NULL;
 
 	if (ring_size > 0) {
-		memcpy(m, src->hr_ring, ring_size);
-		dst->hr_ring = m;
+		/* Use all of a larger buffer, so its size is the block's. */
+		capacity = ring_capacity(sz);
+		dst->hr_ring_hash = m;
+		dst->hr_ring_value = &dst->hr_ring_hash[capacity];
+		dst->hr_shadow = (struct hr_shadow *)
+		    &dst->hr_ring_hash[2 * capacity];
+		dst->hr_ring_capacity = capacity;
+		dst->hr_shadow_capacity = HR_SHADOW_CAP(capacity);
+		memcpy(dst->hr_ring_hash, src->hr_ring_hash,
+		    src->hr_ring_used * sizeof(uint32_t));
+		memcpy(dst->hr_ring_value, src->hr_ring_value,
+		    src->hr_ring_used * sizeof(uint32_t));
+		memcpy(dst->hr_shadow, src->hr_shadow,
+		    src->hr_shadow_used * sizeof(struct hr_shadow));
 	} else {
 		if (m != NULL)
-			free(m, src->hr_mtype);
-		dst->hr_ring = NULL;
+			hr_free(src, m);
+		dst->hr_ring_hash = NULL;
+		dst->hr_ring_value = NULL;
+		dst->hr_shadow = NULL;
+		dst->hr_ring_capacity = 0;
+		dst->hr_shadow_capacity = 0;
 	}
 
 	return 0;
@@ -381,131 +856,1632 @@ bsearch_or_next(const void *key, const void *base0, size_t nmemb, size_t size,
 }
 
 /*
- * Compares two hr_kv_pairs.
+ * Compares two ring hashes.
  */
 static int
-hr_kv_cmp(const void *a, const void *b)
+hr_hash_cmp(const void *a, const void *b)
 {
-	const struct hr_kv_pair *pa = a, *pb = b;
+	const uint32_t *pa = a, *pb = b;
 
-	if (pa->kv_hash > pb->kv_hash)
+	if (*pa > *pb)
 		return 1;
-	else if (pa->kv_hash < pb->kv_hash)
+	else if (*pa < *pb)
 		return -1;
 	return 0;
 }
 
 /*
- * Insert a new mapping into the ordered map internal to this hash_ring.
+ * Starting with entry i, walk the ring until we find @n distinct members.
  */
-static void
-add_ring_item(struct hash_ring *h, uint32_t hash, uint32_t member_)
+static int
+ring_walk(const struct hash_ring *h, uint32_t i, unsigned n,
+    uint32_t *memb_out)
 {
-	struct hr_kv_pair *insert, *end, newpair;
-	uint32_t member = HR_VAL(member_);
+	uint32_t found, walked;
 
-	ASSERT_DEBUG(h->hr_ring_capacity - h->hr_ring_used >= 1);
-	
-	newpair.kv_hash = hash;
-	newpair.kv_value = member;
+	if (i >= h->hr_ring_used)
+		i = 0;
 
-	/* Find the point at which this entry should be inserted */
-	insert = bsearch_or_next(&newpair, h->hr_ring, h->hr_ring_used,
-	    sizeof newpair, hr_kv_cmp);
+	if (h->hr_succ != NULL && n > 1)
+		return ring_walk_succ(h, i, n, memb_out);
 
-	end = h->hr_ring + h->hr_ring_used;
+	walked = 0;
+	for (found = 0; n > found; i = (i + 1) % h->hr_ring_used) {
+		bool already_found = false;
 
-	if (insert != end && insert->kv_hash == hash) {
-		/* Collision on 'hash', lowest value wins */
-		if (member < HR_VAL(insert->kv_value))
-			insert->kv_value = member_;
-		return;
-	}
+		/*
+		 * getn() has already checked hr_nmembers, so this shouldn't
+		 * happen; but never walk more than one lap of the ring.
+		 */
+		if (walked >= h->hr_ring_used)
+			return ENOENT;
+		walked++;
 
-	/* We insert in *front* of 'insert' */
-	if (insert != end)
-		memmove(insert + 1, insert, (end - insert) * sizeof newpair);
+		for (unsigned j = 0; j < found; j++) {
+			if (memb_out[j] == HR_VAL(h->hr_ring_value[i])) {
+				already_found = true;
+				break;
+			}
+		}
 
-	ASSERT_DEBUG(insert == h->hr_ring || (insert-1)->kv_hash < hash);
-	ASSERT_DEBUG(insert == end || hash < (insert+1)->kv_hash);
+		if (already_found)
+			continue;
 
-	*insert = newpair;
-	h->hr_ring_used++;
+		memb_out[found] = HR_VAL(h->hr_ring_value[i]);
+		found++;
+	}
+
+	return 0;
 }
 
-static void
-remove_ring_item(struct hash_ring *h, uint32_t hash, uint32_t member_)
+/*
+ * ring_walk(), stepping from each entry straight to the next one owned by a
+ * different member. Skipped entries all belong to a member already seen, so
+ * one lap still finds every member.
+ */
+static int
+ring_walk_succ(const struct hash_ring *h, uint32_t i, unsigned n,
+    uint32_t *memb_out)
 {
-	struct hr_kv_pair *remove, *end, rpair;
-	uint32_t member = HR_VAL(member_);
+	size_t used = h->hr_ring_used, walked;
+	uint32_t m, next;
+	unsigned found, j;
 
-	rpair.kv_hash = hash;
-	rpair.kv_value = member;
+	walked = 0;
+	for (found = 0;;) {
+		m = HR_VAL(h->hr_ring_value[i]);
+		for (j = 0; j < found && memb_out[j] != m; j++)
+			;
+		if (j == found) {
+			memb_out[found++] = m;
+			if (found == n)
+				return 0;
+		}
 
-	end = h->hr_ring + h->hr_ring_used;
-	remove = bsearch(&rpair, h->hr_ring, h->hr_ring_used,
-	    sizeof(struct hr_kv_pair), hr_kv_cmp);
+		/* A lone member is its own successor, a full lap away. */
+		next = h->hr_succ[i];
+		walked += (next > i) ? next - i : next + used - i;
+		if (walked >= used)
+			return ENOENT;
+		i = next;
+	}
+}
 
-	if (remove == NULL || HR_VAL(remove->kv_value) != member)
-		return;
+/*
+ * Computes the shape of a B+tree over @nkeys hashes into @bt, and returns the
+ * number of bytes needed to build it (including slop for alignment).
+ */
+static size_t
+btree_size(size_t nkeys, struct hr_btree *bt)
+{
+	size_t nodes[HR_BT_MAXH], total;
+	unsigned height, l;
+
+	/* Leaves, then parents up to a single root. */
+	height = 0;
+	nodes[height++] = (nkeys + HR_BT_KEYS - 1) / HR_BT_KEYS;
+	while (nodes[height - 1] > 1) {
+		ASSERT(height < HR_BT_MAXH);
+		nodes[height] = (nodes[height - 1] + HR_BT_KEYS) /
+		    (HR_BT_KEYS + 1);
+		height++;
+	}
 
-	if (remove + 1 != end)
-		memmove(remove, remove + 1,
-		    (end - remove - 1) * sizeof(struct hr_kv_pair));
+	/* Store them root first. */
+	total = 0;
+	for (l = 0; l < height; l++) {
+		bt->bt_nodes[l] = nodes[height - 1 - l];
+		bt->bt_off[l] = total;
+		total += bt->bt_nodes[l];
+	}
+	bt->bt_height = height;
 
-	h->hr_ring_used--;
+	return (total * HR_BT_KEYS + HR_BT_KEYS - 1) * sizeof(uint32_t);
 }
 
+/*
+ * Fills in the keys of a B+tree shaped by btree_size(). Leaf keys are the ring
+ * hashes. Child 'j' of a level 'd' above the leaves covers ring indices up to
+ * (j+1)*16*17^(d-1) - 1, and its key in the parent is the hash at that index.
+ * Indices past the end of the ring read as UINT32_MAX.
+ */
 static void
-rehash(struct hash_ring *h, uint32_t *memb)
+btree_build(struct hr_btree *bt, const uint32_t *ring, size_t nkeys)
 {
-	uint8_t hashdata[8];
-	unsigned nmemb = 0,
-		 i, j;
-	uint32_t reps;
-
-	/* Extract all members... */
-	for (i = 0; i < h->hr_ring_used; i++) {
-		uint32_t m = h->hr_ring[i].kv_value;
-
-		for (j = 0; j < nmemb; j++)
-			if (memb[j] == m)
-				break;
-		if (j >= nmemb) {
-			memb[j] = m;
-			nmemb++;
+	uint64_t span, last;
+	uint32_t *key;
+	size_t k;
+	unsigned l, c;
+
+	span = 0;
+	for (l = bt->bt_height; l-- > 0; ) {
+		key = &bt->bt_keys[bt->bt_off[l] * HR_BT_KEYS];
+
+		for (k = 0; k < bt->bt_nodes[l]; k++) {
+			for (c = 0; c < HR_BT_KEYS; c++) {
+				if (span == 0)
+					last = k * HR_BT_KEYS + c;
+				else
+					last = (k * (HR_BT_KEYS + 1) + c + 1) *
+					    span - 1;
+				*key++ = (last < nkeys) ? ring[last] : UINT32_MAX;
+			}
 		}
+
+		span = (span == 0) ? HR_BT_KEYS : span * (HR_BT_KEYS + 1);
 	}
+}
 
-	/* Re-add all hashes... hurray */
-	for (i = 0; i < nmemb; i++) {
+/*
+ * Sizes a prefix table for @nkeys ring entries. One bucket per entry (rounded
+ * down to a power of two) keeps buckets short, and the table no larger than
+ * half the ring.
+ */
+static size_t
+prefix_size(size_t nkeys, struct hr_prefix *pf)
+{
+	unsigned bits;
+
+	for (bits = 1; bits < HR_PF_MAXBITS && ((size_t)2 << bits) <= nkeys;
+	    bits++)
+		;
+	pf->pf_bits = bits;
+
+	return (((size_t)1 << bits) + 1) * sizeof(uint32_t);
+}
+
+/*
+ * Bucket 'p' holds the ring entries whose top pf_bits bits are 'p':
+ * ring[pf_start[p]] through ring[pf_start[p+1] - 1].
+ */
+static void
+prefix_build(struct hr_prefix *pf, const uint32_t *ring, size_t nkeys)
+{
+	unsigned shift = 32 - pf->pf_bits;
+	size_t i, p;
+
+	i = 0;
+	for (p = 0; p < (size_t)1 << pf->pf_bits; p++) {
+		while (i < nkeys && (ring[i] >> shift) < p)
+			i++;
+		pf->pf_start[p] = i;
+	}
+	pf->pf_start[p] = nkeys;
+}
+
+/*
+ * succ[i] is the first entry after 'i' (cyclically) whose member differs from
+ * that of entry 'i'; or 'i' itself, if there's only one member. Built in one
+ * backwards lap, starting from the end of some run of a member.
+ */
+static void
+succ_build(uint32_t *succ, const uint32_t *value, size_t nkeys)
+{
+	size_t i, j, k, step;
+
+	for (k = 0; k < nkeys; k++)
+		if (HR_VAL(value[k]) != HR_VAL(value[(k + 1) % nkeys]))
+			break;
+
+	if (k == nkeys) {
+		for (i = 0; i < nkeys; i++)
+			succ[i] = i;
+		return;
+	}
+
+	succ[k] = (k + 1) % nkeys;
+	for (step = 1, j = k; step < nkeys; step++, j = i) {
+		i = (j == 0) ? nkeys - 1 : j - 1;
+		succ[i] = (HR_VAL(value[i]) != HR_VAL(value[j])) ? j : succ[j];
+	}
+}
+
+static void
+ring_succ_discard(struct hash_ring *h)
+{
+
+	if (h->hr_succ != NULL)
+		hr_free(h, h->hr_succ);
+	h->hr_succ = NULL;
+}
+
+/*
+ * Walks every ring entry for its list of @len members, starting a new run
+ * whenever the list changes. Fills in @pl's runs, if it is non-NULL, and
+ * returns the number of runs.
+ */
+static size_t
+preflist_build(const struct hash_ring *h, unsigned len, struct hr_preflist *pl)
+{
+	uint32_t lists[2][HR_PREFLIST_MAXN], *cur, *prev;
+	size_t i, runs;
+	int error;
+
+	runs = 0;
+	prev = NULL;
+	for (i = 0; i < h->hr_ring_used; i++) {
+		cur = lists[i & 1];
+		error = ring_walk(h, i, len, cur);
+		ASSERT(error == 0);
+		(void)error;
+
+		if (prev == NULL || memcmp(cur, prev, len * sizeof *cur) != 0) {
+			if (pl != NULL)
+				memcpy(&pl->pl_memb[runs * len], cur,
+				    len * sizeof *cur);
+			runs++;
+		}
+		if (pl != NULL)
+			pl->pl_hash[runs - 1] = h->hr_ring_hash[i];
+		prev = cur;
+	}
+
+	return runs;
+}
+
+/*
+ * The first run whose last hash is at least @hash holds the answer; past the
+ * last run, the ring wraps around to the first.
+ */
+static int
+preflist_get(const struct hash_ring *h, uint32_t hash, unsigned n,
+    uint32_t *memb_out)
+{
+	const struct hr_preflist *pl = &h->hr_preflist;
+	uint32_t r;
+
+	if (n > pl->pl_len)
+		return ENOENT;
+
+	r = keys_search(h, pl->pl_hash, pl->pl_runs, hash);
+	if (r >= pl->pl_runs)
+		r = 0;
+
+	memcpy(memb_out, &pl->pl_memb[r * pl->pl_len], n * sizeof *memb_out);
+	return 0;
+}
+
+static void
+ring_preflist_discard(struct hash_ring *h)
+{
+
+	if (h->hr_preflist.pl_hash != NULL)
+		hr_free(h, h->hr_preflist.pl_hash);
+	h->hr_preflist.pl_hash = NULL;
+}
+
+static void
+ring_index_discard(struct hash_ring *h)
+{
+
+	if (h->hr_index != NULL)
+		hr_free(h, h->hr_index);
+	h->hr_index = NULL;
+
+	/* Only strategies with an index need to fall back. */
+	if (h->hr_lookup != HR_LOOKUP_INTERP)
+		h->hr_lookup = HR_LOOKUP_BSEARCH;
+}
+
+/*
+ * Hashes @member's vnodes @first through @first + @n - 1 into @out, with the
+ * batch hasher if there is one.
+ */
+static void
+ring_vnodes(const struct hash_ring *h, uint32_t member, uint32_t first,
+    uint32_t n, uint32_t *out)
+{
+	uint8_t hashdata[8];
+
+	if (h->hr_vnode_fn != NULL) {
+		h->hr_vnode_fn(member, first, n, out);
+		return;
+	}
+
+	le32enc(hashdata, member);
+	for (uint32_t i = 0; i < n; i++) {
+		le32enc(&hashdata[4], first + i);
+		out[i] = h->hr_hash_fn(hashdata, sizeof hashdata);
+	}
+}
+
+/*
+ * Insert a new mapping into the ordered map internal to this hash_ring.
+ */
+static uint32_t
+add_ring_item(struct hash_ring *h, uint32_t hash, uint32_t member_)
+{
+	uint32_t *insert, *value, displaced;
+	size_t i, end;
+	uint32_t member = HR_VAL(member_);
+
+	/* Find the point at which this entry should be inserted */
+	insert = bsearch_or_next(&hash, h->hr_ring_hash, h->hr_ring_used,
+	    sizeof hash, hr_hash_cmp);
+
+	i = insert - h->hr_ring_hash;
+	end = h->hr_ring_used;
+	value = &h->hr_ring_value[i];
+
+	if (i != end && *insert == hash) {
+		/* Collision on 'hash', lowest value wins */
+		displaced = HR_NO_MEMBER;
+		if (member < HR_VAL(*value)) {
+			displaced = HR_VAL(*value);
+			shadow_add(h, hash, *value);
+			*value = member_;
+		} else if (member != HR_VAL(*value))
+			shadow_add(h, hash, member_);
+		return displaced;
+	}
+
+	/*
+	 * Only a new hash takes a slot; rehash() re-adds every entry of a
+	 * ring that may be exactly full.
+	 */
+	ASSERT_DEBUG(h->hr_ring_capacity - h->hr_ring_used >= 1);
+
+	/* We insert in *front* of 'insert' */
+	if (i != end) {
+		memmove(insert + 1, insert, (end - i) * sizeof *insert);
+		memmove(value + 1, value, (end - i) * sizeof *value);
+	}
+
+	ASSERT_DEBUG(i == 0 || *(insert-1) < hash);
+	ASSERT_DEBUG(i == end || hash < *(insert+1));
+
+	*insert = hash;
+	*value = member_;
+	h->hr_ring_used++;
+	return HR_NO_MEMBER;
+}
+
+/*
+ * Whether @member holds any ring entry. Its entries can only be at its vnodes'
+ * hashes, so this searches for those instead of scanning the ring.
+ */
+static bool
+ring_has_member(const struct hash_ring *h, uint32_t member)
+{
+
+	return ring_owns_any(h, member, h->hr_nreplicas);
+}
+
+/*
+ * Whether @member holds the ring entry of any of its first @reps vnodes. It
+ * almost always holds the first one.
+ */
+static bool
+ring_owns_any(const struct hash_ring *h, uint32_t member, uint32_t reps)
+{
+	uint32_t vh[HR_VNODE_CHUNK], rhash, *found, value, chunk;
+
+	/* One at a time, unless a batch costs little more. */
+	chunk = (h->hr_vnode_fn != NULL) ? 8 : 1;
+	for (uint32_t r = 0; r < reps; r++) {
+		if (r % chunk == 0)
+			ring_vnodes(h, member, r,
+			    (reps - r < chunk) ? reps - r : chunk, vh);
+		rhash = vh[r % chunk];
+
+		found = bsearch(&rhash, h->hr_ring_hash, h->hr_ring_used,
+		    sizeof rhash, hr_hash_cmp);
+		if (found == NULL)
+			continue;
+		value = h->hr_ring_value[found - h->hr_ring_hash];
+		if (HR_VAL(value) == HR_VAL(member) && value != HR_NO_MEMBER)
+			return true;
+	}
+	return false;
+}
+
+/*
+ * Sorts parallel ring arrays by hash, then member. Quicksort, recursing into
+ * the smaller side; vnode hashes are well mixed, so median-of-three pivots
+ * keep it O(N log N).
+ */
+#define RING_KEY(i)	(((uint64_t)hash[i] << 32) | HR_VAL(value[i]))
+
+static void
+ring_sort(uint32_t *hash, uint32_t *value, size_t n)
+{
+	uint64_t pivot;
+	uint32_t t;
+	size_t i, j, mid;
+
+#define RING_SWAP(a, b)	do {						\
+	t = hash[a]; hash[a] = hash[b]; hash[b] = t;			\
+	t = value[a]; value[a] = value[b]; value[b] = t;		\
+} while (0)
+
+	while (n > 16) {
+		mid = n / 2;
+		if (RING_KEY(mid) < RING_KEY(0))
+			RING_SWAP(mid, 0);
+		if (RING_KEY(n - 1) < RING_KEY(mid)) {
+			RING_SWAP(n - 1, mid);
+			if (RING_KEY(mid) < RING_KEY(0))
+				RING_SWAP(mid, 0);
+		}
+		pivot = RING_KEY(mid);
+
+		/* Hoare partition: [0, j] <= pivot <= [j+1, n). */
+		i = 0;
+		j = n - 1;
+		for (;;) {
+			while (RING_KEY(i) < pivot)
+				i++;
+			while (RING_KEY(j) > pivot)
+				j--;
+			if (i >= j)
+				break;
+			RING_SWAP(i, j);
+			i++;
+			j--;
+		}
+
+		if (j + 1 < n - (j + 1)) {
+			ring_sort(hash, value, j + 1);
+			hash += j + 1;
+			value += j + 1;
+			n -= j + 1;
+		} else {
+			ring_sort(hash + j + 1, value + j + 1, n - (j + 1));
+			n = j + 1;
+		}
+	}
+
+	for (i = 1; i < n; i++)
+		for (j = i; j > 0 && RING_KEY(j) < RING_KEY(j - 1); j--)
+			RING_SWAP(j, j - 1);
+#undef RING_SWAP
+}
+#undef RING_KEY
+
+/*
+ * State of a parallel build(); see ring_build_par().
+ */
+struct build_par {
+	struct hash_ring	*bp_h;
+	const struct hr_member	*bp_members;
+	uint32_t		*bp_hash;	/* Entries as hashed, by task */
+	uint32_t		*bp_value;
+	size_t			*bp_count;	/* [task][bucket] */
+	size_t			*bp_bucket;	/* Ring offset of each bucket */
+	size_t			*bp_first;	/* First member of each task */
+	size_t			*bp_start;	/* First entry of each task */
+	unsigned		 bp_ntasks;
+};
+
+/* Hashes a task's members' vnodes, and counts them by bucket. */
+static void
+build_par_hash(void *arg, unsigned t)
+{
+	struct build_par *bp = arg;
+	const struct hr_member *m;
+	uint32_t *hash, *value, reps;
+	size_t *count, i, j;
+
+	hash = bp->bp_hash;
+	value = bp->bp_value;
+	count = &bp->bp_count[t * HR_PAR_BUCKETS];
+	j = bp->bp_start[t];
+	for (i = bp->bp_first[t]; i < bp->bp_first[t + 1]; i++) {
+		m = &bp->bp_members[i];
+		reps = m->hm_weightpct * bp->bp_h->hr_nreplicas / 100;
+		if (reps == 0)
+			reps = 1;
+
+		ring_vnodes(bp->bp_h, m->hm_member, 0, reps, &hash[j]);
+		for (uint32_t r = 0; r < reps; r++, j++) {
+			value[j] = HR_MK_VAL(m->hm_weightpct, m->hm_member);
+			count[hash[j] >> (32 - HR_PAR_BITS)]++;
+		}
+	}
+	ASSERT_DEBUG(j == bp->bp_start[t + 1]);
+}
+
+/*
+ * Moves a task's entries into the ring, each to the next place its bucket has
+ * for that task.
+ */
+static void
+build_par_scatter(void *arg, unsigned t)
+{
+	struct build_par *bp = arg;
+	uint32_t *rhash, *rvalue, b;
+	size_t *next, i;
+
+	rhash = bp->bp_h->hr_ring_hash;
+	rvalue = bp->bp_h->hr_ring_value;
+	next = &bp->bp_count[t * HR_PAR_BUCKETS];
+	for (i = bp->bp_start[t]; i < bp->bp_start[t + 1]; i++) {
+		b = bp->bp_hash[i] >> (32 - HR_PAR_BITS);
+		rhash[next[b]] = bp->bp_hash[i];
+		rvalue[next[b]] = bp->bp_value[i];
+		next[b]++;
+	}
+}
+
+static void
+build_par_sort(void *arg, unsigned b)
+{
+	struct build_par *bp = arg;
+	size_t off = bp->bp_bucket[b];
+
+	ring_sort(&bp->bp_h->hr_ring_hash[off], &bp->bp_h->hr_ring_value[off],
+	    bp->bp_bucket[b + 1] - off);
+}
+
+/*
+ * Fills the ring with the @n entries of @members' vnodes, sorted as
+ * ring_sort() would, on the ring's workers. Workers hash the members in
+ * contiguous ranges, counting entries by bucket (their top hash bits); then
+ * move them to their bucket's range of the ring; then sort each bucket. As
+ * buckets are ordered by hash, that sorts the ring.
+ *
+ * Returns false, having done nothing, if the ring is too small for it to be
+ * worth it, or there's no scratch space.
+ */
+static bool
+ring_build_par(struct hash_ring *h, const struct hr_member *members,
+    size_t nmembers, size_t n)
+{
+	const struct hr_workers *w = h->hr_workers;
+	struct build_par bp;
+	size_t *count, i, off, sz, reps;
+	unsigned ntasks, t;
+	void *scratch;
+
+	if (w == NULL || w->hw_nworkers < 2 || h->hr_alloc == NULL ||
+	    n < HR_PAR_MIN)
+		return false;
+
+	/* A few tasks per worker, as members' weights may differ. */
+	ntasks = w->hw_nworkers * 4;
+	if (ntasks > HR_PAR_TASKS)
+		ntasks = HR_PAR_TASKS;
+
+	sz = n * HR_ENTRY_SIZE + (ntasks * HR_PAR_BUCKETS +
+	    HR_PAR_BUCKETS + 1 + 2 * (ntasks + 1)) * sizeof(size_t);
+	scratch = h->hr_alloc->ha_alloc(h->hr_alloc->ha_ctx, sz);
+	if (scratch == NULL)
+		return false;
+
+	bp.bp_h = h;
+	bp.bp_members = members;
+	bp.bp_hash = scratch;
+	bp.bp_value = &bp.bp_hash[n];
+	bp.bp_count = (size_t *)&bp.bp_value[n];
+	bp.bp_bucket = &bp.bp_count[ntasks * HR_PAR_BUCKETS];
+	bp.bp_first = &bp.bp_bucket[HR_PAR_BUCKETS + 1];
+	bp.bp_start = &bp.bp_first[ntasks + 1];
+	bp.bp_ntasks = ntasks;
+	memset(bp.bp_count, 0, ntasks * HR_PAR_BUCKETS * sizeof(size_t));
+
+	/* Split members into ranges of about n / ntasks entries. */
+	t = 0;
+	off = 0;
+	bp.bp_first[0] = 0;
+	bp.bp_start[0] = 0;
+	for (i = 0; i < nmembers; i++) {
+		while (t + 1 < ntasks && off >= (t + 1) * n / ntasks) {
+			t++;
+			bp.bp_first[t] = i;
+			bp.bp_start[t] = off;
+		}
+		reps = members[i].hm_weightpct * h->hr_nreplicas / 100;
+		off += (reps == 0) ? 1 : reps;
+	}
+	while (t < ntasks) {
+		t++;
+		bp.bp_first[t] = nmembers;
+		bp.bp_start[t] = off;
+	}
+	ASSERT_DEBUG(off == n);
+
+	w->hw_run(w->hw_ctx, build_par_hash, &bp, ntasks);
+
+	/* Each bucket's range, and each task's place in it. */
+	off = 0;
+	for (unsigned b = 0; b < HR_PAR_BUCKETS; b++) {
+		bp.bp_bucket[b] = off;
+		for (t = 0; t < ntasks; t++) {
+			count = &bp.bp_count[t * HR_PAR_BUCKETS + b];
+			reps = *count;
+			*count = off;
+			off += reps;
+		}
+	}
+	bp.bp_bucket[HR_PAR_BUCKETS] = off;
+
+	w->hw_run(w->hw_ctx, build_par_scatter, &bp, ntasks);
+	w->hw_run(w->hw_ctx, build_par_sort, &bp, HR_PAR_BUCKETS);
+
+	hr_free(h, scratch);
+	return true;
+}
+
+/*
+ * Merges the @n sorted entries @off past the end of the ring into it, in one
+ * backward pass. @off must be at least @n, so that the merged ring ends before
+ * the run starts.
+ *
+ * Entries whose hash is already in the ring aren't added; as in
+ * add_ring_item(), the lower member keeps the entry.
+ */
+static void
+ring_merge(struct hash_ring *h, size_t off, size_t n)
+{
+	uint32_t *hash = h->hr_ring_hash, *value = h->hr_ring_value;
+	uint32_t *runh, *runv, *found, displaced;
+	size_t i, k, m, w;
+
+	ASSERT(off >= n);
+	ASSERT_DEBUG(h->hr_ring_capacity >= h->hr_ring_used + off + n);
+
+	runh = &hash[h->hr_ring_used + off];
+	runv = &value[h->hr_ring_used + off];
+
+	/* Settle collisions first, so the merged size is known. */
+	for (k = m = 0; k < n; k++) {
+		if (m > 0 && runh[m - 1] == runh[k])
+			continue;
+
+		found = bsearch(&runh[k], hash, h->hr_ring_used, sizeof *hash,
+		    hr_hash_cmp);
+		if (found == NULL) {
+			runh[m] = runh[k];
+			runv[m] = runv[k];
+			m++;
+			continue;
+		}
+
+		w = found - hash;
+		if (HR_VAL(runv[k]) < HR_VAL(value[w])) {
+			displaced = HR_VAL(value[w]);
+			shadow_add(h, runh[k], value[w]);
+			value[w] = runv[k];
+
+			/* That may have been its last entry. */
+			if (!ring_has_member(h, displaced))
+				h->hr_nmembers--;
+		} else if (HR_VAL(runv[k]) != HR_VAL(value[w]))
+			shadow_add(h, runh[k], runv[k]);
+	}
+
+	i = h->hr_ring_used;
+	w = i + m;
+	k = m;
+	while (k > 0) {
+		w--;
+		if (i > 0 && hash[i - 1] > runh[k - 1]) {
+			i--;
+			hash[w] = hash[i];
+			value[w] = value[i];
+		} else {
+			k--;
+			hash[w] = runh[k];
+			value[w] = runv[k];
+		}
+	}
+
+	h->hr_ring_used += m;
+}
+
+/*
+ * Size of rehash()'s member set: a power of two, at least twice the members
+ * in the ring, so probes stay short.
+ */
+static size_t
+rehash_slots(const struct hash_ring *h)
+{
+	size_t slots = 16;
+
+	while (slots < 2 * (size_t)h->hr_nmembers)
+		slots *= 2;
+	return slots;
+}
+
+/*
+ * Re-adds every member's vnodes, restoring entries that a removed member had
+ * shadowed. @memb holds rehash_slots() words, an open-addressed set of ring
+ * values (member and weight), so finding the members is linear in the ring.
+ */
+static void
+rehash(struct hash_ring *h, uint32_t *memb)
+{
+	uint32_t vh[HR_VNODE_CHUNK];
+	size_t slots, mask, i, j;
+	uint32_t reps, nmemb, m, prev;
+
+	/* The re-adds below find every collision again. */
+	h->hr_shadow_used = 0;
+	h->hr_shadow_overflow = false;
+
+	slots = rehash_slots(h);
+	mask = slots - 1;
+	for (j = 0; j < slots; j++)
+		memb[j] = HR_NO_MEMBER;
+
+	/* Extract all members... */
+	nmemb = 0;
+	prev = HR_NO_MEMBER;
+	for (i = 0; i < h->hr_ring_used; i++) {
+		m = h->hr_ring_value[i];
+		if (m == prev)
+			continue;
+		prev = m;
+
+		j = m * 0x9E3779B1U;
+		for (j ^= j >> 16, j &= mask; memb[j] != HR_NO_MEMBER && memb[j] != m;
+		    j = (j + 1) & mask)
+			;
+		if (memb[j] == HR_NO_MEMBER) {
+			ASSERT_DEBUG(nmemb + 1 < slots);
+			memb[j] = m;
+			nmemb++;
+		}
+	}
+	h->hr_nmembers = nmemb;
+
+	/* Re-add all hashes... hurray */
+	for (j = 0; j < slots; j++) {
 		unsigned weightpct;
 
-		le32enc(hashdata, HR_VAL(memb[i]));
-		weightpct = HR_WEIGHT(memb[i]);
+		if (memb[j] == HR_NO_MEMBER)
+			continue;
+
+		weightpct = HR_WEIGHT(memb[j]);
 
 		reps = weightpct * h->hr_nreplicas / 100;
 		if (reps == 0)
 			reps = 1;
 
 		for (uint32_t r = 0; r < reps; r++) {
-			uint32_t rhash;
-
-			le32enc(&hashdata[4], r);
-			rhash = h->hr_hash_fn(hashdata, sizeof hashdata);
-			add_ring_item(h, rhash, memb[i]);
+			if (r % HR_VNODE_CHUNK == 0)
+				ring_vnodes(h, HR_VAL(memb[j]), r,
+				    (reps - r < HR_VNODE_CHUNK) ? reps - r :
+				    HR_VNODE_CHUNK, vh);
+			add_ring_item(h, vh[r % HR_VNODE_CHUNK], memb[j]);
 		}
 	}
 }
 
+/*
+ * Sets the weight on all of @mempair's member's entries, and its shadows, to
+ * @mempair's. Like ring_has_member(), this only searches at its vnodes' hashes,
+ * so it costs O(replicas log N), not O(N).
+ */
 static void
 ring_fixup_weights(struct hash_ring *h, uint32_t mempair)
 {
-	struct hr_kv_pair *it, *end;
-	uint32_t member = HR_VAL(mempair);
+	struct hr_shadow *sh = h->hr_shadow;
+	uint32_t vh[HR_VNODE_CHUNK], rhash, *found, *value;
+	uint32_t member = HR_VAL(mempair), nreps = h->hr_nreplicas;
+	size_t i;
+
+	for (uint32_t r = 0; r < nreps; r++) {
+		if (r % HR_VNODE_CHUNK == 0)
+			ring_vnodes(h, member, r, (nreps - r < HR_VNODE_CHUNK) ?
+			    nreps - r : HR_VNODE_CHUNK, vh);
+		rhash = vh[r % HR_VNODE_CHUNK];
+
+		found = bsearch(&rhash, h->hr_ring_hash, h->hr_ring_used,
+		    sizeof rhash, hr_hash_cmp);
+		if (found != NULL) {
+			value = &h->hr_ring_value[found - h->hr_ring_hash];
+			if (HR_VAL(*value) == member && *value != HR_NO_MEMBER)
+				*value = mempair;
+		}
+
+		for (i = shadow_find(h, rhash);
+		    i < h->hr_shadow_used && sh[i].sh_hash == rhash; i++)
+			if (HR_VAL(sh[i].sh_value) == member)
+				sh[i].sh_value = mempair;
+	}
+}
+
+/*
+ * Removes @member's vnodes from @reps up. Each of its entries goes to the next
+ * lowest member that collided on it, if any, or is marked dead; the dead are
+ * swept out in one pass at the end. Hashes that one of its first @reps vnodes
+ * also has stay as they are: it still holds them, or still lost them.
+ */
+static void
+remove_restoring(struct hash_ring *h, uint32_t member, uint32_t reps)
+{
+	uint32_t vh[HR_VNODE_CHUNK], rhash, restored, *found, *value;
+	uint32_t nreps = h->hr_nreplicas;
+	size_t ndead, i;
+	bool present;
+
+	present = ring_has_member(h, member);
+	ndead = 0;
+
+	/* Every kept vnode's hash is in the ring; mark its entry. */
+	for (uint32_t r = 0; r < reps; r++) {
+		if (r % HR_VNODE_CHUNK == 0)
+			ring_vnodes(h, member, r, (reps - r < HR_VNODE_CHUNK) ?
+			    reps - r : HR_VNODE_CHUNK, vh);
+		rhash = vh[r % HR_VNODE_CHUNK];
+
+		found = bsearch(&rhash, h->hr_ring_hash, h->hr_ring_used,
+		    sizeof rhash, hr_hash_cmp);
+		ASSERT_DEBUG(found != NULL);
+		if (found != NULL)
+			h->hr_ring_value[found - h->hr_ring_hash] |= HR_KEPT;
+	}
+
+	for (uint32_t r = reps; r < nreps; r++) {
+		if ((r - reps) % HR_VNODE_CHUNK == 0)
+			ring_vnodes(h, member, r, (nreps - r < HR_VNODE_CHUNK) ?
+			    nreps - r : HR_VNODE_CHUNK, vh);
+		rhash = vh[(r - reps) % HR_VNODE_CHUNK];
+
+		found = bsearch(&rhash, h->hr_ring_hash, h->hr_ring_used,
+		    sizeof rhash, hr_hash_cmp);
+		value = (found != NULL) ?
+		    &h->hr_ring_value[found - h->hr_ring_hash] : NULL;
+		if (value != NULL && *value != HR_NO_MEMBER &&
+		    (*value & HR_KEPT) != 0)
+			continue;
+
+		shadow_forget(h, rhash, member);
+
+		if (value == NULL || *value == HR_NO_MEMBER ||
+		    HR_VAL(*value) != member)
+			continue;
+
+		restored = shadow_take(h, rhash);
+		if (restored == HR_NO_MEMBER) {
+			*value = HR_NO_MEMBER;
+			ndead++;
+			continue;
+		}
+
+		/* It may have lost every other collision. */
+		if (!ring_has_member(h, HR_VAL(restored)))
+			h->hr_nmembers++;
+		*value = restored;
+	}
+
+	if (reps > 0)
+		for (i = 0; i < h->hr_ring_used; i++)
+			if (h->hr_ring_value[i] != HR_NO_MEMBER)
+				h->hr_ring_value[i] &= ~HR_KEPT;
+
+	if (ndead > 0)
+		ring_compact(h);
+
+	if (present && !ring_has_member(h, member))
+		h->hr_nmembers--;
+}
+
+/*
+ * Drops the dead (HR_NO_MEMBER) entries from the ring.
+ */
+static void
+ring_compact(struct hash_ring *h)
+{
+	uint32_t *hash = h->hr_ring_hash, *value = h->hr_ring_value;
+	size_t i, j;
+
+	for (j = 0; j < h->hr_ring_used && value[j] != HR_NO_MEMBER; j++)
+		;
+	for (i = j; i < h->hr_ring_used; i++) {
+		if (value[i] == HR_NO_MEMBER)
+			continue;
+		hash[j] = hash[i];
+		value[j] = value[i];
+		j++;
+	}
+	h->hr_ring_used = j;
+}
+
+/*
+ * Bytes for a ring of @capacity entries, and its shadows.
+ */
+static size_t
+ring_bytes(size_t capacity)
+{
+
+	return (capacity + HR_SHADOW_CAP(capacity)) * HR_ENTRY_SIZE;
+}
+
+/*
+ * The largest ring capacity that fits in @sz bytes: ring_bytes() inverted.
+ */
+static size_t
+ring_capacity(size_t sz)
+{
+	size_t capacity, entries;
+
+	entries = sz / HR_ENTRY_SIZE;
+	if (entries < HR_SHADOW_CAP(0))
+		return 0;
+
+	capacity = (entries - HR_SHADOW_CAP(0)) / 65 * 64;
+	while (ring_bytes(capacity + 1) <= sz)
+		capacity++;
+	return capacity;
+}
+
+static void
+hr_free(const struct hash_ring *h, void *p)
+{
+
+	if (h->hr_alloc != NULL)
+		h->hr_alloc->ha_free(h->hr_alloc->ha_ctx, p);
+	else
+		free(p, h->hr_mtype);
+}
+
+/*
+ * With an allocator, swaps a @buf smaller than @need bytes for a new one, so
+ * that the caller only has to hand back a size if the allocator fails.
+ */
+static void *
+ring_buf(const struct hash_ring *h, void *buf, size_t *sz, size_t need)
+{
+	void *nbuf;
+
+	if (h->hr_alloc == NULL || *sz >= need)
+		return buf;
+
+	nbuf = h->hr_alloc->ha_alloc(h->hr_alloc->ha_ctx, need);
+	if (nbuf == NULL)
+		return buf;
+	if (buf != NULL)
+		hr_free(h, buf);
+	*sz = need;
+	return nbuf;
+}
+
+/*
+ * Grows the ring in place with the allocator's realloc, if it has one, then
+ * moves the shadows and values up to where the larger capacity puts them.
+ */
+static bool
+ring_realloc(struct hash_ring *h, size_t capacity)
+{
+	uint32_t *hashes;
+	size_t old = h->hr_ring_capacity;
+
+	if (h->hr_alloc == NULL || h->hr_alloc->ha_realloc == NULL ||
+	    h->hr_ring_hash == NULL)
+		return false;
+	ASSERT(capacity > old);
+
+	hashes = h->hr_alloc->ha_realloc(h->hr_alloc->ha_ctx, h->hr_ring_hash,
+	    ring_bytes(old), ring_bytes(capacity));
+	if (hashes == NULL)
+		return false;
+
+	/* Shadows first: they move furthest, and values may overlap them. */
+	memmove(&hashes[2 * capacity], &hashes[2 * old],
+	    h->hr_shadow_used * sizeof(struct hr_shadow));
+	memmove(&hashes[capacity], &hashes[old],
+	    h->hr_ring_used * sizeof(hashes[0]));
+
+	h->hr_ring_hash = hashes;
+	h->hr_ring_value = &hashes[capacity];
+	h->hr_ring_capacity = capacity;
+	h->hr_shadow = (struct hr_shadow *)&hashes[2 * capacity];
+	h->hr_shadow_capacity = HR_SHADOW_CAP(capacity);
+	return true;
+}
+
+/*
+ * Capacity to ask for when @want entries don't fit: at least double, so that
+ * N adds copy the ring O(log N) times.
+ */
+static size_t
+ring_grow(const struct hash_ring *h, size_t want)
+{
+	size_t capacity = 2 * h->hr_ring_capacity;
+
+	if (capacity < want)
+		capacity = want;
+	if (capacity < h->hr_ring_reserved)
+		capacity = h->hr_ring_reserved;
+	return capacity;
+}
+
+/*
+ * Capacity remove() should shrink the ring to, or zero to leave it be. A ring
+ * less than a quarter full shrinks to half full, never below its reserve or
+ * room for one more member; growing doubles it, so the gap keeps alternating
+ * adds and removes from moving it back and forth.
+ */
+static size_t
+ring_shrink(const struct hash_ring *h)
+{
+	size_t capacity;
+
+	if (h->hr_ring_used >= h->hr_ring_capacity / 4)
+		return 0;
+
+	capacity = 2 * h->hr_ring_used;
+	if (capacity < h->hr_ring_reserved)
+		capacity = h->hr_ring_reserved;
+	if (capacity < 2 * (size_t)h->hr_nreplicas)
+		capacity = 2 * (size_t)h->hr_nreplicas;
+	if (capacity >= h->hr_ring_capacity / 2)
+		return 0;
+	return capacity;
+}
 
-	end = &h->hr_ring[h->hr_ring_used];
-	for (it = h->hr_ring; it < end; it++)
-		if (HR_VAL(it->kv_value) == member)
-			it->kv_value = mempair;
+/*
+ * Moves the ring and its shadows into @buf of @sz bytes, freeing the old
+ * allocation. Shadows which don't fit are dropped; remove() then rehashes.
+ */
+static void
+ring_adopt(struct hash_ring *h, void *buf, size_t sz)
+{
+	uint32_t *hashes = buf;
+	struct hr_shadow *shadow;
+	size_t capacity, nshadow;
+
+	capacity = ring_capacity(sz);
+	ASSERT(capacity >= h->hr_ring_used);
+	shadow = (struct hr_shadow *)&hashes[2 * capacity];
+
+	if (h->hr_ring_used > 0) {
+		memcpy(hashes, h->hr_ring_hash,
+		    h->hr_ring_used * sizeof(hashes[0]));
+		memcpy(&hashes[capacity], h->hr_ring_value,
+		    h->hr_ring_used * sizeof(hashes[0]));
+	}
+
+	nshadow = h->hr_shadow_used;
+	if (nshadow > HR_SHADOW_CAP(capacity)) {
+		nshadow = HR_SHADOW_CAP(capacity);
+		h->hr_shadow_overflow = true;
+	}
+	if (nshadow > 0)
+		memcpy(shadow, h->hr_shadow, nshadow * sizeof(*shadow));
+
+	if (h->hr_ring_hash != NULL)
+		hr_free(h, h->hr_ring_hash);
+	h->hr_ring_hash = hashes;
+	h->hr_ring_value = &hashes[capacity];
+	h->hr_ring_capacity = capacity;
+	h->hr_shadow = shadow;
+	h->hr_shadow_used = nshadow;
+	h->hr_shadow_capacity = HR_SHADOW_CAP(capacity);
+}
+
+/*
+ * Index of the first shadow with a hash of at least @hash.
+ */
+static size_t
+shadow_find(const struct hash_ring *h, uint32_t hash)
+{
+	size_t lo = 0, hi = h->hr_shadow_used, mid;
+
+	while (lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if (h->hr_shadow[mid].sh_hash < hash)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/*
+ * Remembers that @value lost a collision on @hash. If the table is full, notes
+ * that it is incomplete instead.
+ */
+static void
+shadow_add(struct hash_ring *h, uint32_t hash, uint32_t value)
+{
+	struct hr_shadow *sh = h->hr_shadow;
+	size_t i;
+
+	for (i = shadow_find(h, hash);
+	    i < h->hr_shadow_used && sh[i].sh_hash == hash; i++) {
+		if (HR_VAL(sh[i].sh_value) == HR_VAL(value))
+			return;
+		if (HR_VAL(sh[i].sh_value) > HR_VAL(value))
+			break;
+	}
+
+	if (h->hr_shadow_used == h->hr_shadow_capacity) {
+		h->hr_shadow_overflow = true;
+		return;
+	}
+
+	memmove(&sh[i + 1], &sh[i], (h->hr_shadow_used - i) * sizeof(*sh));
+	sh[i].sh_hash = hash;
+	sh[i].sh_value = value;
+	h->hr_shadow_used++;
+}
+
+/*
+ * Removes and returns the lowest member's shadow on @hash, or HR_NO_MEMBER if
+ * there is none.
+ */
+static uint32_t
+shadow_take(struct hash_ring *h, uint32_t hash)
+{
+	struct hr_shadow *sh = h->hr_shadow;
+	uint32_t value;
+	size_t i;
+
+	i = shadow_find(h, hash);
+	if (i == h->hr_shadow_used || sh[i].sh_hash != hash)
+		return HR_NO_MEMBER;
+
+	value = sh[i].sh_value;
+	memmove(&sh[i], &sh[i + 1],
+	    (h->hr_shadow_used - i - 1) * sizeof(*sh));
+	h->hr_shadow_used--;
+	return value;
+}
+
+/*
+ * Removes @member's shadow on @hash, if any.
+ */
+static void
+shadow_forget(struct hash_ring *h, uint32_t hash, uint32_t member)
+{
+	struct hr_shadow *sh = h->hr_shadow;
+	size_t i;
+
+	for (i = shadow_find(h, hash);
+	    i < h->hr_shadow_used && sh[i].sh_hash == hash; i++) {
+		if (HR_VAL(sh[i].sh_value) != HR_VAL(member))
+			continue;
+		memmove(&sh[i], &sh[i + 1],
+		    (h->hr_shadow_used - i - 1) * sizeof(*sh));
+		h->hr_shadow_used--;
+		return;
+	}
+}
+
+/*
+ * =========================================
+ * Search kernels
+ * =========================================
+ *
+ * Every search ends by counting the keys less than the target in a window of
+ * HR_BT_KEYS hashes: a B+tree node, or the last few candidates of a binary
+ * search over the ring's hash array. Those counts are done 4 or 8 keys at a
+ * time with SSE2 or AVX2 where available. The searches themselves are written
+ * once, as always-inlined templates over the counting primitives, and
+ * instantiated per instruction set; ring_search() and ring_search_batch()
+ * dispatch on h->hr_simd, which hash_ring_init() sets from the running CPU's
+ * features.
+ */
+
+/* Count of keys less than @hash among HR_BT_KEYS keys. */
+typedef unsigned	(*hr_rank_fn)(const uint32_t *keys, uint32_t hash);
+
+static HR_ALWAYS_INLINE unsigned
+rank_scalar(const uint32_t *keys, uint32_t hash)
+{
+	unsigned r = 0;
+
+	for (unsigned c = 0; c < HR_BT_KEYS; c++)
+		r += (keys[c] < hash);
+	return r;
+}
+
+#ifdef HR_SIMD_X86
+/*
+ * x86 only has signed 32-bit compares; flipping the sign bit of both sides
+ * makes them order like unsigned values.
+ */
+static HR_ALWAYS_INLINE HR_TARGET("sse2") unsigned
+rank_sse2(const uint32_t *keys, uint32_t hash)
+{
+	const __m128i bias = _mm_set1_epi32(INT32_MIN);
+	__m128i x, k, acc;
+
+	x = _mm_xor_si128(_mm_set1_epi32(hash), bias);
+	acc = _mm_setzero_si128();
+	for (unsigned c = 0; c < HR_BT_KEYS; c += 4) {
+		k = _mm_xor_si128(_mm_loadu_si128((const __m128i *)&keys[c]),
+		    bias);
+		/* Lanes where key < hash are -1. */
+		acc = _mm_sub_epi32(acc, _mm_cmpgt_epi32(x, k));
+	}
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1,0,3,2)));
+	acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2,3,0,1)));
+	return _mm_cvtsi128_si32(acc);
+}
+
+static HR_ALWAYS_INLINE HR_TARGET("avx2,popcnt") unsigned
+rank_avx2(const uint32_t *keys, uint32_t hash)
+{
+	const __m256i bias = _mm256_set1_epi32(INT32_MIN);
+	__m256i x, k;
+	unsigned r = 0;
+
+	x = _mm256_xor_si256(_mm256_set1_epi32(hash), bias);
+	for (unsigned c = 0; c < HR_BT_KEYS; c += 8) {
+		k = _mm256_xor_si256(
+		    _mm256_loadu_si256((const __m256i *)&keys[c]), bias);
+		r += __builtin_popcount((unsigned)_mm256_movemask_ps(
+		    _mm256_castsi256_ps(_mm256_cmpgt_epi32(x, k))));
+	}
+	return r;
+}
+
+#endif /* HR_SIMD_X86 */
+
+static HR_ALWAYS_INLINE uint32_t
+btree_search_impl(const struct hr_btree *bt, uint32_t hash, hr_rank_fn rank)
+{
+	size_t k;
+	unsigned l;
+
+	k = 0;
+	for (l = 0; l + 1 < bt->bt_height; l++) {
+		k = k * (HR_BT_KEYS + 1) +
+		    rank(&bt->bt_keys[(bt->bt_off[l] + k) * HR_BT_KEYS], hash);
+		/*
+		 * Descended past the last child: every hash is smaller. Answer
+		 * past the end of the leaves, whatever level this is.
+		 */
+		if (k >= bt->bt_nodes[l + 1])
+			return bt->bt_nodes[bt->bt_height - 1] * HR_BT_KEYS;
+	}
+
+	return k * HR_BT_KEYS +
+	    rank(&bt->bt_keys[(bt->bt_off[l] + k) * HR_BT_KEYS], hash);
+}
+
+/*
+ * Branchless binary search, until the answer is known to be among
+ * HR_BT_KEYS consecutive entries; then count those less than the target.
+ */
+static HR_ALWAYS_INLINE uint32_t
+ring_bsearch_impl(const uint32_t *ring, size_t n, uint32_t hash,
+    hr_rank_fn rank)
+{
+	const uint32_t *base, *end;
+	size_t half;
+
+	if (n < HR_BT_KEYS) {
+		for (half = 0; half < n && ring[half] < hash; half++)
+			;
+		return half;
+	}
+
+	base = ring;
+	end = ring + n;
+	while (n > HR_BT_KEYS) {
+		half = n / 2;
+		base = (base[half] < hash) ? base + half : base;
+		n -= half;
+	}
+	if (base + HR_BT_KEYS > end)
+		base = end - HR_BT_KEYS;
+
+	return (base - ring) + rank(base, hash);
+}
+
+/*
+ * Lower bound of @hash, given that it's at some index in [lo, hi]. Ranges no
+ * longer than a window are just counted.
+ */
+static HR_ALWAYS_INLINE uint32_t
+range_search_impl(const uint32_t *ring, size_t n, uint32_t hash,
+    size_t lo, size_t hi, hr_rank_fn rank)
+{
+
+	if (hi - lo > HR_BT_KEYS)
+		return lo + ring_bsearch_impl(&ring[lo], hi - lo, hash, rank);
+	if (n < HR_BT_KEYS)
+		return ring_bsearch_impl(ring, n, hash, rank);
+	if (lo + HR_BT_KEYS > n)
+		lo = n - HR_BT_KEYS;
+	return lo + rank(&ring[lo], hash);
+}
+
+/*
+ * Interpolation search: ring hashes are uniformly distributed, so a hash's
+ * position is about proportional to its value within the range still being
+ * searched. That takes O(log log N) probes on average, but degrades to O(N)
+ * on skewed rings; after HR_INTERP_PROBES probes, finish with binary search.
+ */
+static HR_ALWAYS_INLINE uint32_t
+interp_search_impl(const uint32_t *ring, size_t n, uint32_t hash,
+    hr_rank_fn rank)
+{
+	uint64_t klo, khi;
+	size_t lo, hi, pos;
+	unsigned probes;
+
+	/* The answer is in [lo, hi]; klo and khi bound hash in value. */
+	lo = 0;
+	hi = n;
+	klo = 0;
+	khi = (uint64_t)UINT32_MAX + 1;
+
+	for (probes = 0; hi - lo > HR_BT_KEYS && probes < HR_INTERP_PROBES;
+	    probes++) {
+		pos = lo + (hash - klo) * (hi - lo) / (khi - klo);
+		if (pos >= hi)
+			pos = hi - 1;
+
+		if (ring[pos] < hash) {
+			lo = pos + 1;
+			klo = ring[pos];
+		} else {
+			hi = pos;
+			khi = ring[pos];
+		}
+	}
+
+	return range_search_impl(ring, n, hash, lo, hi, rank);
+}
+
+static HR_ALWAYS_INLINE uint32_t
+ring_search_impl(const struct hash_ring *h, uint32_t hash, hr_rank_fn rank)
+{
+	const struct hr_prefix *pf = &h->hr_prefix;
+	uint32_t p;
+
+	switch (h->hr_lookup) {
+	case HR_LOOKUP_BTREE:
+		return btree_search_impl(&h->hr_btree, hash, rank);
+	case HR_LOOKUP_PREFIX:
+		p = hash >> (32 - pf->pf_bits);
+		return range_search_impl(h->hr_ring_hash, h->hr_ring_used,
+		    hash, pf->pf_start[p], pf->pf_start[p + 1], rank);
+	case HR_LOOKUP_INTERP:
+		return interp_search_impl(h->hr_ring_hash, h->hr_ring_used,
+		    hash, rank);
+	default:
+		return ring_bsearch_impl(h->hr_ring_hash, h->hr_ring_used,
+		    hash, rank);
+	}
+}
+
+/*
+ * ring_search() for @count keys in lockstep.
+ *
+ * The probe offsets of a branchless binary search depend only on the ring
+ * size, so all keys descend together; each key's next probe is prefetched
+ * while the rest of the group is compared. Likewise, every key visits one
+ * B+tree node per level. Cache misses for the group overlap instead of
+ * serializing.
+ */
+static HR_ALWAYS_INLINE void
+ring_search_batch_impl(const struct hash_ring *h, const uint32_t *hashes,
+    size_t count, uint32_t *idx, hr_rank_fn rank)
+{
+	const uint32_t *ring = h->hr_ring_hash;
+	size_t len, half, next, b;
+
+	if (h->hr_ring_used < HR_BT_KEYS) {
+		for (b = 0; b < count; b++)
+			idx[b] = ring_bsearch_impl(ring, h->hr_ring_used,
+			    hashes[b], rank);
+		return;
+	}
+
+	for (b = 0; b < count; b++)
+		idx[b] = 0;
+
+	if (h->hr_lookup == HR_LOOKUP_BTREE) {
+		const struct hr_btree *bt = &h->hr_btree;
+		const uint32_t *node;
+		unsigned l;
+
+		for (l = 0; l < bt->bt_height; l++) {
+			for (b = 0; b < count; b++) {
+				if (idx[b] >= bt->bt_nodes[l]) {
+					idx[b] = UINT32_MAX;
+					continue;
+				}
+				node = &bt->bt_keys[(bt->bt_off[l] + idx[b]) *
+				    HR_BT_KEYS];
+				if (l + 1 < bt->bt_height) {
+					idx[b] = idx[b] * (HR_BT_KEYS + 1) +
+					    rank(node, hashes[b]);
+					HR_PREFETCH(&bt->bt_keys[
+					    (bt->bt_off[l + 1] + idx[b]) *
+					    HR_BT_KEYS]);
+				} else
+					idx[b] = idx[b] * HR_BT_KEYS +
+					    rank(node, hashes[b]);
+			}
+		}
+		for (b = 0; b < count; b++)
+			if (idx[b] > h->hr_ring_used)
+				idx[b] = h->hr_ring_used;
+		return;
+	}
+
+	if (h->hr_lookup == HR_LOOKUP_PREFIX) {
+		const struct hr_prefix *pf = &h->hr_prefix;
+		unsigned shift = 32 - pf->pf_bits;
+
+		for (b = 0; b < count; b++)
+			HR_PREFETCH(&pf->pf_start[hashes[b] >> shift]);
+		for (b = 0; b < count; b++) {
+			idx[b] = pf->pf_start[hashes[b] >> shift];
+			HR_PREFETCH(&ring[idx[b]]);
+		}
+		for (b = 0; b < count; b++)
+			idx[b] = range_search_impl(ring, h->hr_ring_used,
+			    hashes[b], idx[b],
+			    pf->pf_start[(hashes[b] >> shift) + 1], rank);
+		return;
+	}
+
+	if (h->hr_lookup == HR_LOOKUP_INTERP) {
+		/* Get every key's first probe in flight. */
+		for (b = 0; b < count; b++)
+			HR_PREFETCH(&ring[(uint64_t)hashes[b] *
+			    h->hr_ring_used >> 32]);
+		for (b = 0; b < count; b++)
+			idx[b] = interp_search_impl(ring, h->hr_ring_used,
+			    hashes[b], rank);
+		return;
+	}
+
+	for (len = h->hr_ring_used; len > HR_BT_KEYS; len -= half) {
+		half = len / 2;
+		next = (len - half) / 2;
+
+		for (b = 0; b < count; b++) {
+			/* Branchless; the outcome is a coin flip. */
+			idx[b] += half & -(uint32_t)(ring[idx[b] + half] <
+			    hashes[b]);
+			HR_PREFETCH(&ring[idx[b] + next]);
+		}
+	}
+
+	for (b = 0; b < count; b++) {
+		if (idx[b] + HR_BT_KEYS > h->hr_ring_used)
+			idx[b] = h->hr_ring_used - HR_BT_KEYS;
+		idx[b] += rank(&ring[idx[b]], hashes[b]);
+	}
+}
+
+static uint32_t
+keys_search_scalar(const uint32_t *keys, size_t nkeys, uint32_t hash)
+{
+
+	return ring_bsearch_impl(keys, nkeys, hash, rank_scalar);
+}
+
+static uint32_t
+ring_search_scalar(const struct hash_ring *h, uint32_t hash)
+{
+
+	return ring_search_impl(h, hash, rank_scalar);
+}
+
+static void
+ring_search_batch_scalar(const struct hash_ring *h, const uint32_t *hashes,
+    size_t count, uint32_t *idx)
+{
+
+	ring_search_batch_impl(h, hashes, count, idx, rank_scalar);
+}
+
+#ifdef HR_SIMD_X86
+static HR_TARGET("sse2") uint32_t
+keys_search_sse2(const uint32_t *keys, size_t nkeys, uint32_t hash)
+{
+
+	return ring_bsearch_impl(keys, nkeys, hash, rank_sse2);
+}
+
+static HR_TARGET("sse2") uint32_t
+ring_search_sse2(const struct hash_ring *h, uint32_t hash)
+{
+
+	return ring_search_impl(h, hash, rank_sse2);
+}
+
+static HR_TARGET("sse2") void
+ring_search_batch_sse2(const struct hash_ring *h, const uint32_t *hashes,
+    size_t count, uint32_t *idx)
+{
+
+	ring_search_batch_impl(h, hashes, count, idx, rank_sse2);
+}
+
+static HR_TARGET("avx2,popcnt") uint32_t
+keys_search_avx2(const uint32_t *keys, size_t nkeys, uint32_t hash)
+{
+
+	return ring_bsearch_impl(keys, nkeys, hash, rank_avx2);
+}
+
+static HR_TARGET("avx2,popcnt") uint32_t
+ring_search_avx2(const struct hash_ring *h, uint32_t hash)
+{
+
+	return ring_search_impl(h, hash, rank_avx2);
+}
+
+static HR_TARGET("avx2,popcnt") void
+ring_search_batch_avx2(const struct hash_ring *h, const uint32_t *hashes,
+    size_t count, uint32_t *idx)
+{
+
+	ring_search_batch_impl(h, hashes, count, idx, rank_avx2);
+}
+#endif /* HR_SIMD_X86 */
+
+/*
+ * Find the smallest 'i' for which hr_ring_hash[i] >= hash, or hr_ring_used if
+ * there is none.
+ */
+static uint32_t
+ring_search(const struct hash_ring *h, uint32_t hash)
+{
+
+	switch (h->hr_simd) {
+#ifdef HR_SIMD_X86
+	case HR_SIMD_AVX2:
+		return ring_search_avx2(h, hash);
+	case HR_SIMD_SSE2:
+		return ring_search_sse2(h, hash);
+#endif
+	default:
+		return ring_search_scalar(h, hash);
+	}
+}
+
+/* ring_search(), over some other sorted array of @nkeys hashes. */
+static uint32_t
+keys_search(const struct hash_ring *h, const uint32_t *keys, size_t nkeys,
+    uint32_t hash)
+{
+
+	switch (h->hr_simd) {
+#ifdef HR_SIMD_X86
+	case HR_SIMD_AVX2:
+		return keys_search_avx2(keys, nkeys, hash);
+	case HR_SIMD_SSE2:
+		return keys_search_sse2(keys, nkeys, hash);
+#endif
+	default:
+		return keys_search_scalar(keys, nkeys, hash);
+	}
+}
+
+static void
+ring_search_batch(const struct hash_ring *h, const uint32_t *hashes,
+    size_t count, uint32_t *idx)
+{
+
+	switch (h->hr_simd) {
+#ifdef HR_SIMD_X86
+	case HR_SIMD_AVX2:
+		ring_search_batch_avx2(h, hashes, count, idx);
+		break;
+	case HR_SIMD_SSE2:
+		ring_search_batch_sse2(h, hashes, count, idx);
+		break;
+#endif
+	default:
+		ring_search_batch_scalar(h, hashes, count, idx);
+		break;
+	}
+}
+
+/* The best search kernel this CPU can run. */
+static enum hr_simd
+hr_simd_detect(void)
+{
+
+#ifdef HR_SIMD_X86
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+		return HR_SIMD_AVX2;
+	return HR_SIMD_SSE2;
+#else
+	return HR_SIMD_SCALAR;
+#endif
 }
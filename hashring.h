@@ -11,7 +11,8 @@
  * Note: Users are responsible for ensuring access is appropriately serialized.
  * 'clean()', 'add()', and 'remove()' should be performed only with exclusive
  * access. 'getn()' can be performed with shared locking (so long as the
- * modifying calls are excluded).
+ * modifying calls are excluded). In userland, hashring_rcu.h and
+ * hashring_seq.h wrap a ring so that lookups need no lock at all.
  */
 
 #ifndef _HASHRING_H_
@@ -38,6 +39,22 @@ struct malloc_type;
 
 typedef uint32_t	(*hr_hasher_t)(const void *, size_t);
 
+/*
+ * Optional batch hasher for a member's vnodes: stores in @out[i], for each 'i'
+ * below @n, what the ring's hr_hasher_t gives for the 8-byte key made of
+ * @member and then @first + i, each as 32-bit little-endian.
+ */
+typedef void		(*hr_vnode_hasher_t)(uint32_t member, uint32_t first,
+					     uint32_t n, uint32_t *out);
+
+/* Lookup strategies for hash_ring_index(). */
+enum hr_lookup {
+	HR_LOOKUP_BSEARCH = 0,	/* Binary search of the ring (default) */
+	HR_LOOKUP_BTREE,	/* Static 16-ary B+tree over ring hashes */
+	HR_LOOKUP_PREFIX,	/* Jump table indexed by top bits of hash */
+	HR_LOOKUP_INTERP,	/* Interpolation search of the ring */
+};
+
 struct hash_ring;
 
 /*
@@ -47,6 +64,60 @@ struct hash_ring;
 void	hash_ring_init(struct hash_ring *h, hr_hasher_t hash,
 		       struct malloc_type *mt, uint32_t nreplicas);
 
+/*
+ * Optional allocator for hash_ring_init_alloc(). ha_realloc may be NULL, and
+ * is passed the old size of the block. All are passed ha_ctx.
+ */
+struct hr_allocator {
+	void	*(*ha_alloc)(void *ctx, size_t sz);
+	void	*(*ha_realloc)(void *ctx, void *p, size_t oldsz, size_t sz);
+	void	 (*ha_free)(void *ctx, void *p);
+	void	*ha_ctx;
+};
+
+/*
+ * Like hash_ring_init(), but @h gets all its memory from @alloc (which must
+ * outlive it) instead of from its callers. Calls which take a buffer then
+ * allocate one themselves when what they're passed (NULL, say) is too small,
+ * so they only return a size if @alloc fails. Any buffers passed in must come
+ * from @alloc too, as they are freed to it. remove() only allocates when it
+ * must rehash or shrink the ring, and add() none while the ring has room.
+ */
+void	hash_ring_init_alloc(struct hash_ring *h, hr_hasher_t hash,
+			     const struct hr_allocator *alloc,
+			     uint32_t nreplicas);
+
+/*
+ * Has @h hash vnodes with @fn, which must agree exactly with its hasher, in
+ * batches. Adds, removes and builds spend most of their time hashing vnodes;
+ * a vectorized @fn (see isi_hash32_vnodes() and MurmurHash3_x86_32_vnodes())
+ * makes them much cheaper. NULL goes back to calling the hasher per vnode.
+ */
+void	hash_ring_set_vnode_hasher(struct hash_ring *h, hr_vnode_hasher_t fn);
+
+/*
+ * Optional workers for hash_ring_set_workers(). hw_run calls @fn(@arg, i) for
+ * each 'i' below @ntasks, up to hw_nworkers of them at once, and returns when
+ * all have. It is passed hw_ctx.
+ */
+typedef void		(*hr_task_t)(void *arg, unsigned i);
+
+struct hr_workers {
+	void	(*hw_run)(void *ctx, hr_task_t fn, void *arg, unsigned ntasks);
+	void	*hw_ctx;
+	unsigned hw_nworkers;
+};
+
+/*
+ * Has build() hash and sort the vnodes of a large ring on @w (which must
+ * outlive @h), calling the ring's hashers from several workers at once. The
+ * ring built is the same, byte for byte. This needs scratch space as large as
+ * the ring, so only rings with an allocator (see hash_ring_init_alloc()) use
+ * @w, and build() stays serial if the allocator fails. NULL goes back to
+ * serial builds. In userland, hashring_pool.h provides a thread pool.
+ */
+void	hash_ring_set_workers(struct hash_ring *h, const struct hr_workers *w);
+
 /* Cleans a hash_ring @h. */
 void	hash_ring_clean(struct hash_ring *h);
 
@@ -57,21 +128,65 @@ void	hash_ring_clean(struct hash_ring *h);
  * the ring.
  *
  * If newmemb isn't big enough, fails and returns a size of buffer for caller
- * to allocate. On success, returns zero.
+ * to allocate. On success, returns zero. The size asked for grows the ring
+ * geometrically, so a run of adds only rarely needs a new buffer; a smaller
+ * buffer that still fits this add is accepted too.
  *
  * Only the low 24 bits of member are usable.
  */
 size_t	hash_ring_add(struct hash_ring *h, uint32_t member, unsigned weightpct,
 		      void *newmemb, size_t sz);
 
+/*
+ * Grows @h to hold @nmembers members at full weight, so that adding up to that
+ * many takes no further buffers. remove() won't shrink it below that either.
+ *
+ * Like add(), if buf isn't big enough, fails and returns a size of buffer for
+ * caller to allocate. The passed buf is either kept or freed. On success,
+ * returns zero.
+ */
+size_t	hash_ring_reserve(struct hash_ring *h, uint32_t nmembers, void *buf,
+			  size_t sz);
+
+/*
+ * A member and its weight, for hash_ring_build().
+ */
+struct hr_member {
+	uint32_t	hm_member;
+	unsigned	hm_weightpct;
+};
+
+/*
+ * Replaces the contents of @h with the @nmembers members in @members, each
+ * with its @hm_weightpct (1-100). The result is exactly the ring that adding
+ * them one by one to an empty ring would produce, but takes O(N log N) time
+ * for N ring entries, instead of O(N^2). Each member may appear only once.
+ * With workers (see hash_ring_set_workers()), large rings are built in
+ * parallel.
+ *
+ * Like add(), if buf isn't big enough, fails and returns a size of buffer for
+ * caller to allocate. On success, returns zero.
+ */
+size_t	hash_ring_build(struct hash_ring *h, const struct hr_member *members,
+			size_t nmembers, void *buf, size_t sz);
+
 /*
  * Decreases the @weightpct (0-99) of @member in @h (potentially to zero, i.e.,
  * full removal). If the member is already absent or its weight is less than
  * @weightpct, does nothing. As with hash_ring_add(), a non-zero @weightpct
  * will always round up to at least one entry in the ring.
  *
+ * Entries of other members which had lost a hash collision to @member's take
+ * its place, just as if it had never been added. The ring remembers those
+ * entries, so this costs about as much as an add(); only if there were too many
+ * collisions to remember does it fall back to rehashing the ring.
+ *
+ * Once the ring is less than a quarter full, it is moved into the smaller
+ * auxiliary buffer, leaving it half full (but no smaller than reserved).
+ *
  * Like add(), takes an auxiliary buf and returns a new size if this one isn't
- * big enough. The passed buf is always freed. On success, returns zero.
+ * big enough. The passed buf is either kept or freed. On success, returns
+ * zero.
  */
 size_t	hash_ring_remove(struct hash_ring *h, uint32_t member,
 			 unsigned weightpct, void *aux, size_t sz);
@@ -85,11 +200,78 @@ size_t	hash_ring_remove(struct hash_ring *h, uint32_t member,
  *
  * EINVAL - @n is zero
  * ENOENT - If the request is unsatisfiable (for example, because fewer members
- *          exist)
+ *          exist; that case is detected without walking the ring)
  */
 int	hash_ring_getn(const struct hash_ring *h, uint32_t hash, unsigned n,
 		       uint32_t *memb_out);
 
+/*
+ * Like hash_ring_getn(), for the @count keys in @hashes. The @n replicas for
+ * @hashes[k] are stored in @memb_out[k*n] through @memb_out[k*n + n-1], so
+ * @memb_out must be large enough for @count * @n results.
+ *
+ * Searches for several keys are interleaved so that their cache misses
+ * overlap; this is considerably faster than calling getn() in a loop on rings
+ * which don't fit in cache.
+ *
+ * Returns zero on success or an error code as getn() does. All keys share a
+ * ring, so either every lookup succeeds or none does.
+ */
+int	hash_ring_getn_batch(const struct hash_ring *h, const uint32_t *hashes,
+			     size_t count, unsigned n, uint32_t *memb_out);
+
+/*
+ * Returns the number of distinct members in @h: the largest @n for which
+ * getn() can succeed. Members whose every ring entry lost a hash collision to
+ * a lower-numbered member don't count. Constant time.
+ */
+uint32_t	hash_ring_nmembers(const struct hash_ring *h);
+
+/*
+ * Builds a read-optimized lookup index of kind @lookup over the current
+ * contents of @h, which getn() uses until the next add() or remove(). Those
+ * discard the index (getn() falls back to binary search); callers rebuild it
+ * once a batch of membership changes is complete. HR_LOOKUP_BSEARCH just
+ * discards any index.
+ *
+ * HR_LOOKUP_INTERP needs no index (and no buffer), so it persists across
+ * add() and remove(). It relies on ring hashes being uniformly distributed;
+ * with a poor hasher it is no faster than binary search.
+ *
+ * Like add(), if buf isn't big enough, fails and returns a size of buffer for
+ * caller to allocate. The passed buf is either kept or freed. On success,
+ * returns zero.
+ */
+size_t	hash_ring_index(struct hash_ring *h, enum hr_lookup lookup, void *buf,
+			size_t sz);
+
+/*
+ * Builds a table giving, for each ring entry, the next entry owned by a
+ * different member. getn() with @n > 1 follows it past runs of entries whose
+ * member was already found, so a lookup costs about the same however many
+ * replicas each member has. Like an index, the table is discarded by add()
+ * and remove(); callers rebuild it once membership settles.
+ *
+ * Buffer handling is as for hash_ring_index().
+ */
+size_t	hash_ring_successors(struct hash_ring *h, void *buf, size_t sz);
+
+/*
+ * Precomputes the getn() answer for every n up to @maxn (at most
+ * HR_PREFLIST_MAXN) on every arc of @h, merging adjacent arcs whose answers
+ * are the same. getn() with @n <= @maxn then costs one search of the arcs and
+ * a copy, and fails at once if fewer than @n members exist. The table takes
+ * 4 * (1 + @maxn) bytes per arc, at most one arc per ring entry. A @maxn of
+ * zero just discards it.
+ *
+ * Like an index, the table is discarded by add() and remove(). Buffer handling
+ * is as for hash_ring_index().
+ */
+#define HR_PREFLIST_MAXN	16
+
+size_t	hash_ring_preflist(struct hash_ring *h, unsigned maxn, void *buf,
+			   size_t sz);
+
 /*
  * Copies a hash_ring object.
  *
@@ -97,7 +279,9 @@ int	hash_ring_getn(const struct hash_ring *h, uint32_t hash, unsigned n,
  *
  * Given a buf m (can be null) and size of buf (can be zero), copy src to dst.
  * If m isn't big enough, returns new size for caller to allocate. On success,
- * returns zero.
+ * returns zero. The copy has no lookup index, successor table or preference
+ * lists; see hash_ring_index(), hash_ring_successors() and
+ * hash_ring_preflist().
  */
 size_t	hash_ring_copy(struct hash_ring *dst, struct hash_ring *src, void *m,
 		       size_t sz);
@@ -111,24 +295,110 @@ void hash_ring_swap(struct hash_ring *h1, struct hash_ring *h2);
  * ===============================================================
  */
 
-struct hr_kv_pair {
-	uint32_t	 kv_hash;
-	uint32_t	 kv_value;
+/*
+ * A ring entry which lost a hash collision to a lower member's.
+ */
+struct hr_shadow {
+	uint32_t	 sh_hash;
+	uint32_t	 sh_value;
+};
+
+/*
+ * Static B+tree of ring hashes, HR_BT_KEYS (one cacheline) per node. Levels
+ * are stored root first; the last level holds every ring hash in order, padded
+ * with UINT32_MAX. An inner node key is the largest hash under that child.
+ */
+#define HR_BT_KEYS	16
+#define HR_BT_MAXH	8
+
+struct hr_btree {
+	uint32_t	*bt_keys;
+	size_t		 bt_off[HR_BT_MAXH];	/* First node of each level */
+	size_t		 bt_nodes[HR_BT_MAXH];	/* No. of nodes in each level */
+	unsigned	 bt_height;
+};
+
+/*
+ * Radix jump table: pf_start[p] is the index of the first ring entry whose top
+ * pf_bits bits are at least 'p'. pf_bits grows with the ring, up to
+ * HR_PF_MAXBITS.
+ */
+#define HR_PF_MAXBITS	24
+
+struct hr_prefix {
+	uint32_t	*pf_start;
+	unsigned	 pf_bits;
+};
+
+/*
+ * Preference lists: the first pl_len distinct members from each run of ring
+ * entries that have the same list. pl_hash[r] is the last hash of run 'r', and
+ * its members are pl_memb[r*pl_len] through pl_memb[r*pl_len + pl_len-1].
+ * pl_len is pl_maxn, or the number of members if there are fewer.
+ */
+struct hr_preflist {
+	uint32_t	*pl_hash;
+	uint32_t	*pl_memb;
+	size_t		 pl_runs;
+	unsigned	 pl_len;
+	unsigned	 pl_maxn;
+};
+
+/* Instruction set of the search kernel; chosen by hash_ring_init(). */
+enum hr_simd {
+	HR_SIMD_SCALAR = 0,
+	HR_SIMD_SSE2,
+	HR_SIMD_AVX2,
 };
 
 struct hash_ring {
 	hr_hasher_t		 hr_hash_fn;
+	hr_vnode_hasher_t	 hr_vnode_fn;	/* Or NULL */
 	struct malloc_type	*hr_mtype;
+	const struct hr_allocator	*hr_alloc;	/* Or NULL */
+	const struct hr_workers	*hr_workers;	/* Or NULL */
 
-	/* Sorted hash->value map */
-	struct hr_kv_pair	*hr_ring;
-	/* In units of struct hr_kv_pair: */
+	/*
+	 * Sorted hash->value map, as parallel arrays sharing one allocation
+	 * (hashes first), so that searches only touch hashes.
+	 */
+	uint32_t		*hr_ring_hash;
+	uint32_t		*hr_ring_value;
+	/* In units of ring entries (one hash and one value): */
 	size_t			 hr_ring_used;
 	size_t			 hr_ring_capacity;
+	size_t			 hr_ring_reserved;	/* hash_ring_reserve() */
+
+	/*
+	 * Entries shadowed by hash collisions, sorted by hash and member, so
+	 * remove() can restore them. They follow the ring's values in its
+	 * allocation. If they don't fit, hr_shadow_overflow is set and remove()
+	 * rehashes instead.
+	 */
+	struct hr_shadow	*hr_shadow;
+	size_t			 hr_shadow_used;
+	size_t			 hr_shadow_capacity;
+	bool			 hr_shadow_overflow;
 
 	/* No. of replicas per member in map */
 	uint32_t		 hr_nreplicas;
 
+	/* No. of distinct members with entries in the map */
+	uint32_t		 hr_nmembers;
+
+	/* Optional lookup index; see hash_ring_index() */
+	enum hr_lookup		 hr_lookup;
+	void			*hr_index;
+	struct hr_btree		 hr_btree;
+	struct hr_prefix	 hr_prefix;
+	enum hr_simd		 hr_simd;
+
+	/* Optional table of distinct successors; see hash_ring_successors() */
+	uint32_t		*hr_succ;
+
+	/* Optional preference lists; see hash_ring_preflist() */
+	struct hr_preflist	 hr_preflist;
+
 #ifdef INVARIANTS
 	bool			 hr_initialized;
 #endif
@@ -0,0 +1,546 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Per-node hash_ring replicas; see hashring_numa.h.
+ *
+ * Readers and reclamation work as in hashring_rcu.c, except that what is
+ * published is a snapshot of one ring copied on every node, and a reader
+ * picks its own node's copy out of it.
+ *
+ * A mutator makes the new ring on node 0, from node 0's copy, then moves to
+ * each other node to copy it there, and builds each copy's extras where it
+ * is. Ring memory comes straight from mmap(), so the copy's first touch of it
+ * places it; recycled malloc() memory may already live on another node.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "hashring_numa.h"
+
+/* Keeps ring memory cacheline-aligned behind numa_alloc()'s size header */
+#define NUMA_HDR	64
+
+struct hr_numa_node {
+	cpu_set_t	nn_cpus;
+};
+
+static void *
+numa_alloc(void *ctx, size_t sz)
+{
+	char *p;
+
+	(void)ctx;
+	p = mmap(NULL, sz + NUMA_HDR, PROT_READ | PROT_WRITE,
+	    MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED)
+		return NULL;
+	*(size_t *)p = sz + NUMA_HDR;
+	return p + NUMA_HDR;
+}
+
+static void
+numa_free(void *ctx, void *p)
+{
+	char *base = (char *)p - NUMA_HDR;
+
+	(void)ctx;
+	munmap(base, *(size_t *)base);
+}
+
+static const struct hr_allocator numa_allocator = {
+	numa_alloc, NULL, numa_free, NULL
+};
+
+static void
+numa_ring_free(struct hash_ring *ring)
+{
+
+	hash_ring_clean(ring);
+	numa_free(NULL, ring);
+}
+
+static void
+numa_snap_free(const struct hash_ring_numa *n, struct hr_numa_snap *ns)
+{
+
+	for (unsigned i = 0; i < n->hrn_nnodes; i++)
+		if (ns->ns_ring[i] != NULL)
+			numa_ring_free(ns->ns_ring[i]);
+	free(ns);
+}
+
+/* Parses a sysfs CPU list, like "0-3,8-11", into @set. */
+static void
+numa_parse_cpus(const char *list, cpu_set_t *set)
+{
+	unsigned long lo, hi;
+	char *end;
+
+	CPU_ZERO(set);
+	while (*list >= '0' && *list <= '9') {
+		lo = hi = strtoul(list, &end, 10);
+		if (*end == '-')
+			hi = strtoul(end + 1, &end, 10);
+		for (; lo <= hi && lo < CPU_SETSIZE; lo++)
+			CPU_SET(lo, set);
+		list = (*end == ',') ? end + 1 : end;
+	}
+}
+
+/*
+ * Finds the system's nodes with CPUs, or failing that, makes one node of the
+ * CPUs we may run on. Returns how many.
+ */
+static unsigned
+numa_detect(struct hr_numa_node *sys)
+{
+	char path[64], list[4096];
+	unsigned nsys = 0;
+	FILE *f;
+
+	for (unsigned i = 0; i < HR_NUMA_MAXNODES; i++) {
+		snprintf(path, sizeof path,
+		    "/sys/devices/system/node/node%u/cpulist", i);
+		f = fopen(path, "r");
+		if (f == NULL)
+			continue;
+		if (fgets(list, sizeof list, f) != NULL) {
+			numa_parse_cpus(list, &sys[nsys].nn_cpus);
+			if (CPU_COUNT(&sys[nsys].nn_cpus) > 0)
+				nsys++;
+		}
+		fclose(f);
+	}
+
+	if (nsys == 0) {
+		if (sched_getaffinity(0, sizeof sys[0].nn_cpus,
+		    &sys[0].nn_cpus) != 0) {
+			CPU_ZERO(&sys[0].nn_cpus);
+			CPU_SET(0, &sys[0].nn_cpus);
+		}
+		nsys = 1;
+	}
+	return nsys;
+}
+
+/*
+ * Frees every retired snapshot no reader can still be using. Called with
+ * hrn_lock held; returns true if none remain.
+ */
+static bool
+numa_reclaim(struct hash_ring_numa *n)
+{
+	struct hr_numa_snap *ns, **prev;
+	struct hr_numa_reader *rd;
+	uint64_t oldest = UINT64_MAX, e;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (rd = n->hrn_readers; rd != NULL; rd = rd->nr_next) {
+		e = __atomic_load_n(&rd->nr_epoch, __ATOMIC_ACQUIRE);
+		if (e != 0 && e < oldest)
+			oldest = e;
+	}
+
+	for (prev = &n->hrn_retired; (ns = *prev) != NULL;) {
+		if (ns->ns_epoch < oldest) {
+			*prev = ns->ns_next;
+			numa_snap_free(n, ns);
+		} else
+			prev = &ns->ns_next;
+	}
+	return (n->hrn_retired == NULL);
+}
+
+/*
+ * Moves the mutator onto node 0, and gives it a ring there to change: a copy
+ * of the current one, or if not @copy, an empty one. numa_publish() moves the
+ * mutator back to @saved.
+ */
+static struct hash_ring *
+numa_first(struct hash_ring_numa *n, bool copy, cpu_set_t *saved)
+{
+	struct hash_ring *ring;
+
+	if (sched_getaffinity(0, sizeof *saved, saved) != 0)
+		CPU_ZERO(saved);
+	(void)hash_ring_numa_bind(n, 0);
+
+	ring = numa_alloc(NULL, sizeof *ring);
+	if (ring == NULL)
+		return NULL;
+	hash_ring_init_alloc(ring, n->hrn_hash, &numa_allocator,
+	    n->hrn_nreplicas);
+	if (copy && hash_ring_copy(ring, n->hrn_snap->ns_ring[0], NULL,
+	    0) != 0) {
+		numa_free(NULL, ring);
+		return NULL;
+	}
+	return ring;
+}
+
+/* Gives @ring the configured index, successors and preference lists. */
+static int
+numa_extras(const struct hash_ring_numa *n, struct hash_ring *ring)
+{
+
+	if (n->hrn_lookup != HR_LOOKUP_BSEARCH &&
+	    hash_ring_index(ring, n->hrn_lookup, NULL, 0) != 0)
+		return ENOMEM;
+	if (n->hrn_succ && hash_ring_successors(ring, NULL, 0) != 0)
+		return ENOMEM;
+	if (n->hrn_maxn != 0 &&
+	    hash_ring_preflist(ring, n->hrn_maxn, NULL, 0) != 0)
+		return ENOMEM;
+	return 0;
+}
+
+/*
+ * Copies @first to every other node, gives each copy its extras, publishes
+ * them and retires the current snapshot. On @error, or if any of that fails,
+ * frees them instead. Either way, moves the mutator back to @saved. Called
+ * with hrn_lock held.
+ */
+static int
+numa_publish(struct hash_ring_numa *n, struct hash_ring *first, int error,
+    const cpu_set_t *saved)
+{
+	struct hr_numa_snap *ns = NULL, *old;
+	struct hash_ring *ring;
+
+	if (first == NULL)
+		error = ENOMEM;
+	if (error == 0 && (ns = calloc(1, sizeof *ns +
+	    n->hrn_nnodes * sizeof ns->ns_ring[0])) == NULL)
+		error = ENOMEM;
+	if (error == 0) {
+		ns->ns_ring[0] = first;
+		error = numa_extras(n, first);
+	}
+	for (unsigned i = 1; error == 0 && i < n->hrn_nnodes; i++) {
+		(void)hash_ring_numa_bind(n, i);
+		ring = numa_alloc(NULL, sizeof *ring);
+		if (ring == NULL) {
+			error = ENOMEM;
+			break;
+		}
+		if (hash_ring_copy(ring, first, NULL, 0) != 0) {
+			numa_free(NULL, ring);
+			error = ENOMEM;
+			break;
+		}
+		ns->ns_ring[i] = ring;
+		error = numa_extras(n, ring);
+	}
+
+	if (CPU_COUNT(saved) > 0)
+		(void)sched_setaffinity(0, sizeof *saved, saved);
+
+	if (error != 0) {
+		if (ns != NULL)
+			numa_snap_free(n, ns);
+		else if (first != NULL)
+			numa_ring_free(first);
+		return error;
+	}
+
+	old = n->hrn_snap;
+	__atomic_store_n(&n->hrn_snap, ns, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	if (old != NULL) {
+		old->ns_epoch = n->hrn_epoch;
+		old->ns_next = n->hrn_retired;
+		n->hrn_retired = old;
+	}
+	__atomic_store_n(&n->hrn_epoch, n->hrn_epoch + 1, __ATOMIC_RELEASE);
+
+	(void)numa_reclaim(n);
+	return 0;
+}
+
+int
+hash_ring_numa_init(struct hash_ring_numa *n, hr_hasher_t hash,
+    uint32_t nreplicas, unsigned nnodes)
+{
+	cpu_set_t saved;
+	int error;
+
+	n->hrn_sys = malloc(HR_NUMA_MAXNODES * sizeof *n->hrn_sys);
+	if (n->hrn_sys == NULL)
+		return ENOMEM;
+	n->hrn_nsys = numa_detect(n->hrn_sys);
+	if (nnodes == 0)
+		nnodes = n->hrn_nsys;
+	n->hrn_nnodes = (nnodes < HR_NUMA_MAXNODES) ? nnodes :
+	    HR_NUMA_MAXNODES;
+
+	error = pthread_mutex_init(&n->hrn_lock, NULL);
+	if (error != 0) {
+		free(n->hrn_sys);
+		return error;
+	}
+	n->hrn_snap = NULL;
+	n->hrn_epoch = 1;
+	n->hrn_readers = NULL;
+	n->hrn_retired = NULL;
+	n->hrn_hash = hash;
+	n->hrn_nreplicas = nreplicas;
+	n->hrn_lookup = HR_LOOKUP_BSEARCH;
+	n->hrn_succ = false;
+	n->hrn_maxn = 0;
+
+	error = numa_publish(n, numa_first(n, false, &saved), 0, &saved);
+	if (error != 0) {
+		pthread_mutex_destroy(&n->hrn_lock);
+		free(n->hrn_sys);
+	}
+	return error;
+}
+
+void
+hash_ring_numa_clean(struct hash_ring_numa *n)
+{
+	struct hr_numa_snap *ns;
+
+	while ((ns = n->hrn_retired) != NULL) {
+		n->hrn_retired = ns->ns_next;
+		numa_snap_free(n, ns);
+	}
+	numa_snap_free(n, n->hrn_snap);
+	n->hrn_snap = NULL;
+	pthread_mutex_destroy(&n->hrn_lock);
+	free(n->hrn_sys);
+}
+
+unsigned
+hash_ring_numa_nnodes(const struct hash_ring_numa *n)
+{
+
+	return n->hrn_nnodes;
+}
+
+int
+hash_ring_numa_bind(const struct hash_ring_numa *n, unsigned node)
+{
+	const cpu_set_t *cpus;
+
+	if (node >= n->hrn_nnodes)
+		return EINVAL;
+	cpus = &n->hrn_sys[node % n->hrn_nsys].nn_cpus;
+	if (sched_setaffinity(0, sizeof *cpus, cpus) != 0)
+		return errno;
+	return 0;
+}
+
+unsigned
+hash_ring_numa_node(const struct hash_ring_numa *n)
+{
+	int cpu = sched_getcpu();
+
+	for (unsigned i = 0; cpu >= 0 && i < n->hrn_nsys; i++)
+		if (CPU_ISSET(cpu, &n->hrn_sys[i].nn_cpus))
+			return i % n->hrn_nnodes;
+	return 0;
+}
+
+void
+hash_ring_numa_register(struct hash_ring_numa *n, struct hr_numa_reader *rd,
+    unsigned node)
+{
+
+	rd->nr_epoch = 0;
+	rd->nr_node = node % n->hrn_nnodes;
+	pthread_mutex_lock(&n->hrn_lock);
+	rd->nr_next = n->hrn_readers;
+	n->hrn_readers = rd;
+	pthread_mutex_unlock(&n->hrn_lock);
+}
+
+void
+hash_ring_numa_unregister(struct hash_ring_numa *n, struct hr_numa_reader *rd)
+{
+	struct hr_numa_reader **prev;
+
+	pthread_mutex_lock(&n->hrn_lock);
+	for (prev = &n->hrn_readers; *prev != NULL; prev = &(*prev)->nr_next) {
+		if (*prev == rd) {
+			*prev = rd->nr_next;
+			break;
+		}
+	}
+	(void)numa_reclaim(n);
+	pthread_mutex_unlock(&n->hrn_lock);
+}
+
+const struct hash_ring *
+hash_ring_numa_enter(struct hash_ring_numa *n, struct hr_numa_reader *rd)
+{
+	const struct hr_numa_snap *ns;
+
+	__atomic_store_n(&rd->nr_epoch,
+	    __atomic_load_n(&n->hrn_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	ns = __atomic_load_n(&n->hrn_snap, __ATOMIC_ACQUIRE);
+	return ns->ns_ring[rd->nr_node];
+}
+
+void
+hash_ring_numa_exit(struct hash_ring_numa *n, struct hr_numa_reader *rd)
+{
+
+	(void)n;
+	__atomic_store_n(&rd->nr_epoch, 0, __ATOMIC_RELEASE);
+}
+
+int
+hash_ring_numa_getn(struct hash_ring_numa *n, struct hr_numa_reader *rd,
+    uint32_t hash, unsigned count, uint32_t *memb_out)
+{
+	const struct hash_ring *ring;
+	int error;
+
+	ring = hash_ring_numa_enter(n, rd);
+	error = hash_ring_getn(ring, hash, count, memb_out);
+	hash_ring_numa_exit(n, rd);
+	return error;
+}
+
+int
+hash_ring_numa_add(struct hash_ring_numa *n, uint32_t member,
+    unsigned weightpct)
+{
+	struct hash_ring *first;
+	cpu_set_t saved;
+	int error = 0;
+
+	pthread_mutex_lock(&n->hrn_lock);
+	first = numa_first(n, true, &saved);
+	if (first != NULL &&
+	    hash_ring_add(first, member, weightpct, NULL, 0) != 0)
+		error = ENOMEM;
+	error = numa_publish(n, first, error, &saved);
+	pthread_mutex_unlock(&n->hrn_lock);
+	return error;
+}
+
+int
+hash_ring_numa_remove(struct hash_ring_numa *n, uint32_t member,
+    unsigned weightpct)
+{
+	struct hash_ring *first;
+	cpu_set_t saved;
+	int error = 0;
+
+	pthread_mutex_lock(&n->hrn_lock);
+	first = numa_first(n, true, &saved);
+	if (first != NULL &&
+	    hash_ring_remove(first, member, weightpct, NULL, 0) != 0)
+		error = ENOMEM;
+	error = numa_publish(n, first, error, &saved);
+	pthread_mutex_unlock(&n->hrn_lock);
+	return error;
+}
+
+int
+hash_ring_numa_build(struct hash_ring_numa *n, const struct hr_member *members,
+    size_t nmembers)
+{
+	struct hash_ring *first;
+	cpu_set_t saved;
+	int error = 0;
+
+	/* Nothing of the old ring is kept, so don't copy it. */
+	pthread_mutex_lock(&n->hrn_lock);
+	first = numa_first(n, false, &saved);
+	if (first != NULL &&
+	    hash_ring_build(first, members, nmembers, NULL, 0) != 0)
+		error = ENOMEM;
+	error = numa_publish(n, first, error, &saved);
+	pthread_mutex_unlock(&n->hrn_lock);
+	return error;
+}
+
+/*
+ * Publish copies with the extras as now configured; on failure, go back to
+ * the old configuration.
+ */
+static int
+numa_reconfigure(struct hash_ring_numa *n, enum hr_lookup lookup, bool succ,
+    unsigned maxn)
+{
+	enum hr_lookup olookup = n->hrn_lookup;
+	bool osucc = n->hrn_succ;
+	unsigned omaxn = n->hrn_maxn;
+	cpu_set_t saved;
+	int error;
+
+	n->hrn_lookup = lookup;
+	n->hrn_succ = succ;
+	n->hrn_maxn = maxn;
+	error = numa_publish(n, numa_first(n, true, &saved), 0, &saved);
+	if (error != 0) {
+		n->hrn_lookup = olookup;
+		n->hrn_succ = osucc;
+		n->hrn_maxn = omaxn;
+	}
+	return error;
+}
+
+int
+hash_ring_numa_index(struct hash_ring_numa *n, enum hr_lookup lookup)
+{
+	int error;
+
+	pthread_mutex_lock(&n->hrn_lock);
+	error = numa_reconfigure(n, lookup, n->hrn_succ, n->hrn_maxn);
+	pthread_mutex_unlock(&n->hrn_lock);
+	return error;
+}
+
+int
+hash_ring_numa_successors(struct hash_ring_numa *n)
+{
+	int error;
+
+	pthread_mutex_lock(&n->hrn_lock);
+	error = numa_reconfigure(n, n->hrn_lookup, true, n->hrn_maxn);
+	pthread_mutex_unlock(&n->hrn_lock);
+	return error;
+}
+
+int
+hash_ring_numa_preflist(struct hash_ring_numa *n, unsigned maxn)
+{
+	int error;
+
+	pthread_mutex_lock(&n->hrn_lock);
+	error = numa_reconfigure(n, n->hrn_lookup, n->hrn_succ, maxn);
+	pthread_mutex_unlock(&n->hrn_lock);
+	return error;
+}
+
+void
+hash_ring_numa_synchronize(struct hash_ring_numa *n)
+{
+	bool done;
+
+	for (;;) {
+		pthread_mutex_lock(&n->hrn_lock);
+		done = numa_reclaim(n);
+		pthread_mutex_unlock(&n->hrn_lock);
+		if (done)
+			break;
+		sched_yield();
+	}
+}
@@ -0,0 +1,145 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * A hash_ring replicated per NUMA node, for read-mostly use from many
+ * sockets. Each node has its own copy of the ring and of its lookup index,
+ * successors and preference lists, in memory local to it; readers look up in
+ * their own node's copy, so lookups don't cross the interconnect.
+ *
+ * As in hashring_rcu.h, lookups are lock-free. A mutator builds a new copy
+ * for every node and publishes them all at once, with one pointer swap, so
+ * readers on every node move to the new ring together. Replaced copies are
+ * reclaimed once no reader can still be using them.
+ *
+ * Nodes and their CPUs come from /sys/devices/system/node. Memory is placed
+ * by first touch: a mutator moves itself onto each node in turn to make that
+ * node's copy, in pages fresh from mmap(). Reader threads should be bound to
+ * a node (hash_ring_numa_bind() does that), and read its copy.
+ *
+ * Userland (Linux) only.
+ */
+
+#ifndef _HASHRING_NUMA_H_
+#define _HASHRING_NUMA_H_
+
+#include <pthread.h>
+
+#include "hashring.h"
+
+/* Most nodes a ring is replicated on */
+#define HR_NUMA_MAXNODES	64
+
+struct hash_ring_numa;
+
+/*
+ * Per-thread reader state, registered with hash_ring_numa_register() before
+ * the thread's first lookup. Each is padded to a cacheline of its own.
+ */
+struct hr_numa_reader {
+	uint64_t		 nr_epoch;	/* 0 when quiescent */
+	struct hr_numa_reader	*nr_next;
+	unsigned		 nr_node;
+	char			 nr_pad[64 - sizeof(uint64_t) - sizeof(void *) -
+				     sizeof(unsigned)];
+} __attribute__((__aligned__(64)));
+
+/*
+ * Initializes @n with an empty ring of @nreplicas replicas hashed by @hash,
+ * copied on each of @nnodes nodes. Zero means one copy per NUMA node; more
+ * than there are wraps around them, and 1 keeps one copy for all. Returns
+ * zero, or an errno.
+ */
+int	hash_ring_numa_init(struct hash_ring_numa *n, hr_hasher_t hash,
+			    uint32_t nreplicas, unsigned nnodes);
+
+/* Frees @n and every copy. No readers may be inside it. */
+void	hash_ring_numa_clean(struct hash_ring_numa *n);
+
+/* How many copies @n keeps. */
+unsigned	hash_ring_numa_nnodes(const struct hash_ring_numa *n);
+
+/* Binds the calling thread to the CPUs of @node. Returns zero, or an errno. */
+int	hash_ring_numa_bind(const struct hash_ring_numa *n, unsigned node);
+
+/* The node whose copy is local to the CPU the caller is running on. */
+unsigned	hash_ring_numa_node(const struct hash_ring_numa *n);
+
+/*
+ * Adds or removes the calling thread's @rd as a reader of @n. It reads
+ * @node's copy; normally hash_ring_numa_node()'s.
+ */
+void	hash_ring_numa_register(struct hash_ring_numa *n,
+				struct hr_numa_reader *rd, unsigned node);
+void	hash_ring_numa_unregister(struct hash_ring_numa *n,
+				  struct hr_numa_reader *rd);
+
+/*
+ * Returns the reader's node's copy of the current ring, which stays valid
+ * (and unchanged) until the matching hash_ring_numa_exit(). Don't nest these,
+ * or mutate @n in between.
+ */
+const struct hash_ring	*hash_ring_numa_enter(struct hash_ring_numa *n,
+					      struct hr_numa_reader *rd);
+void	hash_ring_numa_exit(struct hash_ring_numa *n,
+			    struct hr_numa_reader *rd);
+
+/* hash_ring_getn() between enter() and exit(). */
+int	hash_ring_numa_getn(struct hash_ring_numa *n,
+			    struct hr_numa_reader *rd, uint32_t hash,
+			    unsigned count, uint32_t *memb_out);
+
+/*
+ * As the hash_ring_*() call of the same name, applied to every copy. index(),
+ * successors() and preflist() settings carry over to later rings. Return
+ * zero on success, or ENOMEM.
+ */
+int	hash_ring_numa_add(struct hash_ring_numa *n, uint32_t member,
+			   unsigned weightpct);
+int	hash_ring_numa_remove(struct hash_ring_numa *n, uint32_t member,
+			      unsigned weightpct);
+int	hash_ring_numa_build(struct hash_ring_numa *n,
+			     const struct hr_member *members, size_t nmembers);
+int	hash_ring_numa_index(struct hash_ring_numa *n, enum hr_lookup lookup);
+int	hash_ring_numa_successors(struct hash_ring_numa *n);
+int	hash_ring_numa_preflist(struct hash_ring_numa *n, unsigned maxn);
+
+/* Waits until every replaced ring is reclaimed. */
+void	hash_ring_numa_synchronize(struct hash_ring_numa *n);
+
+/*
+ * ===============================================================
+ * Private! Do not access any of these directly.
+ * ===============================================================
+ */
+
+/* One ring, copied on every node; published and retired as a whole. */
+struct hr_numa_snap {
+	struct hr_numa_snap	*ns_next;	/* Retired list */
+	uint64_t		 ns_epoch;	/* Retired in */
+	struct hash_ring	*ns_ring[];	/* By node */
+};
+
+struct hr_numa_node;
+
+struct hash_ring_numa {
+	struct hr_numa_snap	*hrn_snap __attribute__((__aligned__(64)));
+	uint64_t		 hrn_epoch;
+	unsigned		 hrn_nnodes;
+
+	/* Mutator state, under hrn_lock. */
+	pthread_mutex_t		 hrn_lock __attribute__((__aligned__(64)));
+	struct hr_numa_reader	*hrn_readers;
+	struct hr_numa_snap	*hrn_retired;
+	struct hr_numa_node	*hrn_sys;	/* System nodes' CPUs */
+	unsigned		 hrn_nsys;
+	hr_hasher_t		 hrn_hash;
+	uint32_t		 hrn_nreplicas;
+	enum hr_lookup		 hrn_lookup;
+	bool			 hrn_succ;
+	unsigned		 hrn_maxn;
+};
+
+#endif  /* _HASHRING_NUMA_H_ */
@@ -0,0 +1,155 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Thread pool for hr_workers; see hashring_pool.h.
+ *
+ * A call publishes its task function and bumps hrp_gen; the caller and each
+ * thread that wakes for it then claim tasks from hrp_next until none are
+ * left. Claiming threads are counted in hrp_busy, and a call neither returns
+ * nor starts while any are, so a thread can't claim a task of one call with
+ * the function of another.
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "hashring_pool.h"
+
+static void
+pool_claim(struct hash_ring_pool *p, hr_task_t fn, void *arg, unsigned ntasks)
+{
+	unsigned i;
+
+	while ((i = __atomic_fetch_add(&p->hrp_next, 1, __ATOMIC_RELAXED)) <
+	    ntasks)
+		fn(arg, i);
+}
+
+static void *
+pool_thread(void *arg)
+{
+	struct hash_ring_pool *p = arg;
+	unsigned long seen = 0;
+	hr_task_t fn;
+	void *fnarg;
+	unsigned ntasks;
+
+	pthread_mutex_lock(&p->hrp_lock);
+	for (;;) {
+		while (!p->hrp_stop && p->hrp_gen == seen)
+			pthread_cond_wait(&p->hrp_start, &p->hrp_lock);
+		if (p->hrp_stop)
+			break;
+
+		seen = p->hrp_gen;
+		fn = p->hrp_fn;
+		fnarg = p->hrp_arg;
+		ntasks = p->hrp_ntasks;
+		p->hrp_busy++;
+		pthread_mutex_unlock(&p->hrp_lock);
+
+		pool_claim(p, fn, fnarg, ntasks);
+
+		pthread_mutex_lock(&p->hrp_lock);
+		if (--p->hrp_busy == 0)
+			pthread_cond_signal(&p->hrp_done);
+	}
+	pthread_mutex_unlock(&p->hrp_lock);
+	return NULL;
+}
+
+static void
+pool_run(void *ctx, hr_task_t fn, void *arg, unsigned ntasks)
+{
+	struct hash_ring_pool *p = ctx;
+
+	pthread_mutex_lock(&p->hrp_lock);
+	/* Threads late to the last call may still be looking for tasks. */
+	while (p->hrp_busy > 0)
+		pthread_cond_wait(&p->hrp_done, &p->hrp_lock);
+	p->hrp_fn = fn;
+	p->hrp_arg = arg;
+	p->hrp_ntasks = ntasks;
+	__atomic_store_n(&p->hrp_next, 0, __ATOMIC_RELAXED);
+	p->hrp_gen++;
+	p->hrp_busy++;
+	pthread_cond_broadcast(&p->hrp_start);
+	pthread_mutex_unlock(&p->hrp_lock);
+
+	pool_claim(p, fn, arg, ntasks);
+
+	pthread_mutex_lock(&p->hrp_lock);
+	p->hrp_busy--;
+	while (p->hrp_busy > 0)
+		pthread_cond_wait(&p->hrp_done, &p->hrp_lock);
+	pthread_mutex_unlock(&p->hrp_lock);
+}
+
+int
+hash_ring_pool_init(struct hash_ring_pool *p, unsigned nworkers)
+{
+	long ncpu;
+	int error;
+
+	if (nworkers == 0) {
+		ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+		nworkers = (ncpu > 0) ? (unsigned)ncpu : 1;
+	}
+
+	p->hrp_workers.hw_run = pool_run;
+	p->hrp_workers.hw_ctx = p;
+	p->hrp_workers.hw_nworkers = nworkers;
+	p->hrp_nthreads = 0;
+	p->hrp_busy = 0;
+	p->hrp_gen = 0;
+	p->hrp_stop = false;
+
+	p->hrp_threads = malloc(nworkers * sizeof *p->hrp_threads);
+	if (p->hrp_threads == NULL)
+		return ENOMEM;
+	error = pthread_mutex_init(&p->hrp_lock, NULL);
+	if (error != 0) {
+		free(p->hrp_threads);
+		return error;
+	}
+	pthread_cond_init(&p->hrp_start, NULL);
+	pthread_cond_init(&p->hrp_done, NULL);
+
+	for (; p->hrp_nthreads + 1 < nworkers; p->hrp_nthreads++) {
+		error = pthread_create(&p->hrp_threads[p->hrp_nthreads], NULL,
+		    pool_thread, p);
+		if (error != 0) {
+			hash_ring_pool_clean(p);
+			return error;
+		}
+	}
+	return 0;
+}
+
+void
+hash_ring_pool_clean(struct hash_ring_pool *p)
+{
+
+	pthread_mutex_lock(&p->hrp_lock);
+	p->hrp_stop = true;
+	pthread_cond_broadcast(&p->hrp_start);
+	pthread_mutex_unlock(&p->hrp_lock);
+	for (unsigned i = 0; i < p->hrp_nthreads; i++)
+		pthread_join(p->hrp_threads[i], NULL);
+
+	pthread_cond_destroy(&p->hrp_done);
+	pthread_cond_destroy(&p->hrp_start);
+	pthread_mutex_destroy(&p->hrp_lock);
+	free(p->hrp_threads);
+}
+
+const struct hr_workers *
+hash_ring_pool_workers(const struct hash_ring_pool *p)
+{
+
+	return &p->hrp_workers;
+}
@@ -0,0 +1,59 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * A pool of threads to run a ring's parallel work on; see
+ * hash_ring_set_workers(). The thread calling in runs tasks too. One pool may
+ * serve any number of rings, but only one call at a time.
+ *
+ * Userland only.
+ */
+
+#ifndef _HASHRING_POOL_H_
+#define _HASHRING_POOL_H_
+
+#include <pthread.h>
+
+#include "hashring.h"
+
+struct hash_ring_pool;
+
+/*
+ * Initializes @p to run up to @nworkers tasks at once, starting one thread
+ * fewer than that. Zero means one per online CPU. Returns zero, or an errno.
+ */
+int	hash_ring_pool_init(struct hash_ring_pool *p, unsigned nworkers);
+
+/* Stops and joins @p's threads. No call may be running on it. */
+void	hash_ring_pool_clean(struct hash_ring_pool *p);
+
+/* The workers to pass to hash_ring_set_workers(). */
+const struct hr_workers	*hash_ring_pool_workers(const struct hash_ring_pool *p);
+
+/*
+ * ===============================================================
+ * Private! Do not access any of these directly.
+ * ===============================================================
+ */
+
+struct hash_ring_pool {
+	struct hr_workers	 hrp_workers;
+	pthread_t		*hrp_threads;
+	unsigned		 hrp_nthreads;
+
+	/* The call being run; all under hrp_lock, but hrp_next. */
+	pthread_mutex_t		 hrp_lock;
+	pthread_cond_t		 hrp_start;
+	pthread_cond_t		 hrp_done;
+	hr_task_t		 hrp_fn;
+	void			*hrp_arg;
+	unsigned		 hrp_ntasks;
+	unsigned		 hrp_next;	/* Next task to claim */
+	unsigned		 hrp_busy;	/* Threads claiming tasks */
+	unsigned long		 hrp_gen;	/* Calls started */
+	bool			 hrp_stop;
+};
+
+#endif  /* _HASHRING_POOL_H_ */
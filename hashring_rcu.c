@@ -0,0 +1,375 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * RCU-style publication of hash_ring snapshots; see hashring_rcu.h.
+ *
+ * hrr_epoch starts at 1 and is advanced by every publication. A reader
+ * entering stores the epoch it saw in its rr_epoch, then (after a full fence)
+ * loads the snapshot pointer; leaving, it stores 0. A mutator stores the new
+ * pointer, fences, and then advances the epoch, tagging the old snapshot with
+ * the epoch it was replaced in. A reader that saw a later epoch must also see
+ * the new pointer, so a snapshot retired in epoch 'e' is free once no reader
+ * is inside with an epoch of 'e' or earlier.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hashring_rcu.h"
+
+static void *
+rcu_alloc(void *ctx, size_t sz)
+{
+
+	(void)ctx;
+	return malloc(sz);
+}
+
+static void *
+rcu_realloc(void *ctx, void *p, size_t oldsz, size_t sz)
+{
+
+	(void)ctx;
+	(void)oldsz;
+	return realloc(p, sz);
+}
+
+static void
+rcu_free(void *ctx, void *p)
+{
+
+	(void)ctx;
+	free(p);
+}
+
+static const struct hr_allocator rcu_allocator = {
+	rcu_alloc, rcu_realloc, rcu_free, NULL
+};
+
+static void
+rcu_ring_free(struct hash_ring *ring)
+{
+
+	hash_ring_clean(ring);
+	free(ring);
+}
+
+/*
+ * Frees every retired snapshot no reader can still be using. Called with
+ * hrr_lock held; returns true if none remain.
+ */
+static bool
+rcu_reclaim(struct hash_ring_rcu *r)
+{
+	struct hr_rcu_retired *rt, **prev;
+	struct hr_rcu_reader *rd;
+	uint64_t oldest = UINT64_MAX, e;
+
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	for (rd = r->hrr_readers; rd != NULL; rd = rd->rr_next) {
+		e = __atomic_load_n(&rd->rr_epoch, __ATOMIC_ACQUIRE);
+		if (e != 0 && e < oldest)
+			oldest = e;
+	}
+
+	for (prev = &r->hrr_retired; (rt = *prev) != NULL;) {
+		if (rt->rt_epoch < oldest) {
+			*prev = rt->rt_next;
+			rcu_ring_free(rt->rt_ring);
+			free(rt);
+		} else
+			prev = &rt->rt_next;
+	}
+	return (r->hrr_retired == NULL);
+}
+
+/* A private copy of the current snapshot, for a mutator to change. */
+static struct hash_ring *
+rcu_copy(struct hash_ring_rcu *r)
+{
+	struct hash_ring *next;
+
+	next = malloc(sizeof *next);
+	if (next == NULL)
+		return NULL;
+	if (hash_ring_copy(next, r->hrr_ring, NULL, 0) != 0) {
+		free(next);
+		return NULL;
+	}
+	return next;
+}
+
+/*
+ * Gives @next the configured index, successors and preference lists, makes it
+ * the current snapshot and retires the old one. On @error, or if any of that
+ * fails, frees @next instead. Called with hrr_lock held.
+ */
+static int
+rcu_publish(struct hash_ring_rcu *r, struct hash_ring *next, int error)
+{
+	struct hr_rcu_retired *rt = NULL;
+	struct hash_ring *old;
+
+	if (next == NULL)
+		return ENOMEM;
+	if (error == 0 && r->hrr_lookup != HR_LOOKUP_BSEARCH &&
+	    hash_ring_index(next, r->hrr_lookup, NULL, 0) != 0)
+		error = ENOMEM;
+	if (error == 0 && r->hrr_succ &&
+	    hash_ring_successors(next, NULL, 0) != 0)
+		error = ENOMEM;
+	if (error == 0 && r->hrr_maxn != 0 &&
+	    hash_ring_preflist(next, r->hrr_maxn, NULL, 0) != 0)
+		error = ENOMEM;
+	if (error == 0 && (rt = malloc(sizeof *rt)) == NULL)
+		error = ENOMEM;
+	if (error != 0) {
+		rcu_ring_free(next);
+		return error;
+	}
+
+	old = r->hrr_ring;
+	__atomic_store_n(&r->hrr_ring, next, __ATOMIC_RELEASE);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+	rt->rt_ring = old;
+	rt->rt_epoch = r->hrr_epoch;
+	rt->rt_next = r->hrr_retired;
+	r->hrr_retired = rt;
+	__atomic_store_n(&r->hrr_epoch, r->hrr_epoch + 1, __ATOMIC_RELEASE);
+
+	(void)rcu_reclaim(r);
+	return 0;
+}
+
+int
+hash_ring_rcu_init(struct hash_ring_rcu *r, hr_hasher_t hash,
+    uint32_t nreplicas)
+{
+	struct hash_ring *ring;
+	int error;
+
+	ring = malloc(sizeof *ring);
+	if (ring == NULL)
+		return ENOMEM;
+	hash_ring_init_alloc(ring, hash, &rcu_allocator, nreplicas);
+
+	error = pthread_mutex_init(&r->hrr_lock, NULL);
+	if (error != 0) {
+		rcu_ring_free(ring);
+		return error;
+	}
+	r->hrr_ring = ring;
+	r->hrr_epoch = 1;
+	r->hrr_readers = NULL;
+	r->hrr_retired = NULL;
+	r->hrr_lookup = HR_LOOKUP_BSEARCH;
+	r->hrr_succ = false;
+	r->hrr_maxn = 0;
+	return 0;
+}
+
+void
+hash_ring_rcu_clean(struct hash_ring_rcu *r)
+{
+	struct hr_rcu_retired *rt;
+
+	while ((rt = r->hrr_retired) != NULL) {
+		r->hrr_retired = rt->rt_next;
+		rcu_ring_free(rt->rt_ring);
+		free(rt);
+	}
+	rcu_ring_free(r->hrr_ring);
+	r->hrr_ring = NULL;
+	pthread_mutex_destroy(&r->hrr_lock);
+}
+
+void
+hash_ring_rcu_register(struct hash_ring_rcu *r, struct hr_rcu_reader *rd)
+{
+
+	rd->rr_epoch = 0;
+	pthread_mutex_lock(&r->hrr_lock);
+	rd->rr_next = r->hrr_readers;
+	r->hrr_readers = rd;
+	pthread_mutex_unlock(&r->hrr_lock);
+}
+
+void
+hash_ring_rcu_unregister(struct hash_ring_rcu *r, struct hr_rcu_reader *rd)
+{
+	struct hr_rcu_reader **prev;
+
+	pthread_mutex_lock(&r->hrr_lock);
+	for (prev = &r->hrr_readers; *prev != NULL; prev = &(*prev)->rr_next) {
+		if (*prev == rd) {
+			*prev = rd->rr_next;
+			break;
+		}
+	}
+	(void)rcu_reclaim(r);
+	pthread_mutex_unlock(&r->hrr_lock);
+}
+
+const struct hash_ring *
+hash_ring_rcu_enter(struct hash_ring_rcu *r, struct hr_rcu_reader *rd)
+{
+
+	__atomic_store_n(&rd->rr_epoch,
+	    __atomic_load_n(&r->hrr_epoch, __ATOMIC_ACQUIRE), __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	return __atomic_load_n(&r->hrr_ring, __ATOMIC_ACQUIRE);
+}
+
+void
+hash_ring_rcu_exit(struct hash_ring_rcu *r, struct hr_rcu_reader *rd)
+{
+
+	(void)r;
+	__atomic_store_n(&rd->rr_epoch, 0, __ATOMIC_RELEASE);
+}
+
+int
+hash_ring_rcu_getn(struct hash_ring_rcu *r, struct hr_rcu_reader *rd,
+    uint32_t hash, unsigned n, uint32_t *memb_out)
+{
+	const struct hash_ring *ring;
+	int error;
+
+	ring = hash_ring_rcu_enter(r, rd);
+	error = hash_ring_getn(ring, hash, n, memb_out);
+	hash_ring_rcu_exit(r, rd);
+	return error;
+}
+
+int
+hash_ring_rcu_add(struct hash_ring_rcu *r, uint32_t member, unsigned weightpct)
+{
+	struct hash_ring *next;
+	int error = 0;
+
+	pthread_mutex_lock(&r->hrr_lock);
+	next = rcu_copy(r);
+	if (next != NULL && hash_ring_add(next, member, weightpct, NULL, 0) != 0)
+		error = ENOMEM;
+	error = rcu_publish(r, next, error);
+	pthread_mutex_unlock(&r->hrr_lock);
+	return error;
+}
+
+int
+hash_ring_rcu_remove(struct hash_ring_rcu *r, uint32_t member,
+    unsigned weightpct)
+{
+	struct hash_ring *next;
+	int error = 0;
+
+	pthread_mutex_lock(&r->hrr_lock);
+	next = rcu_copy(r);
+	if (next != NULL &&
+	    hash_ring_remove(next, member, weightpct, NULL, 0) != 0)
+		error = ENOMEM;
+	error = rcu_publish(r, next, error);
+	pthread_mutex_unlock(&r->hrr_lock);
+	return error;
+}
+
+int
+hash_ring_rcu_build(struct hash_ring_rcu *r, const struct hr_member *members,
+    size_t nmembers)
+{
+	struct hash_ring *next;
+	int error = 0;
+
+	/* Nothing of the old ring is kept, so don't copy it. */
+	pthread_mutex_lock(&r->hrr_lock);
+	next = malloc(sizeof *next);
+	if (next != NULL) {
+		hash_ring_init_alloc(next, r->hrr_ring->hr_hash_fn,
+		    &rcu_allocator, r->hrr_ring->hr_nreplicas);
+		hash_ring_set_vnode_hasher(next, r->hrr_ring->hr_vnode_fn);
+		if (hash_ring_build(next, members, nmembers, NULL, 0) != 0)
+			error = ENOMEM;
+	}
+	error = rcu_publish(r, next, error);
+	pthread_mutex_unlock(&r->hrr_lock);
+	return error;
+}
+
+/*
+ * Publish a copy with the extras as now configured; on failure, go back to
+ * the old configuration.
+ */
+static int
+rcu_reconfigure(struct hash_ring_rcu *r, enum hr_lookup lookup, bool succ,
+    unsigned maxn)
+{
+	enum hr_lookup olookup = r->hrr_lookup;
+	bool osucc = r->hrr_succ;
+	unsigned omaxn = r->hrr_maxn;
+	int error;
+
+	r->hrr_lookup = lookup;
+	r->hrr_succ = succ;
+	r->hrr_maxn = maxn;
+	error = rcu_publish(r, rcu_copy(r), 0);
+	if (error != 0) {
+		r->hrr_lookup = olookup;
+		r->hrr_succ = osucc;
+		r->hrr_maxn = omaxn;
+	}
+	return error;
+}
+
+int
+hash_ring_rcu_index(struct hash_ring_rcu *r, enum hr_lookup lookup)
+{
+	int error;
+
+	pthread_mutex_lock(&r->hrr_lock);
+	error = rcu_reconfigure(r, lookup, r->hrr_succ, r->hrr_maxn);
+	pthread_mutex_unlock(&r->hrr_lock);
+	return error;
+}
+
+int
+hash_ring_rcu_successors(struct hash_ring_rcu *r)
+{
+	int error;
+
+	pthread_mutex_lock(&r->hrr_lock);
+	error = rcu_reconfigure(r, r->hrr_lookup, true, r->hrr_maxn);
+	pthread_mutex_unlock(&r->hrr_lock);
+	return error;
+}
+
+int
+hash_ring_rcu_preflist(struct hash_ring_rcu *r, unsigned maxn)
+{
+	int error;
+
+	pthread_mutex_lock(&r->hrr_lock);
+	error = rcu_reconfigure(r, r->hrr_lookup, r->hrr_succ, maxn);
+	pthread_mutex_unlock(&r->hrr_lock);
+	return error;
+}
+
+void
+hash_ring_rcu_synchronize(struct hash_ring_rcu *r)
+{
+	bool done;
+
+	for (;;) {
+		pthread_mutex_lock(&r->hrr_lock);
+		done = rcu_reclaim(r);
+		pthread_mutex_unlock(&r->hrr_lock);
+		if (done)
+			break;
+		sched_yield();
+	}
+}
@@ -0,0 +1,124 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * A hash_ring shared between threads without a reader lock. Readers look up
+ * in an immutable snapshot of the ring; mutators copy the current snapshot,
+ * change the copy, and publish it with an atomic pointer swap. Snapshots
+ * that readers may still be using are reclaimed once every reader has since
+ * passed through a quiescent point (epoch-based reclamation).
+ *
+ * Lookups are wait-free and write only to the reader's own cacheline. Mutators
+ * are serialized by a mutex and pay for a copy of the ring each; batch
+ * membership changes with hash_ring_rcu_build().
+ *
+ * Userland only.
+ */
+
+#ifndef _HASHRING_RCU_H_
+#define _HASHRING_RCU_H_
+
+#include <pthread.h>
+
+#include "hashring.h"
+
+struct hash_ring_rcu;
+
+/*
+ * Per-thread reader state, registered with hash_ring_rcu_register() before the
+ * thread's first lookup. Each is padded to a cacheline of its own.
+ */
+struct hr_rcu_reader {
+	uint64_t		 rr_epoch;	/* 0 when quiescent */
+	struct hr_rcu_reader	*rr_next;
+	char			 rr_pad[64 - sizeof(uint64_t) - sizeof(void *)];
+} __attribute__((__aligned__(64)));
+
+/*
+ * Initializes @r with an empty ring of @nreplicas replicas hashed by @hash.
+ * Returns zero, or ENOMEM.
+ */
+int	hash_ring_rcu_init(struct hash_ring_rcu *r, hr_hasher_t hash,
+			   uint32_t nreplicas);
+
+/* Frees @r and every snapshot. No readers may be inside it. */
+void	hash_ring_rcu_clean(struct hash_ring_rcu *r);
+
+/* Adds or removes the calling thread's @rd as a reader of @r. */
+void	hash_ring_rcu_register(struct hash_ring_rcu *r,
+			       struct hr_rcu_reader *rd);
+void	hash_ring_rcu_unregister(struct hash_ring_rcu *r,
+				 struct hr_rcu_reader *rd);
+
+/*
+ * Returns the current snapshot, which stays valid (and unchanged) until the
+ * matching hash_ring_rcu_exit(). Don't nest these, or mutate @r in between.
+ */
+const struct hash_ring	*hash_ring_rcu_enter(struct hash_ring_rcu *r,
+					     struct hr_rcu_reader *rd);
+void	hash_ring_rcu_exit(struct hash_ring_rcu *r, struct hr_rcu_reader *rd);
+
+/* hash_ring_getn() on the current snapshot. */
+int	hash_ring_rcu_getn(struct hash_ring_rcu *r, struct hr_rcu_reader *rd,
+			   uint32_t hash, unsigned n, uint32_t *memb_out);
+
+/*
+ * As hash_ring_add(), hash_ring_remove() and hash_ring_build(), publishing a
+ * new snapshot. The lookup index, successor table and preference lists of the
+ * current snapshot, if any, are rebuilt for the new one. Return zero on
+ * success, or ENOMEM; on failure, the current snapshot is unchanged.
+ */
+int	hash_ring_rcu_add(struct hash_ring_rcu *r, uint32_t member,
+			  unsigned weightpct);
+int	hash_ring_rcu_remove(struct hash_ring_rcu *r, uint32_t member,
+			     unsigned weightpct);
+int	hash_ring_rcu_build(struct hash_ring_rcu *r,
+			    const struct hr_member *members, size_t nmembers);
+
+/*
+ * As hash_ring_index(), hash_ring_successors() and hash_ring_preflist() on a
+ * new snapshot; these stay in place across later mutations. Return zero or
+ * ENOMEM.
+ */
+int	hash_ring_rcu_index(struct hash_ring_rcu *r, enum hr_lookup lookup);
+int	hash_ring_rcu_successors(struct hash_ring_rcu *r);
+int	hash_ring_rcu_preflist(struct hash_ring_rcu *r, unsigned maxn);
+
+/*
+ * Waits until no reader can be using a replaced snapshot, and frees them all.
+ * Mutators otherwise free what they can without waiting.
+ */
+void	hash_ring_rcu_synchronize(struct hash_ring_rcu *r);
+
+/*
+ * ===============================================================
+ * Private! Do not access any of these directly.
+ * ===============================================================
+ */
+
+/* A replaced snapshot, and the epoch it was replaced in. */
+struct hr_rcu_retired {
+	struct hash_ring	*rt_ring;
+	uint64_t		 rt_epoch;
+	struct hr_rcu_retired	*rt_next;
+};
+
+struct hash_ring_rcu {
+	/* Read by readers; only written by mutators. */
+	struct hash_ring	*hrr_ring __attribute__((__aligned__(64)));
+	uint64_t		 hrr_epoch;
+
+	/* Mutator state, under hrr_lock. */
+	pthread_mutex_t		 hrr_lock __attribute__((__aligned__(64)));
+	struct hr_rcu_reader	*hrr_readers;
+	struct hr_rcu_retired	*hrr_retired;
+
+	/* What every new snapshot is given; see hash_ring_rcu_index() */
+	enum hr_lookup		 hrr_lookup;
+	bool			 hrr_succ;
+	unsigned		 hrr_maxn;	/* Preference lists, or 0 */
+};
+
+#endif  /* _HASHRING_RCU_H_ */
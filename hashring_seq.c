@@ -0,0 +1,284 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Sequence-locked hash_ring; see hashring_seq.h.
+ *
+ * A lookup copies the ring's struct between two reads of an even, unchanged
+ * sequence, so the copy is consistent: its arrays and their lengths belong
+ * together, and the memory it points at is still allocated (the ring's
+ * allocator only retires blocks; see seq_free()). Searching arrays that a
+ * mutation is editing in place may give a wrong answer, but stays in bounds
+ * and terminates; the sequence is checked again afterwards, and the lookup
+ * retried if it moved.
+ */
+
+#include <errno.h>
+#include <sched.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "hashring_seq.h"
+
+static void *
+seq_alloc(void *ctx, size_t sz)
+{
+	struct hr_seq_block *sb;
+
+	(void)ctx;
+	sb = malloc(sizeof *sb + sz);
+	if (sb == NULL)
+		return NULL;
+	sb->sb_size = sz;
+	return sb + 1;
+}
+
+/*
+ * Lookups may still be reading a block the ring lets go of, so keep it until
+ * hash_ring_seq_reclaim(). Called with hrs_lock held.
+ */
+static void
+seq_free(void *ctx, void *p)
+{
+	struct hash_ring_seq *s = ctx;
+	struct hr_seq_block *sb = (struct hr_seq_block *)p - 1;
+
+	sb->sb_next = s->hrs_retired;
+	s->hrs_retired = sb;
+}
+
+static inline void
+seq_write_begin(struct hash_ring_seq *s)
+{
+
+	__atomic_store_n(&s->hrs_seq, s->hrs_seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static inline void
+seq_write_end(struct hash_ring_seq *s)
+{
+
+	__atomic_store_n(&s->hrs_seq, s->hrs_seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Waits out any mutation and returns the (even) sequence. */
+static inline unsigned long
+seq_read_begin(const struct hash_ring_seq *s)
+{
+	unsigned long seq;
+
+	while ((seq = __atomic_load_n(&s->hrs_seq, __ATOMIC_ACQUIRE)) & 1)
+		sched_yield();
+	return seq;
+}
+
+static inline bool
+seq_read_retry(const struct hash_ring_seq *s, unsigned long seq)
+{
+
+	__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	return (__atomic_load_n(&s->hrs_seq, __ATOMIC_RELAXED) != seq);
+}
+
+/*
+ * A consistent copy of the ring's struct, and the sequence it is from. The
+ * copy is by word rather than memcpy(): the compiler makes that a 'rep movs',
+ * and lookups then stall reading the copy back (store forwarding fails).
+ */
+static unsigned long
+seq_snapshot(const struct hash_ring_seq *s, struct hash_ring *h)
+{
+	const uintptr_t *src = (const uintptr_t *)&s->hrs_ring;
+	uintptr_t *dst = (uintptr_t *)h;
+	unsigned long seq;
+
+	do {
+		seq = seq_read_begin(s);
+		for (size_t i = 0; i < sizeof *h / sizeof *dst; i++)
+			dst[i] = __atomic_load_n(&src[i], __ATOMIC_RELAXED);
+	} while (seq_read_retry(s, seq));
+	return seq;
+}
+
+int
+hash_ring_seq_init(struct hash_ring_seq *s, hr_hasher_t hash,
+    uint32_t nreplicas)
+{
+	int error;
+
+	error = pthread_mutex_init(&s->hrs_lock, NULL);
+	if (error != 0)
+		return error;
+	s->hrs_seq = 0;
+	s->hrs_retired = NULL;
+	s->hrs_alloc.ha_alloc = seq_alloc;
+	s->hrs_alloc.ha_realloc = NULL;		/* realloc() frees in place */
+	s->hrs_alloc.ha_free = seq_free;
+	s->hrs_alloc.ha_ctx = s;
+	hash_ring_init_alloc(&s->hrs_ring, hash, &s->hrs_alloc, nreplicas);
+	return 0;
+}
+
+void
+hash_ring_seq_clean(struct hash_ring_seq *s)
+{
+
+	hash_ring_clean(&s->hrs_ring);
+	(void)hash_ring_seq_reclaim(s);
+	pthread_mutex_destroy(&s->hrs_lock);
+}
+
+int
+hash_ring_seq_getn(const struct hash_ring_seq *s, uint32_t hash, unsigned n,
+    uint32_t *memb_out)
+{
+	struct hash_ring h;
+	unsigned long seq;
+	int error;
+
+	do {
+		seq = seq_snapshot(s, &h);
+		error = hash_ring_getn(&h, hash, n, memb_out);
+	} while (seq_read_retry(s, seq));
+	return error;
+}
+
+int
+hash_ring_seq_getn_batch(const struct hash_ring_seq *s, const uint32_t *hashes,
+    size_t count, unsigned n, uint32_t *memb_out)
+{
+	struct hash_ring h;
+	unsigned long seq;
+	int error;
+
+	do {
+		seq = seq_snapshot(s, &h);
+		error = hash_ring_getn_batch(&h, hashes, count, n, memb_out);
+	} while (seq_read_retry(s, seq));
+	return error;
+}
+
+int
+hash_ring_seq_add(struct hash_ring_seq *s, uint32_t member, unsigned weightpct)
+{
+	size_t rc;
+
+	pthread_mutex_lock(&s->hrs_lock);
+	seq_write_begin(s);
+	rc = hash_ring_add(&s->hrs_ring, member, weightpct, NULL, 0);
+	seq_write_end(s);
+	pthread_mutex_unlock(&s->hrs_lock);
+	return (rc != 0 ? ENOMEM : 0);
+}
+
+int
+hash_ring_seq_remove(struct hash_ring_seq *s, uint32_t member,
+    unsigned weightpct)
+{
+	size_t rc;
+
+	pthread_mutex_lock(&s->hrs_lock);
+	seq_write_begin(s);
+	rc = hash_ring_remove(&s->hrs_ring, member, weightpct, NULL, 0);
+	seq_write_end(s);
+	pthread_mutex_unlock(&s->hrs_lock);
+	return (rc != 0 ? ENOMEM : 0);
+}
+
+int
+hash_ring_seq_build(struct hash_ring_seq *s, const struct hr_member *members,
+    size_t nmembers)
+{
+	struct hash_ring next;
+	size_t rc;
+
+	/*
+	 * Build beside the ring, and only hold lookups off while swapping the
+	 * result in; the old ring is retired by cleaning it.
+	 */
+	pthread_mutex_lock(&s->hrs_lock);
+	hash_ring_init_alloc(&next, s->hrs_ring.hr_hash_fn, &s->hrs_alloc,
+	    s->hrs_ring.hr_nreplicas);
+	hash_ring_set_vnode_hasher(&next, s->hrs_ring.hr_vnode_fn);
+	next.hr_ring_reserved = s->hrs_ring.hr_ring_reserved;
+	rc = hash_ring_build(&next, members, nmembers, NULL, 0);
+	if (rc == 0) {
+		seq_write_begin(s);
+		hash_ring_swap(&s->hrs_ring, &next);
+		seq_write_end(s);
+	}
+	hash_ring_clean(&next);
+	pthread_mutex_unlock(&s->hrs_lock);
+	return (rc != 0 ? ENOMEM : 0);
+}
+
+int
+hash_ring_seq_reserve(struct hash_ring_seq *s, uint32_t nmembers)
+{
+	size_t rc;
+
+	pthread_mutex_lock(&s->hrs_lock);
+	seq_write_begin(s);
+	rc = hash_ring_reserve(&s->hrs_ring, nmembers, NULL, 0);
+	seq_write_end(s);
+	pthread_mutex_unlock(&s->hrs_lock);
+	return (rc != 0 ? ENOMEM : 0);
+}
+
+int
+hash_ring_seq_index(struct hash_ring_seq *s, enum hr_lookup lookup)
+{
+	size_t rc;
+
+	pthread_mutex_lock(&s->hrs_lock);
+	seq_write_begin(s);
+	rc = hash_ring_index(&s->hrs_ring, lookup, NULL, 0);
+	seq_write_end(s);
+	pthread_mutex_unlock(&s->hrs_lock);
+	return (rc != 0 ? ENOMEM : 0);
+}
+
+int
+hash_ring_seq_successors(struct hash_ring_seq *s)
+{
+	size_t rc;
+
+	pthread_mutex_lock(&s->hrs_lock);
+	seq_write_begin(s);
+	rc = hash_ring_successors(&s->hrs_ring, NULL, 0);
+	seq_write_end(s);
+	pthread_mutex_unlock(&s->hrs_lock);
+	return (rc != 0 ? ENOMEM : 0);
+}
+
+int
+hash_ring_seq_preflist(struct hash_ring_seq *s, unsigned maxn)
+{
+	size_t rc;
+
+	pthread_mutex_lock(&s->hrs_lock);
+	seq_write_begin(s);
+	rc = hash_ring_preflist(&s->hrs_ring, maxn, NULL, 0);
+	seq_write_end(s);
+	pthread_mutex_unlock(&s->hrs_lock);
+	return (rc != 0 ? ENOMEM : 0);
+}
+
+size_t
+hash_ring_seq_reclaim(struct hash_ring_seq *s)
+{
+	struct hr_seq_block *sb;
+	size_t freed = 0;
+
+	pthread_mutex_lock(&s->hrs_lock);
+	while ((sb = s->hrs_retired) != NULL) {
+		s->hrs_retired = sb->sb_next;
+		freed += sb->sb_size;
+		free(sb);
+	}
+	pthread_mutex_unlock(&s->hrs_lock);
+	return freed;
+}
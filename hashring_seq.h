@@ -0,0 +1,96 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * A hash_ring shared between threads under a sequence lock. Mutators edit the
+ * one ring in place, with the sequence odd for the duration; lookups read
+ * without writing anything shared and retry if the sequence moved. Unlike
+ * hashring_rcu.h, the ring isn't copied for each change.
+ *
+ * Lookups retry for as long as a mutation is in progress, so they can wait
+ * behind one (an add that has to grow the ring copies it; build() doesn't hold
+ * readers off while it works).
+ *
+ * A lookup that started before a mutation may still be reading memory the
+ * mutation replaced: a grown or shrunk ring, or a rebuilt index. So these are
+ * kept until hash_ring_seq_reclaim(), to be called when no lookup can have
+ * been in flight since they were replaced. hash_ring_seq_reserve() up front
+ * avoids growing the ring at all.
+ *
+ * Userland only.
+ */
+
+#ifndef _HASHRING_SEQ_H_
+#define _HASHRING_SEQ_H_
+
+#include <pthread.h>
+
+#include "hashring.h"
+
+struct hash_ring_seq;
+
+/*
+ * Initializes @s with an empty ring of @nreplicas replicas hashed by @hash.
+ * Returns zero, or an errno.
+ */
+int	hash_ring_seq_init(struct hash_ring_seq *s, hr_hasher_t hash,
+			   uint32_t nreplicas);
+
+/* Frees @s and everything it kept. No lookups may be in progress. */
+void	hash_ring_seq_clean(struct hash_ring_seq *s);
+
+/* hash_ring_getn() and hash_ring_getn_batch(), retrying across mutations. */
+int	hash_ring_seq_getn(const struct hash_ring_seq *s, uint32_t hash,
+			   unsigned n, uint32_t *memb_out);
+int	hash_ring_seq_getn_batch(const struct hash_ring_seq *s,
+				 const uint32_t *hashes, size_t count,
+				 unsigned n, uint32_t *memb_out);
+
+/*
+ * As the hash_ring_*() call of the same name, without caller buffers. Return
+ * zero on success, or ENOMEM.
+ */
+int	hash_ring_seq_add(struct hash_ring_seq *s, uint32_t member,
+			  unsigned weightpct);
+int	hash_ring_seq_remove(struct hash_ring_seq *s, uint32_t member,
+			     unsigned weightpct);
+int	hash_ring_seq_build(struct hash_ring_seq *s,
+			    const struct hr_member *members, size_t nmembers);
+int	hash_ring_seq_reserve(struct hash_ring_seq *s, uint32_t nmembers);
+int	hash_ring_seq_index(struct hash_ring_seq *s, enum hr_lookup lookup);
+int	hash_ring_seq_successors(struct hash_ring_seq *s);
+int	hash_ring_seq_preflist(struct hash_ring_seq *s, unsigned maxn);
+
+/*
+ * Frees what mutations have replaced, and returns how many bytes that was.
+ * The caller must know that no lookup begun before the last mutation is
+ * still running.
+ */
+size_t	hash_ring_seq_reclaim(struct hash_ring_seq *s);
+
+/*
+ * ===============================================================
+ * Private! Do not access any of these directly.
+ * ===============================================================
+ */
+
+/* Header of every block the ring allocates; see seq_free(). */
+struct hr_seq_block {
+	struct hr_seq_block	*sb_next;
+	size_t			 sb_size;
+};
+
+struct hash_ring_seq {
+	/* Odd while a mutation is in progress. */
+	unsigned long		 hrs_seq __attribute__((__aligned__(64)));
+	struct hash_ring	 hrs_ring;
+
+	/* Mutator state, under hrs_lock. */
+	pthread_mutex_t		 hrs_lock __attribute__((__aligned__(64)));
+	struct hr_allocator	 hrs_alloc;
+	struct hr_seq_block	*hrs_retired;
+};
+
+#endif  /* _HASHRING_SEQ_H_ */
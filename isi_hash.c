@@ -1,5 +1,12 @@
+#include <string.h>
+
 #include "isi_hash.h"
 
+#if defined(__GNUC__) && defined(__x86_64__)
+# include <immintrin.h>
+# define ISI_HASH_AVX2	1
+#endif
+
 /*
  * This hash function code is taken from Robert Jenkins. See
  * http://burtleburtle.net/bob/hash/evahash.html
@@ -182,3 +189,130 @@ isi_hash64(const void *_k, size_t len, uint64_t level)
 
 #undef mix
 }
+
+/**
+ * isi_hash32() of the 8-byte key { @w0, @w1 }, i.e. of two 32-bit words in
+ * memory order and host byte order.  An 8-byte key never reaches the 12-byte
+ * loop and has no byte tail, so this is the single mix() isi_hash32() would
+ * end with.
+ *
+ * @param w0		the first 4 bytes of the key
+ * @param w1		the last 4 bytes of the key
+ * @param initval	as for isi_hash32()
+ */
+uint32_t
+isi_hash32_u32x2(uint32_t w0, uint32_t w1, uint32_t initval)
+{
+#define mix(a, b, c)				\
+	do {					\
+		a -= b; a -= c; a ^= (c >> 13);	\
+		b -= c; b -= a; b ^= (a << 8);	\
+		c -= a; c -= b; c ^= (b >> 13);	\
+		a -= b; a -= c; a ^= (c >> 12);	\
+		b -= c; b -= a; b ^= (a << 16);	\
+		c -= a; c -= b; c ^= (b >> 5);	\
+		a -= b; a -= c; a ^= (c >> 3);	\
+		b -= c; b -= a; b ^= (a << 10);	\
+		c -= a; c -= b; c ^= (b >> 15);	\
+	} while (0)
+
+	uint32_t a = 0x9e3779b9 + w0, b = 0x9e3779b9 + w1, c = initval;
+
+	mix(a, b, c);
+
+	return c;
+
+#undef mix
+}
+
+/*
+ * isi_hash32() of the 8-byte key: @member, then @replica, little-endian.
+ */
+static uint32_t
+isi_hash32_vnode(uint32_t member, uint32_t replica, uint32_t initval)
+{
+	uint8_t k[8];
+	uint32_t w[2];
+
+	for (int i = 0; i < 4; i++) {
+		k[i] = (member >> (8 * i)) & 0xff;
+		k[4 + i] = (replica >> (8 * i)) & 0xff;
+	}
+	memcpy(w, k, sizeof w);
+	return isi_hash32_u32x2(w[0], w[1], initval);
+}
+
+#ifdef ISI_HASH_AVX2
+/*
+ * Eight vnodes per iteration. An 8-byte key is a single mix() with a = the
+ * member, b = the replica and c = initval, so each lane just runs mix() on its
+ * own replica.
+ */
+__attribute__((__target__("avx2")))
+static void
+isi_hash32_vnodes_avx2(uint32_t member, uint32_t first, uint32_t n,
+    uint32_t initval, uint32_t *out)
+{
+#define step(x, y, z, shift, s)						\
+	do {								\
+		x = _mm256_sub_epi32(_mm256_sub_epi32(x, y), z);	\
+		x = _mm256_xor_si256(x, shift(z, s));			\
+	} while (0)
+#define mix(a, b, c)							\
+	do {								\
+		step(a, b, c, _mm256_srli_epi32, 13);			\
+		step(b, c, a, _mm256_slli_epi32, 8);			\
+		step(c, a, b, _mm256_srli_epi32, 13);			\
+		step(a, b, c, _mm256_srli_epi32, 12);			\
+		step(b, c, a, _mm256_slli_epi32, 16);			\
+		step(c, a, b, _mm256_srli_epi32, 5);			\
+		step(a, b, c, _mm256_srli_epi32, 3);			\
+		step(b, c, a, _mm256_slli_epi32, 10);			\
+		step(c, a, b, _mm256_srli_epi32, 15);			\
+	} while (0)
+
+	const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+	__m256i a, b, c;
+	uint32_t i;
+
+	for (i = 0; n - i >= 8; i += 8) {
+		a = _mm256_set1_epi32((int)(0x9e3779b9 + member));
+		b = _mm256_add_epi32(
+		    _mm256_set1_epi32((int)(0x9e3779b9 + first + i)), lanes);
+		c = _mm256_set1_epi32((int)initval);
+		mix(a, b, c);
+		_mm256_storeu_si256((__m256i *)&out[i], c);
+	}
+
+	for (; i < n; i++)
+		out[i] = isi_hash32_vnode(member, first + i, initval);
+
+#undef mix
+#undef step
+}
+#endif /* ISI_HASH_AVX2 */
+
+/**
+ * isi_hash32() of @n consecutive vnode keys, as hr_vnode_hasher_t describes.
+ *
+ * @param member	the first 4 bytes of every key
+ * @param first		the last 4 bytes of the first key
+ * @param n		the number of keys
+ * @param initval	as for isi_hash32()
+ * @param out		room for @n hashes
+ */
+void
+isi_hash32_vnodes(uint32_t member, uint32_t first, uint32_t n,
+    uint32_t initval, uint32_t *out)
+{
+
+#ifdef ISI_HASH_AVX2
+	if (__builtin_cpu_supports("avx2")) {
+		isi_hash32_vnodes_avx2(member, first, n, initval, out);
+		return;
+	}
+#endif
+
+	for (uint32_t i = 0; i < n; i++)
+		out[i] = isi_hash32_vnode(member, first + i, initval);
+}
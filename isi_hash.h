@@ -7,4 +7,9 @@
 uint32_t	isi_hash32(const void *_k, size_t len, uint32_t initval);
 uint64_t	isi_hash64(const void *_k, size_t len, uint64_t initval);
 
+uint32_t	isi_hash32_u32x2(uint32_t w0, uint32_t w1, uint32_t initval);
+
+void		isi_hash32_vnodes(uint32_t member, uint32_t first, uint32_t n,
+				  uint32_t initval, uint32_t *out);
+
 #endif
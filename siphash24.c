@@ -139,6 +139,47 @@ siphash24(const u8 *in, u64 inlen, const u64 k[2])
   return b;
 }
 
+/*
+ * One message block, then the length block (8 << 56, no tail bytes), then
+ * finalization; siphash24() with its loop and tail switch unrolled away.
+ */
+u64
+siphash24_u32x2(uint32_t w0, uint32_t w1, const u64 k[2])
+{
+  u64 v0 = 0x736f6d6570736575ULL;
+  u64 v1 = 0x646f72616e646f6dULL;
+  u64 v2 = 0x6c7967656e657261ULL;
+  u64 v3 = 0x7465646279746573ULL;
+  const u64 b = ( ( u64 )8 ) << 56;
+  u32 w[2] = { w0, w1 };
+  u8 in[8];
+  u64 m;
+
+  memcpy( in, w, sizeof in );
+  m = U8TO64_LE( in );
+  v3 ^= k[1];
+  v2 ^= k[0];
+  v1 ^= k[1];
+  v0 ^= k[0];
+
+  v3 ^= m;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= m;
+
+  v3 ^= b;
+  SIPROUND;
+  SIPROUND;
+  v0 ^= b;
+
+  v2 ^= 0xff;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  SIPROUND;
+  return v0 ^ v1 ^ v2 ^ v3;
+}
+
 #if 0
 /*
    SipHash-2-4 output with
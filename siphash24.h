@@ -11,4 +11,10 @@ typedef uint8_t u8;
  */
 u64 siphash24(const u8 *in, u64 inlen, const u64 k[2]);
 
+/*
+ * SipHash-2-4 of the 8-byte key { w0, w1 }, two 32-bit words in host byte
+ * order; the same as siphash24() of those 8 bytes.
+ */
+u64 siphash24_u32x2(uint32_t w0, uint32_t w1, const u64 k[2]);
+
 #endif
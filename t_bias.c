@@ -21,6 +21,7 @@ le32enc(void *vp, uint32_t val)
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "t_bias.h"
 #include "siphash24.h"
@@ -204,10 +205,24 @@ isi_hasher64(const void *data, size_t len)
 uint32_t
 isi_hasher32(const void *data, size_t len)
 {
+	uint32_t w0, w1;
 
+	if (len == 8) {
+		memcpy(&w0, data, 4);
+		memcpy(&w1, (const uint8_t *)data + 4, 4);
+		return isi_hash32_u32x2(w0, w1, 0);
+	}
 	return isi_hash32(data, len, 0);
 }
 
+/* isi_hasher32() of a batch of vnodes */
+void
+isi_hasher32_vnodes(uint32_t member, uint32_t first, uint32_t n, uint32_t *out)
+{
+
+	isi_hash32_vnodes(member, first, n, 0, out);
+}
+
 /*
  * This is overkill...
  */
@@ -235,12 +250,29 @@ uint32_t
 mmh3_32_hasher(const void *data, size_t len)
 {
 	unsigned char md[4];
+	uint32_t w0, w1, res;
 
-	MurmurHash3_x86_32(data, len, 0x0/*seed*/, md);
+	if (len == 8) {
+		memcpy(&w0, data, 4);
+		memcpy(&w1, (const uint8_t *)data + 4, 4);
+		res = MurmurHash3_x86_32_u32x2(w0, w1, 0x0/*seed*/);
+		memcpy(md, &res, sizeof md);
+	} else
+		MurmurHash3_x86_32(data, len, 0x0/*seed*/, md);
 
 	return be32dec(md);
 }
 
+/* mmh3_32_hasher() of a batch of vnodes */
+void
+mmh3_32_vnodes(uint32_t member, uint32_t first, uint32_t n, uint32_t *out)
+{
+
+	MurmurHash3_x86_32_vnodes(member, first, n, 0x0/*seed*/, out);
+	for (uint32_t i = 0; i < n; i++)
+		out[i] = be32dec(&out[i]);
+}
+
 uint32_t
 mmh3_128_hasher(const void *data, size_t len)
 {
@@ -278,13 +310,88 @@ siphasher(const void *d, size_t len)
 		0xe276920babca796dULL,
 		0x443ef008123a77ceULL,
 	};
+	uint32_t w0, w1;
 	uint64_t sr;
 
-	sr = siphash24(d, len, k);
+	if (len == 8) {
+		memcpy(&w0, d, 4);
+		memcpy(&w1, (const uint8_t *)d + 4, 4);
+		sr = siphash24_u32x2(w0, w1, k);
+	} else
+		sr = siphash24(d, len, k);
 	return (sr >> 32) ^ sr;
 }
 
+uint32_t
+rnd(uint64_t *st)
+{
+	uint64_t x = *st;
+
+	/* xorshift64* */
+	x ^= x >> 12;
+	x ^= x << 25;
+	x ^= x >> 27;
+	*st = x;
+	return (x * 0x2545f4914f6cdd1dULL) >> 32;
+}
+
+void
+check_getn_matches(getn_fn getn, void *ctx, const struct hash_ring *exp)
+{
+	uint32_t got[3], want[3], hash;
+	uint64_t st = 7;
+	int rc1, rc2;
+
+	for (unsigned i = 0; i < 10000; i++) {
+		hash = rnd(&st);
+		rc1 = getn(ctx, hash, 3, got);
+		rc2 = hash_ring_getn(exp, hash, 3, want);
+		fail_unless(rc1 == rc2);
+		if (rc1 == 0)
+			for (unsigned j = 0; j < 3; j++)
+				fail_unless(got[j] == want[j]);
+	}
+}
+
+unsigned
+check_snapshot(const struct hash_ring *ring, uint64_t *st, uint32_t nmembers,
+    uint32_t extra)
+{
+	uint32_t a[3], b[3], hash;
+	unsigned errors = 0;
+
+	for (unsigned i = 0; i < SNAPSHOT_LOOKUPS; i++) {
+		hash = rnd(st);
+		if (hash_ring_getn(ring, hash, 3, a) != 0 ||
+		    hash_ring_getn(ring, hash, 3, b) != 0) {
+			errors++;
+			continue;
+		}
+		for (unsigned j = 0; j < 3; j++) {
+			if (a[j] != b[j])
+				errors++;
+			if ((a[j] < 1 || a[j] > nmembers) && a[j] != extra)
+				errors++;
+		}
+	}
+	return errors;
+}
 
+void
+stress_tally(struct stress *st, unsigned errors, unsigned long lookups)
+{
+
+	__atomic_add_fetch(&st->st_errors, errors, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&st->st_lookups, lookups, __ATOMIC_RELAXED);
+}
+
+void
+check_stress(const struct stress *st)
+{
+
+	fail_unless(st->st_errors == 0, "%u bad lookups", st->st_errors);
+	fail_unless(st->st_lookups > 0);
+}
 
 static struct hist_summary
 sample_hr(struct histogram *h, const struct hash_compare *hc, unsigned drives)
@@ -344,6 +451,62 @@ START_TEST(bias_ring)
 }
 END_TEST
 
+/*
+ * The fixed-width kernels must hash exactly as the generic functions do, or
+ * rings built with one would move under the other.
+ */
+START_TEST(u32x2_identical)
+{
+	const uint64_t sk[2] = { 0x0706050403020100ULL, 0x0f0e0d0c0b0a0908ULL };
+	uint64_t x = 0x9e3779b97f4a7c15ULL;
+	uint32_t w[2], seed, mmh3;
+
+	for (unsigned i = 0; i < 100000; i++) {
+		w[0] = rnd(&x);
+		w[1] = i < 1000 ? i : (uint32_t)x;
+		seed = i & 1 ? 0 : (uint32_t)(x >> 16);
+
+		fail_unless(isi_hash32_u32x2(w[0], w[1], seed) ==
+		    isi_hash32(w, sizeof w, seed));
+
+		MurmurHash3_x86_32(w, sizeof w, seed, &mmh3);
+		fail_unless(MurmurHash3_x86_32_u32x2(w[0], w[1], seed) == mmh3);
+
+		fail_unless(siphash24_u32x2(w[0], w[1], sk) ==
+		    siphash24((const uint8_t *)w, sizeof w, sk));
+	}
+}
+END_TEST
+
+/*
+ * crc32c_hasher() and both of its paths must match the byte-at-a-time table,
+ * at every length and alignment the loops distinguish.
+ */
+START_TEST(crc32c_identical)
+{
+	uint8_t buf[64 + 8];
+	uint32_t crc;
+
+	for (unsigned i = 0; i < sizeof buf; i++)
+		buf[i] = (uint8_t)(i * 0x9d + 0x3b);
+
+	for (size_t off = 0; off < 8; off++) {
+		for (size_t len = 0; len <= 64; len++) {
+			fail_unless(crc32c_hasher(&buf[off], len) ==
+			    crc32cer(&buf[off], len));
+
+			crc = ~(uint32_t)0;
+			for (size_t i = 0; i < len; i++)
+				CRC32C(crc, buf[off + i]);
+			fail_unless(crc32c_sw(~(uint32_t)0, &buf[off], len) ==
+			    crc);
+			fail_unless(crc32c(~(uint32_t)0, &buf[off], len) ==
+			    crc);
+		}
+	}
+}
+END_TEST
+
 void
 suite_add_t_bias(Suite *s)
 {
@@ -352,4 +515,9 @@ suite_add_t_bias(Suite *s)
 	t = tcase_create("bias_ring");
 	tcase_add_test(t, bias_ring);
 	suite_add_tcase(s, t);
+
+	t = tcase_create("u32x2");
+	tcase_add_test(t, u32x2_identical);
+	tcase_add_test(t, crc32c_identical);
+	suite_add_tcase(s, t);
 }
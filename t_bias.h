@@ -14,6 +14,9 @@
 /* Add bias tests to check suite */
 void suite_add_t_bias(Suite *s);
 void suite_add_t_weights(Suite *s);
+void suite_add_t_rcu(Suite *s);
+void suite_add_t_seq(Suite *s);
+void suite_add_t_numa(Suite *s);
 
 extern const struct hash_compare {
 	const char	*name;
@@ -33,4 +36,40 @@ uint32_t crc32er(const void *data, size_t len);
 uint32_t crc32cer(const void *vdata, size_t len);
 uint32_t siphasher(const void *d, size_t len);
 
+/* Batch versions, for hash_ring_set_vnode_hasher() */
+void mmh3_32_vnodes(uint32_t member, uint32_t first, uint32_t n, uint32_t *out);
+void isi_hasher32_vnodes(uint32_t member, uint32_t first, uint32_t n,
+    uint32_t *out);
+
+/* Pseudo-random test keys; *st is the state, and must not be zero */
+uint32_t rnd(uint64_t *st);
+
+/* A lookup through some wrapper around a ring, e.g. hash_ring_seq_getn() */
+typedef int (*getn_fn)(void *ctx, uint32_t hash, unsigned n,
+    uint32_t *memb_out);
+
+/* getn(n=3) through @getn and on the plain ring @exp agree for many hashes */
+void check_getn_matches(getn_fn getn, void *ctx, const struct hash_ring *exp);
+
+/*
+ * Looks up SNAPSHOT_LOOKUPS random hashes twice each in @ring, which must not
+ * change meanwhile. Returns how many answers moved, or named neither a member
+ * in 1..@nmembers nor @extra.
+ */
+#define SNAPSHOT_LOOKUPS	64
+unsigned check_snapshot(const struct hash_ring *ring, uint64_t *st,
+    uint32_t nmembers, uint32_t extra);
+
+/* Shared by a concurrent test's writer and its reader threads */
+struct stress {
+	volatile bool	 st_stop;
+	unsigned	 st_errors;
+	unsigned long	 st_lookups;
+};
+
+/* Adds in a reader's counts, as it finishes */
+void stress_tally(struct stress *st, unsigned errors, unsigned long lookups);
+/* With the readers joined: they looked things up, and got no bad answers */
+void check_stress(const struct stress *st);
+
 #endif
@@ -14,15 +14,18 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "hashring.h"
+#include "hashring_pool.h"
 
 #include "t_bias.h"
 
 #define hash_ring_init(r, h, n) hash_ring_init(r, h, NULL, n)
 
-#define NBYTES (16*1024)
+#define NBYTES (32*1024)
 
 #define hash_ring_add(r, m) \
 fail_if(hash_ring_add(r, m, 100/*weight*/, malloc(NBYTES), NBYTES))
@@ -44,7 +47,7 @@ _hash_ring_dump(struct hash_ring *h)
 	printf("\tring:\n");
 	for (size_t i = 0; i < h->hr_ring_used; i++)
 		printf("\t\t{ hash: %#"PRIx32", bin: %#"PRIx32" }\n",
-		    h->hr_ring[i].kv_hash, h->hr_ring[i].kv_value);
+		    h->hr_ring_hash[i], h->hr_ring_value[i]);
 	printf("\tring capacity: %zu\n", h->hr_ring_capacity);
 }
 #endif
@@ -268,9 +271,9 @@ ring_is_sorted(struct hash_ring *ring)
 	uint32_t last = 0;
 
 	for (size_t i = 0; i < ring->hr_ring_used; i++) {
-		if (ring->hr_ring[i].kv_hash <= last && last != 0)
+		if (ring->hr_ring_hash[i] <= last && last != 0)
 			fail("hashes aren't sorted");
-		last = ring->hr_ring[i].kv_hash;
+		last = ring->hr_ring_hash[i];
 	}
 }
 
@@ -283,7 +286,7 @@ START_TEST(func_add)
 	hash_ring_add(&ring, 0xABCDEF);
 
 	fail_unless(ring.hr_ring_used == ring.hr_nreplicas);
-	fail_if(ring.hr_ring == NULL);
+	fail_if(ring.hr_ring_hash == NULL);
 
 	ring_is_sorted(&ring);
 
@@ -291,7 +294,7 @@ START_TEST(func_add)
 
 	/* This can fail in unlikely event of a collision: */
 	fail_unless(ring.hr_ring_used == 2*ring.hr_nreplicas);
-	fail_if(ring.hr_ring == NULL);
+	fail_if(ring.hr_ring_hash == NULL);
 
 	ring_is_sorted(&ring);
 	hash_ring_clean(&ring);
@@ -322,7 +325,7 @@ START_TEST(func_remove_nonexist)
 	hash_ring_remove(&ring, 0xFEDCBA);
 
 	fail_unless(ring.hr_ring_used == ring.hr_nreplicas);
-	fail_if(ring.hr_ring == NULL);
+	fail_if(ring.hr_ring_hash == NULL);
 	hash_ring_clean(&ring);
 }
 END_TEST
@@ -604,6 +607,370 @@ START_TEST(func_get_two_quick2)
 }
 END_TEST
 
+START_TEST(func_get_batch)
+{
+	struct hash_ring ring;
+	const uint32_t bin1 = 0xABCDEF,
+	      bin2 = 0xDC0FEE,
+	      bin3 = 0x80F000;
+	uint32_t bins[2 * NELEM(_lotsa_inputs)], bin[2];
+	int err;
+
+	hash_ring_init(&ring, hasher, 128);
+
+	hash_ring_add(&ring, bin1);
+	hash_ring_add(&ring, bin2);
+	hash_ring_add(&ring, bin3);
+
+	for (unsigned n = 1; n <= 2; n++) {
+		err = hash_ring_getn_batch(&ring, _lotsa_inputs,
+		    NELEM(_lotsa_inputs), n, bins);
+		fail_if(err);
+
+		for (unsigned i = 0; i < NELEM(_lotsa_inputs); i++) {
+			err = hash_ring_getn(&ring, _lotsa_inputs[i], n, bin);
+			fail_if(err);
+
+			for (unsigned j = 0; j < n; j++)
+				fail_if(bins[i * n + j] != bin[j],
+				    "0x%08x: batch 0x%08x != 0x%08x",
+				    _lotsa_inputs[i], bins[i * n + j], bin[j]);
+		}
+	}
+	hash_ring_clean(&ring);
+}
+END_TEST
+
+/* The caller-allocates dance, for rings too big for NBYTES. */
+static void
+add_any(struct hash_ring *ring, uint32_t member)
+{
+	void *buf = NULL;
+	size_t sz = 0;
+
+	while ((sz = (hash_ring_add)(ring, member, 100, buf, sz)) != 0)
+		buf = malloc(sz);
+}
+
+static void
+index_any(struct hash_ring *ring, enum hr_lookup lookup)
+{
+	void *buf = NULL;
+	size_t sz = 0;
+
+	while ((sz = hash_ring_index(ring, lookup, buf, sz)) != 0)
+		buf = malloc(sz);
+}
+
+/*
+ * Checks that getn() and getn_batch() agree with plain, scalar binary search
+ * for random keys and for keys at and around every ring entry.
+ */
+static void
+check_lookup(struct hash_ring *ring, enum hr_lookup lookup)
+{
+	uint32_t *keys, *exp, *got;
+	enum hr_simd simd;
+	size_t nkeys;
+	unsigned n;
+	int err;
+
+	nkeys = NELEM(_lotsa_inputs) + 3 * ring->hr_ring_used + 2;
+	keys = malloc(nkeys * sizeof *keys);
+	exp = malloc(2 * nkeys * sizeof *exp);
+	got = malloc(2 * nkeys * sizeof *got);
+	fail_unless(keys && exp && got);
+
+	memcpy(keys, _lotsa_inputs, sizeof _lotsa_inputs);
+	nkeys = NELEM(_lotsa_inputs);
+	for (size_t i = 0; i < ring->hr_ring_used; i++) {
+		keys[nkeys++] = ring->hr_ring_hash[i] - 1;
+		keys[nkeys++] = ring->hr_ring_hash[i];
+		keys[nkeys++] = ring->hr_ring_hash[i] + 1;
+	}
+	keys[nkeys++] = 0;
+	keys[nkeys++] = UINT32_MAX;
+
+	n = (ring->hr_ring_used > ring->hr_nreplicas) ? 2 : 1;
+
+	simd = ring->hr_simd;
+	ring->hr_simd = HR_SIMD_SCALAR;
+	index_any(ring, HR_LOOKUP_BSEARCH);
+	for (size_t i = 0; i < nkeys; i++) {
+		err = hash_ring_getn(ring, keys[i], n, &exp[i * n]);
+		fail_if(err);
+	}
+	ring->hr_simd = simd;
+
+	index_any(ring, lookup);
+	fail_unless(ring->hr_lookup == lookup);
+	for (size_t i = 0; i < nkeys; i++) {
+		err = hash_ring_getn(ring, keys[i], n, &got[i * n]);
+		fail_if(err);
+	}
+	fail_if(memcmp(exp, got, nkeys * n * sizeof *got) != 0);
+
+	memset(got, 0, nkeys * n * sizeof *got);
+	err = hash_ring_getn_batch(ring, keys, nkeys, n, got);
+	fail_if(err);
+	fail_if(memcmp(exp, got, nkeys * n * sizeof *got) != 0);
+
+	free(got);
+	free(exp);
+	free(keys);
+}
+
+static const enum hr_lookup lookups[] = {
+	HR_LOOKUP_BSEARCH,
+	HR_LOOKUP_BTREE,
+	HR_LOOKUP_PREFIX,
+	HR_LOOKUP_INTERP,
+};
+
+START_TEST(func_index)
+{
+	/* One leaf, one inner level, two inner levels. */
+	const uint32_t reps[] = { 1, 5, 100, 2000 };
+	/*
+	 * Two members at these make rings of 1904, 2448, 3264, 4352 and 4896
+	 * entries, whose last inner node above the leaves' parents runs out
+	 * of children before the largest hashes.
+	 */
+	const uint32_t reps2[] = { 952, 1224, 1632, 2176, 2448 };
+	struct hash_ring ring;
+
+	for (unsigned l = 0; l < NELEM(lookups); l++) {
+		for (unsigned r = 0; r < NELEM(reps); r++) {
+			hash_ring_init(&ring, hasher, reps[r]);
+
+			add_any(&ring, 0xABCDEF);
+			check_lookup(&ring, lookups[l]);
+
+			add_any(&ring, 0xDC0FEE);
+			add_any(&ring, 0x80F000);
+			check_lookup(&ring, lookups[l]);
+
+			/* Mutations discard the index. */
+			hash_ring_remove(&ring, 0xDC0FEE);
+			fail_unless(ring.hr_index == NULL);
+			if (lookups[l] == HR_LOOKUP_INTERP)
+				fail_unless(ring.hr_lookup == HR_LOOKUP_INTERP);
+			else
+				fail_unless(ring.hr_lookup == HR_LOOKUP_BSEARCH);
+			check_lookup(&ring, lookups[l]);
+
+			hash_ring_clean(&ring);
+		}
+	}
+
+	for (unsigned r = 0; r < NELEM(reps2); r++) {
+		hash_ring_init(&ring, hasher, reps2[r]);
+		add_any(&ring, 1);
+		add_any(&ring, 2);
+		check_lookup(&ring, HR_LOOKUP_BTREE);
+		hash_ring_clean(&ring);
+	}
+}
+END_TEST
+
+START_TEST(func_search_simd)
+{
+	const uint32_t reps[] = { 3, 5, 100, 2000 };
+	enum hr_simd simd[3];
+	unsigned nsimd = 0;
+	struct hash_ring ring;
+
+	simd[nsimd++] = HR_SIMD_SCALAR;
+#ifdef __x86_64__
+	simd[nsimd++] = HR_SIMD_SSE2;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("popcnt"))
+		simd[nsimd++] = HR_SIMD_AVX2;
+#endif
+
+	for (unsigned r = 0; r < NELEM(reps); r++) {
+		hash_ring_init(&ring, hasher, reps[r]);
+
+		add_any(&ring, 0xABCDEF);
+		add_any(&ring, 0xDC0FEE);
+		add_any(&ring, 0x80F000);
+
+		for (unsigned s = 0; s < nsimd; s++) {
+			ring.hr_simd = simd[s];
+			for (unsigned l = 0; l < NELEM(lookups); l++)
+				check_lookup(&ring, lookups[l]);
+		}
+
+		hash_ring_clean(&ring);
+	}
+}
+END_TEST
+
+static void
+successors_any(struct hash_ring *ring)
+{
+	void *buf = NULL;
+	size_t sz = 0;
+
+	while ((sz = hash_ring_successors(ring, buf, sz)) != 0)
+		buf = malloc(sz);
+}
+
+/*
+ * getn() must give the same answers, including ENOENT, with and without the
+ * successor table.
+ */
+static void
+check_successors(struct hash_ring *ring, unsigned maxn)
+{
+	uint32_t exp[8], got[8];
+	int experr, goterr;
+
+	fail_unless(maxn <= NELEM(exp));
+	fail_unless(ring->hr_succ == NULL);
+
+	for (unsigned n = 1; n <= maxn; n++) {
+		for (size_t i = 0; i < NELEM(_lotsa_inputs); i++) {
+			experr = hash_ring_getn(ring, _lotsa_inputs[i], n, exp);
+
+			successors_any(ring);
+			goterr = hash_ring_getn(ring, _lotsa_inputs[i], n, got);
+
+			free(ring->hr_succ);
+			ring->hr_succ = NULL;
+
+			fail_unless(experr == goterr);
+			if (experr == 0)
+				fail_if(memcmp(exp, got, n * sizeof *got) != 0);
+		}
+	}
+}
+
+START_TEST(func_successors)
+{
+	struct hash_ring ring;
+	void *buf;
+	size_t sz;
+
+	hash_ring_init(&ring, hasher, 64);
+	check_successors(&ring, 2);
+
+	/* One member: every entry is its own successor. */
+	add_any(&ring, 0xABCDEF);
+	check_successors(&ring, 2);
+
+	add_any(&ring, 0xDC0FEE);
+	for (uint32_t m = 1; m <= 4; m++) {
+		buf = NULL;
+		sz = 0;
+		while ((sz = (hash_ring_add)(&ring, m, 25 * m, buf, sz)) != 0)
+			buf = malloc(sz);
+	}
+	check_successors(&ring, 7);
+
+	/* Mutations discard the table. */
+	successors_any(&ring);
+	fail_if(ring.hr_succ == NULL);
+	hash_ring_remove(&ring, 0xDC0FEE);
+	fail_unless(ring.hr_succ == NULL);
+	check_successors(&ring, 6);
+
+	hash_ring_clean(&ring);
+}
+END_TEST
+
+static void
+preflist_any(struct hash_ring *ring, unsigned maxn)
+{
+	void *buf = NULL;
+	size_t sz = 0;
+
+	while ((sz = hash_ring_preflist(ring, maxn, buf, sz)) != 0)
+		buf = malloc(sz);
+}
+
+/*
+ * getn() and getn_batch() must give the same answers, including ENOENT, with
+ * and without preference lists of up to @maxn members.
+ */
+static void
+check_preflist(struct hash_ring *ring, unsigned maxn)
+{
+	const size_t nkeys = NELEM(_lotsa_inputs), stride = maxn + 1;
+	uint32_t *exp, *got;
+	int experr[HR_PREFLIST_MAXN + 2], goterr;
+
+	/* exp[n] holds the answers for n, at 'stride' members per key. */
+	exp = malloc((maxn + 2) * nkeys * stride * sizeof *exp);
+	got = malloc(nkeys * stride * sizeof *got);
+	fail_unless(exp && got);
+
+#define EXP(n, i)	(&exp[((n) * nkeys + (i)) * stride])
+	for (unsigned n = 1; n <= maxn + 1; n++) {
+		experr[n] = 0;
+		for (size_t i = 0; i < nkeys && experr[n] == 0; i++)
+			experr[n] = hash_ring_getn(ring, _lotsa_inputs[i], n,
+			    EXP(n, i));
+	}
+
+	preflist_any(ring, maxn);
+	fail_unless(ring->hr_ring_used == 0 ||
+	    ring->hr_preflist.pl_hash != NULL);
+
+	for (unsigned n = 1; n <= maxn + 1; n++) {
+		goterr = 0;
+		for (size_t i = 0; i < nkeys && goterr == 0; i++) {
+			goterr = hash_ring_getn(ring, _lotsa_inputs[i], n, got);
+			if (goterr == 0)
+				fail_if(memcmp(EXP(n, i), got,
+				    n * sizeof *got) != 0);
+		}
+		fail_unless(goterr == experr[n]);
+
+		goterr = hash_ring_getn_batch(ring, _lotsa_inputs, nkeys, n,
+		    got);
+		fail_unless(goterr == experr[n]);
+		for (size_t i = 0; i < nkeys && goterr == 0; i++)
+			fail_if(memcmp(EXP(n, i), &got[i * n],
+			    n * sizeof *got) != 0);
+	}
+#undef EXP
+
+	/* Discard them again. */
+	hash_ring_preflist(ring, 0, NULL, 0);
+	fail_unless(ring->hr_preflist.pl_hash == NULL);
+
+	free(got);
+	free(exp);
+}
+
+START_TEST(func_preflist)
+{
+	struct hash_ring ring;
+
+	hash_ring_init(&ring, hasher, 64);
+	check_preflist(&ring, 3);
+
+	/* Fewer members than maxn. */
+	add_any(&ring, 0xABCDEF);
+	check_preflist(&ring, 3);
+	add_any(&ring, 0xDC0FEE);
+	check_preflist(&ring, 3);
+
+	for (uint32_t m = 1; m <= 6; m++)
+		add_any(&ring, m);
+	check_preflist(&ring, 3);
+	check_preflist(&ring, HR_PREFLIST_MAXN);
+
+	/* Mutations discard the lists. */
+	preflist_any(&ring, 3);
+	hash_ring_remove(&ring, 0xDC0FEE);
+	fail_unless(ring.hr_preflist.pl_hash == NULL);
+	check_preflist(&ring, 5);
+
+	hash_ring_clean(&ring);
+}
+END_TEST
+
 START_TEST(err_get_two_with_one_in_ring)
 {
 	struct hash_ring ring;
@@ -619,6 +986,35 @@ START_TEST(err_get_two_with_one_in_ring)
 }
 END_TEST
 
+START_TEST(err_get_batch)
+{
+	struct hash_ring ring;
+	uint32_t bins[2 * NELEM(_lotsa_inputs)];
+	int err;
+
+	hash_ring_init(&ring, hasher, 128);
+
+	err = hash_ring_getn_batch(&ring, _lotsa_inputs, NELEM(_lotsa_inputs),
+	    1, bins);
+	fail_unless(err == ENOENT);
+
+	hash_ring_add(&ring, 0xABCDEF);
+
+	err = hash_ring_getn_batch(&ring, _lotsa_inputs, NELEM(_lotsa_inputs),
+	    0, bins);
+	fail_unless(err == EINVAL);
+
+	err = hash_ring_getn_batch(&ring, _lotsa_inputs, NELEM(_lotsa_inputs),
+	    2, bins);
+	fail_unless(err == ENOENT);
+
+	/* An empty batch trivially succeeds. */
+	err = hash_ring_getn_batch(&ring, _lotsa_inputs, 0, 1, bins);
+	fail_if(err);
+	hash_ring_clean(&ring);
+}
+END_TEST
+
 #undef hasher
 
 const struct hash_compare comparison_functions[] = {
@@ -637,6 +1033,7 @@ const struct hash_compare comparison_functions[] = {
 	{ "crc32", crc32er, true },
 #endif
 	{ "crc32c", crc32cer, true },
+	{ "crc32c_hw", crc32c_hasher, true },
 	{ "siphash", siphasher, true },
 	{ 0 },
 };
@@ -666,12 +1063,12 @@ test_rmse(struct hash_ring *ring, double *distr, uint32_t buckets[NBUCKETS])
 
 	int64_t exptd_item_keyspace = total_keyspace / total_ring_items;
 
-	uint64_t last = -(total_keyspace - ring->hr_ring[ring->hr_ring_used-1].kv_hash);
+	uint64_t last = -(total_keyspace - ring->hr_ring_hash[ring->hr_ring_used-1]);
 
 	double dMSE = 0.;
 
 	for (size_t i = 0; i < ring->hr_ring_used; i++) {
-		uint64_t cur = ring->hr_ring[i].kv_hash,
+		uint64_t cur = ring->hr_ring_hash[i],
 			 dist = cur - last;
 		int64_t err = exptd_item_keyspace - (int64_t)dist;
 
@@ -683,7 +1080,7 @@ test_rmse(struct hash_ring *ring, double *distr, uint32_t buckets[NBUCKETS])
 		last = cur;
 
 		for (unsigned b = 0; b < NBUCKETS; b++)
-			if (buckets[b] == ring->hr_ring[i].kv_value)
+			if (buckets[b] == ring->hr_ring_value[i])
 				distr[b] += (double)dist;
 	}
 
@@ -787,6 +1184,67 @@ START_TEST(distribution)
 }
 END_TEST
 
+/*
+ * Interpolation search depends on how uniformly the hasher spreads ring
+ * entries; compare it with binary search for each.
+ */
+START_TEST(interp_vs_bsearch)
+{
+	const unsigned nmembers = 64, nlookups = 256 * 1024;
+	struct hash_ring hr;
+	uint64_t st = 0x2545f4914f6cdd1dULL;
+	uint32_t *keys, bin;
+
+	keys = malloc(nlookups * sizeof *keys);
+	fail_unless((uintptr_t)keys);
+	for (unsigned k = 0; k < nlookups; k++)
+		keys[k] = rnd(&st);
+
+	printf("Lookup time, ns; lower is better.\n");
+	printf("# replicas:\t");
+	for (unsigned j = 0; j < NELEM(comparison_replicas); j++)
+		printf("%"PRIu32" bsearch\t%"PRIu32" interp\t",
+		    comparison_replicas[j], comparison_replicas[j]);
+	printf("\n");
+
+	for (unsigned i = 0; comparison_functions[i].name != NULL; i++) {
+		printf("%s\t\t", comparison_functions[i].name);
+
+		for (unsigned j = 0; j < NELEM(comparison_replicas); j++) {
+			hash_ring_init(&hr, comparison_functions[i].hash,
+			    comparison_replicas[j]);
+			for (uint32_t m = 1; m <= nmembers; m++)
+				add_any(&hr, m * 0x10001);
+
+			check_lookup(&hr, HR_LOOKUP_INTERP);
+
+			for (unsigned l = 0; l < 2; l++) {
+				struct timespec t0, t1;
+
+				index_any(&hr, (l == 0) ? HR_LOOKUP_BSEARCH :
+				    HR_LOOKUP_INTERP);
+
+				clock_gettime(CLOCK_MONOTONIC, &t0);
+				for (unsigned k = 0; k < nlookups; k++)
+					fail_if(hash_ring_getn(&hr, keys[k], 1,
+					    &bin));
+				clock_gettime(CLOCK_MONOTONIC, &t1);
+
+				printf("%.1f\t\t", ((t1.tv_sec - t0.tv_sec) *
+				    1e9 + (t1.tv_nsec - t0.tv_nsec)) /
+				    nlookups);
+			}
+
+			hash_ring_clean(&hr);
+		}
+
+		printf("\n");
+	}
+
+	free(keys);
+}
+END_TEST
+
 START_TEST(err_idempotent)
 {
 	struct hash_ring ring;
@@ -796,17 +1254,21 @@ START_TEST(err_idempotent)
 	fail_unless(ring.hr_ring_used == 0);
 	hash_ring_add(&ring, 0x123456);
 	fail_unless(ring.hr_ring_used == 64);
+	fail_unless(hash_ring_nmembers(&ring) == 1);
 
 	/* adding the same item? don't count it */
 	hash_ring_add(&ring, 0x123456);
 	fail_unless(ring.hr_ring_used == 64);
+	fail_unless(hash_ring_nmembers(&ring) == 1);
 
 	hash_ring_remove(&ring, 0x123456);
 	fail_unless(ring.hr_ring_used == 0);
+	fail_unless(hash_ring_nmembers(&ring) == 0);
 
 	/* removing the same item also works. */
 	hash_ring_remove(&ring, 0x123456);
 	fail_unless(ring.hr_ring_used == 0);
+	fail_unless(hash_ring_nmembers(&ring) == 0);
 
 	hash_ring_clean(&ring);
 }
@@ -825,6 +1287,603 @@ stupid_hash(const void *d, size_t len)
 	return res;
 }
 
+static void
+build_any(struct hash_ring *ring, const struct hr_member *members, size_t n)
+{
+	void *buf = NULL;
+	size_t sz = 0;
+
+	while ((sz = hash_ring_build(ring, members, n, buf, sz)) != 0)
+		buf = malloc(sz);
+}
+
+static void
+check_same_ring(struct hash_ring *got, struct hash_ring *exp)
+{
+
+	fail_unless(got->hr_ring_used == exp->hr_ring_used);
+	fail_unless(hash_ring_nmembers(got) == hash_ring_nmembers(exp));
+	if (exp->hr_ring_used > 0) {
+		fail_if(memcmp(got->hr_ring_hash, exp->hr_ring_hash,
+		    exp->hr_ring_used * sizeof(uint32_t)) != 0);
+		fail_if(memcmp(got->hr_ring_value, exp->hr_ring_value,
+		    exp->hr_ring_used * sizeof(uint32_t)) != 0);
+	}
+}
+
+/*
+ * hash_ring_build() must produce exactly the ring that adding each member in
+ * turn does.
+ */
+static void
+check_build(hr_hasher_t hash, const struct hr_member *members, size_t n)
+{
+	struct hash_ring exp, got;
+	void *buf;
+	size_t sz;
+
+	hash_ring_init(&exp, hash, 64);
+	for (size_t i = 0; i < n; i++) {
+		buf = NULL;
+		sz = 0;
+		while ((sz = (hash_ring_add)(&exp, members[i].hm_member,
+		    members[i].hm_weightpct, buf, sz)) != 0)
+			buf = malloc(sz);
+	}
+
+	/* Build replaces whatever was there. */
+	hash_ring_init(&got, hash, 64);
+	add_any(&got, 0xFEEDED);
+	build_any(&got, members, n);
+	check_same_ring(&got, &exp);
+
+	hash_ring_clean(&got);
+	hash_ring_clean(&exp);
+}
+
+START_TEST(func_build)
+{
+	struct hr_member members[200];
+
+	check_build(md5_hasher, NULL, 0);
+
+	for (unsigned i = 0; i < NELEM(members); i++) {
+		members[i].hm_member = (i * 0x9E3779B1U) & 0xFFFFFF;
+		members[i].hm_weightpct = 1 + i % 100;
+	}
+	check_build(md5_hasher, members, 1);
+	check_build(md5_hasher, members, NELEM(members));
+	check_build(isi_hasher64, members, NELEM(members));
+
+	/* Collisions, in both orders; 0x100 loses every one to 1. */
+	members[0] = (struct hr_member){ 33, 100 };
+	members[1] = (struct hr_member){ 0x100, 50 };
+	members[2] = (struct hr_member){ 1, 100 };
+	members[3] = (struct hr_member){ 0x10000, 75 };
+	members[4] = (struct hr_member){ 2, 1 };
+	check_build(stupid_hash, members, 5);
+}
+END_TEST
+
+/*
+ * Removing members[@victim] down to @weightpct must leave exactly the ring
+ * built without it (or with its lower weight), shadowed entries and all.
+ */
+static void
+check_remove(const struct hr_member *members, size_t n, uint32_t nreplicas,
+    size_t victim, unsigned weightpct, bool overflow)
+{
+	struct hr_member rest[64];
+	struct hash_ring exp, got;
+	size_t nrest = 0;
+
+	fail_unless(n <= NELEM(rest));
+	for (size_t i = 0; i < n; i++) {
+		if (i != victim)
+			rest[nrest++] = members[i];
+		else if (weightpct > 0)
+			rest[nrest++] = (struct hr_member){
+			    members[i].hm_member, weightpct };
+	}
+
+	hash_ring_init(&exp, stupid_hash, nreplicas);
+	build_any(&exp, rest, nrest);
+
+	hash_ring_init(&got, stupid_hash, nreplicas);
+	build_any(&got, members, n);
+	fail_unless(got.hr_shadow_overflow == overflow);
+	fail_if((hash_ring_remove)(&got, members[victim].hm_member, weightpct,
+	    malloc(NBYTES), NBYTES));
+	check_same_ring(&got, &exp);
+
+	hash_ring_clean(&got);
+	hash_ring_clean(&exp);
+}
+
+/*
+ * md5_hasher(), but member 3's vnode 12 lands on its own vnode 1, and member
+ * 2's vnodes 1 and 12 both land on member 1's vnode 0.
+ */
+static uint32_t
+self_collide_hash(const void *d, size_t len)
+{
+	uint8_t v[8];
+	uint32_t m, r;
+
+	if (len != sizeof v)
+		return md5_hasher(d, len);
+	memcpy(v, d, sizeof v);
+	m = v[0] | v[1] << 8 | (uint32_t)v[2] << 16 | (uint32_t)v[3] << 24;
+	r = v[4] | v[5] << 8 | (uint32_t)v[6] << 16 | (uint32_t)v[7] << 24;
+	if (m == 3 && r == 12)
+		v[4] = 1;
+	else if (m == 2 && (r == 1 || r == 12)) {
+		v[0] = 1;
+		v[4] = 0;
+	}
+	return md5_hasher(v, sizeof v);
+}
+
+START_TEST(func_remove_shadows)
+{
+	/* With 8 replicas: 11 collisions, a few of them three-way. */
+	static const struct hr_member members[] = {
+		{ 5, 100 }, { 0x100, 50 }, { 1, 100 }, { 2, 10 },
+		{ 0x30000, 25 },
+	};
+	struct hr_member many[40];
+	struct hash_ring ring, copy, exp;
+
+	for (size_t v = 0; v < NELEM(members); v++) {
+		check_remove(members, NELEM(members), 8, v, 0, false);
+		check_remove(members, NELEM(members), 8, v, 5, false);
+		if (members[v].hm_weightpct > 50)
+			check_remove(members, NELEM(members), 8, v, 50, false);
+	}
+
+	/* A copy has as much room for new shadows as any ring. */
+	hash_ring_init(&ring, stupid_hash, 8);
+	build_any(&ring, members, NELEM(members) - 1);
+	fail_if(hash_ring_copy(&copy, &ring, malloc(NBYTES), NBYTES));
+	fail_unless(copy.hr_shadow_capacity > copy.hr_shadow_used);
+	fail_if((hash_ring_add)(&copy, members[NELEM(members) - 1].hm_member,
+	    members[NELEM(members) - 1].hm_weightpct, malloc(NBYTES), NBYTES));
+	fail_if(copy.hr_shadow_overflow);
+	fail_if((hash_ring_remove)(&copy, members[0].hm_member, 0,
+	    malloc(NBYTES), NBYTES));
+	hash_ring_init(&exp, stupid_hash, 8);
+	build_any(&exp, &members[1], NELEM(members) - 1);
+	check_same_ring(&copy, &exp);
+	hash_ring_clean(&exp);
+	hash_ring_clean(&copy);
+	hash_ring_clean(&ring);
+
+	/*
+	 * Lowering a weight keeps the hashes the member still has, even when
+	 * a dropped vnode shares one: member 3 keeps its entry, and member 2
+	 * its shadow under member 1.
+	 */
+	for (unsigned i = 0; i < 8; i++)
+		many[i] = (struct hr_member){ i + 1, 100 };
+	hash_ring_init(&ring, self_collide_hash, 16);
+	build_any(&ring, many, 8);
+	for (unsigned i = 0; i < 3; i++) {
+		uint32_t m = (i < 2) ? 3 - i : 1;
+		unsigned w = (i < 2) ? 50 : 0;
+
+		fail_if((hash_ring_remove)(&ring, m, w, malloc(NBYTES),
+		    NBYTES));
+		many[m - 1].hm_weightpct = w;
+		hash_ring_init(&exp, self_collide_hash, 16);
+		build_any(&exp, (i < 2) ? many : &many[1], (i < 2) ? 8 : 7);
+		check_same_ring(&ring, &exp);
+		hash_ring_clean(&exp);
+	}
+	hash_ring_clean(&ring);
+
+	/* Far too many collisions to remember; remove() rehashes instead. */
+	for (unsigned i = 0; i < NELEM(many); i++)
+		many[i] = (struct hr_member){ i + 1, 100 };
+	check_remove(many, NELEM(many), 64, 0, 0, true);
+	check_remove(many, NELEM(many), 64, 17, 0, true);
+	check_remove(many, NELEM(many), 64, 17, 50, true);
+}
+END_TEST
+
+START_TEST(err_rehash_low_weights)
+{
+	struct hr_member members[200];
+	struct hash_ring ring;
+	void *aux;
+	size_t sz;
+
+	/* One entry each: many more members than entries per replica count. */
+	for (unsigned i = 0; i < NELEM(members); i++)
+		members[i] = (struct hr_member){ i + 1, 1 };
+
+	hash_ring_init(&ring, md5_hasher, 64);
+	build_any(&ring, members, NELEM(members));
+	fail_unless(hash_ring_nmembers(&ring) == NELEM(members));
+
+	/* Force the rehash, with exactly the aux buffer it asks for. */
+	ring.hr_shadow_overflow = true;
+	sz = (hash_ring_remove)(&ring, 7, 0, NULL, 0);
+	fail_unless(sz >= NELEM(members) * sizeof(uint32_t));
+	aux = malloc(sz);
+	fail_if((hash_ring_remove)(&ring, 7, 0, aux, sz));
+	fail_unless(ring.hr_ring_used == NELEM(members) - 1);
+	fail_unless(hash_ring_nmembers(&ring) == NELEM(members) - 1);
+
+	hash_ring_clean(&ring);
+}
+END_TEST
+
+static unsigned
+remove_any(struct hash_ring *ring, uint32_t member)
+{
+	void *buf = NULL;
+	size_t sz = 0;
+	unsigned nbufs = 0;
+
+	while ((sz = (hash_ring_remove)(ring, member, 0, buf, sz)) != 0) {
+		buf = malloc(sz);
+		nbufs++;
+	}
+	return nbufs;
+}
+
+START_TEST(func_grow_shrink)
+{
+	struct hr_member members[256];
+	struct hash_ring ring, exp;
+	size_t sz, peak;
+	unsigned nbufs;
+	void *buf;
+
+	for (unsigned i = 0; i < NELEM(members); i++)
+		members[i] = (struct hr_member){ i + 1, 100 };
+
+	/* Growth is geometric: a few dozen buffers for 256 adds, not 256. */
+	hash_ring_init(&ring, md5_hasher, 64);
+	nbufs = 0;
+	for (unsigned i = 0; i < NELEM(members); i++) {
+		buf = NULL;
+		sz = 0;
+		while ((sz = (hash_ring_add)(&ring, i + 1, 100, buf, sz)) != 0) {
+			buf = malloc(sz);
+			nbufs++;
+		}
+	}
+	fail_unless(nbufs < 16, "%u buffers", nbufs);
+	peak = ring.hr_ring_capacity;
+
+	/* Underfull rings shrink as members leave, and stay correct. */
+	for (unsigned i = NELEM(members) - 1; i >= 8; i--)
+		remove_any(&ring, i + 1);
+	fail_unless(ring.hr_ring_capacity < peak / 4);
+	fail_unless(ring.hr_ring_capacity >= ring.hr_ring_used);
+
+	hash_ring_init(&exp, md5_hasher, 64);
+	build_any(&exp, members, 8);
+	check_same_ring(&ring, &exp);
+	hash_ring_clean(&exp);
+
+	/* A removal that leaves it more than a quarter full doesn't. */
+	peak = ring.hr_ring_capacity;
+	remove_any(&ring, 8);
+	fail_unless(ring.hr_ring_capacity == peak);
+
+	hash_ring_clean(&ring);
+}
+END_TEST
+
+START_TEST(func_reserve)
+{
+	struct hash_ring ring;
+	size_t sz, cap;
+	void *buf;
+
+	hash_ring_init(&ring, md5_hasher, 64);
+	add_any(&ring, 0xFFFF);
+
+	buf = NULL;
+	sz = 0;
+	while ((sz = hash_ring_reserve(&ring, 100, buf, sz)) != 0)
+		buf = malloc(sz);
+	cap = ring.hr_ring_capacity;
+	fail_unless(cap >= 101 * 64);
+	fail_unless(hash_ring_reserve(&ring, 100, NULL, 0) == 0);
+
+	/* No buffers needed to add up to the reservation... */
+	for (uint32_t m = 1; m < 100; m++)
+		fail_if((hash_ring_add)(&ring, m, 100, NULL, 0));
+	fail_unless(hash_ring_nmembers(&ring) == 100);
+	fail_unless(ring.hr_ring_capacity == cap);
+
+	/* ... nor does removing them shrink the ring below it. */
+	for (uint32_t m = 1; m < 100; m++)
+		remove_any(&ring, m);
+	fail_unless(ring.hr_ring_capacity == cap);
+	fail_unless(hash_ring_nmembers(&ring) == 1);
+
+	hash_ring_clean(&ring);
+}
+END_TEST
+
+/* Counts what a ring asks of its allocator. */
+/* Blocks carry their size in front, to check realloc()'s old size. */
+#define CA_HDR	16
+
+struct count_alloc {
+	unsigned	ca_allocs;
+	unsigned	ca_reallocs;
+	int		ca_live;
+	bool		ca_fail;
+};
+
+static void *
+count_alloc(void *ctx, size_t sz)
+{
+	struct count_alloc *ca = ctx;
+	char *p;
+
+	if (ca->ca_fail)
+		return NULL;
+	p = malloc(CA_HDR + sz);
+	if (p == NULL)
+		return NULL;
+	*(size_t *)p = sz;
+	ca->ca_allocs++;
+	ca->ca_live++;
+	return p + CA_HDR;
+}
+
+static void *
+count_realloc(void *ctx, void *p, size_t oldsz, size_t sz)
+{
+	struct count_alloc *ca = ctx;
+	char *np;
+
+	fail_unless(oldsz < sz);
+	fail_unless(*(size_t *)((char *)p - CA_HDR) == oldsz,
+	    "realloc of a %zu byte block as %zu",
+	    *(size_t *)((char *)p - CA_HDR), oldsz);
+	if (ca->ca_fail)
+		return NULL;
+	np = realloc((char *)p - CA_HDR, CA_HDR + sz);
+	if (np == NULL)
+		return NULL;
+	*(size_t *)np = sz;
+	ca->ca_reallocs++;
+	return np + CA_HDR;
+}
+
+static void
+count_free(void *ctx, void *p)
+{
+	struct count_alloc *ca = ctx;
+
+	ca->ca_live--;
+	free((char *)p - CA_HDR);
+}
+
+START_TEST(func_allocator)
+{
+	struct hr_member members[64];
+	struct count_alloc ca = { 0 };
+	const struct hr_allocator alloc = {
+		count_alloc, count_realloc, count_free, &ca
+	};
+	struct hash_ring ring, copy, exp;
+	unsigned allocs, reallocs;
+	uint32_t bins[3];
+
+	for (unsigned i = 0; i < NELEM(members); i++)
+		members[i] = (struct hr_member){ i + 1, 100 };
+
+	/* No retries: every call takes NULL and succeeds. */
+	hash_ring_init_alloc(&ring, md5_hasher, &alloc, 64);
+	fail_if(hash_ring_reserve(&ring, 16, NULL, 0));
+	for (uint32_t m = 1; m <= 16; m++)
+		fail_if((hash_ring_add)(&ring, m, 100, NULL, 0));
+	fail_unless(ca.ca_allocs == 1 && ca.ca_reallocs == 0);
+
+	/* Past the reservation, the ring grows in place. */
+	for (uint32_t m = 17; m <= NELEM(members); m++)
+		fail_if((hash_ring_add)(&ring, m, 100, NULL, 0));
+	fail_unless(ca.ca_allocs == 1 && ca.ca_reallocs > 0);
+
+	hash_ring_init(&exp, md5_hasher, 64);
+	build_any(&exp, members, NELEM(members));
+	check_same_ring(&ring, &exp);
+
+	/* Removes that neither rehash nor shrink allocate nothing. */
+	allocs = ca.ca_allocs;
+	fail_if((hash_ring_remove)(&ring, 5, 0, NULL, 0));
+	fail_if((hash_ring_remove)(&ring, 6, 50, NULL, 0));
+	fail_unless(ca.ca_allocs == allocs);
+
+	fail_if(hash_ring_index(&ring, HR_LOOKUP_BTREE, NULL, 0));
+	fail_if(hash_ring_successors(&ring, NULL, 0));
+	fail_if(hash_ring_preflist(&ring, 3, NULL, 0));
+	fail_if(hash_ring_getn(&ring, 0x1234, 3, bins));
+
+	fail_if(hash_ring_copy(&copy, &ring, NULL, 0));
+	fail_unless(copy.hr_alloc == &alloc);
+
+	/* A copy is exactly full, and grows in place like any ring. */
+	reallocs = ca.ca_reallocs;
+	fail_if((hash_ring_add)(&copy, 1000, 100, NULL, 0));
+	fail_unless(ca.ca_reallocs > reallocs);
+	fail_if(hash_ring_build(&copy, members, 8, NULL, 0));
+
+	/* If the allocator fails, callers get a size back as usual. */
+	ca.ca_fail = true;
+	fail_unless(hash_ring_build(&copy, members, NELEM(members), NULL,
+	    0) > 0);
+	fail_unless(hash_ring_index(&ring, HR_LOOKUP_PREFIX, NULL, 0) > 0);
+	ca.ca_fail = false;
+
+	hash_ring_clean(&copy);
+	hash_ring_clean(&ring);
+	hash_ring_clean(&exp);
+	fail_unless(ca.ca_live == 0, "%d leaked", ca.ca_live);
+}
+END_TEST
+
+static void
+count_task(void *arg, unsigned i)
+{
+	unsigned *hits = arg;
+
+	__atomic_add_fetch(&hits[i], 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * A parallel build() must produce exactly the serial one's ring, shadows and
+ * all.
+ */
+static void
+check_build_parallel(hr_hasher_t hash, const struct hr_member *members,
+    size_t n, const struct hr_workers *w)
+{
+	struct count_alloc ca = { 0 };
+	const struct hr_allocator alloc = {
+		count_alloc, count_realloc, count_free, &ca
+	};
+	struct hash_ring exp, got;
+
+	hash_ring_init(&exp, hash, 256);
+	build_any(&exp, members, n);
+
+	hash_ring_init_alloc(&got, hash, &alloc, 256);
+	hash_ring_set_workers(&got, w);
+	fail_if(hash_ring_build(&got, members, n, NULL, 0));
+	/* The ring, and scratch space for its entries. */
+	fail_unless(ca.ca_allocs == 2);
+
+	check_same_ring(&got, &exp);
+	fail_unless(got.hr_shadow_used == exp.hr_shadow_used);
+	fail_unless(got.hr_shadow_overflow == exp.hr_shadow_overflow);
+	fail_if(memcmp(got.hr_shadow, exp.hr_shadow,
+	    exp.hr_shadow_used * sizeof(*exp.hr_shadow)) != 0);
+
+	hash_ring_clean(&got);
+	hash_ring_clean(&exp);
+	fail_unless(ca.ca_live == 0, "%d leaked", ca.ca_live);
+}
+
+START_TEST(func_build_parallel)
+{
+	struct hr_member members[1000];
+	struct hash_ring_pool pool;
+	unsigned hits[100];
+
+	fail_if(hash_ring_pool_init(&pool, 4));
+
+	/* Every task runs once per call, however many calls. */
+	for (unsigned c = 0; c < 1000; c++) {
+		memset(hits, 0, sizeof hits);
+		hash_ring_pool_workers(&pool)->hw_run(&pool, count_task, hits,
+		    1 + c % NELEM(hits));
+		for (unsigned i = 0; i < NELEM(hits); i++)
+			fail_unless(hits[i] == (i <= c % NELEM(hits)));
+	}
+
+	/* Weights vary, so tasks split members unevenly. */
+	for (unsigned i = 0; i < NELEM(members); i++) {
+		members[i].hm_member = (i * 0x9E3779B1U) & 0xFFFFFF;
+		members[i].hm_weightpct = 1 + i % 100;
+	}
+	check_build_parallel(mmh3_32_hasher, members, NELEM(members),
+	    hash_ring_pool_workers(&pool));
+	check_build_parallel(isi_hasher64, members, NELEM(members),
+	    hash_ring_pool_workers(&pool));
+
+	/* Every entry in one bucket, nearly all of them colliding. */
+	for (unsigned i = 0; i < NELEM(members); i++)
+		members[i] = (struct hr_member){ 1000 - i, 100 };
+	check_build_parallel(stupid_hash, members, NELEM(members),
+	    hash_ring_pool_workers(&pool));
+
+	hash_ring_pool_clean(&pool);
+}
+END_TEST
+
+static const struct vnode_compare {
+	hr_hasher_t		hash;
+	hr_vnode_hasher_t	vnodes;
+} vnode_hashers[] = {
+	{ mmh3_32_hasher, mmh3_32_vnodes },
+	{ isi_hasher32, isi_hasher32_vnodes },
+};
+
+START_TEST(func_vnode_hasher)
+{
+	const uint32_t members[] = { 0, 1, 0xABCDEF, 0xFFFFFF, UINT32_MAX };
+	const uint32_t firsts[] = { 0, 3, UINT32_MAX - 20 };
+	const uint32_t ns[] = { 0, 1, 7, 8, 9, 17, 64, 100 };
+	struct hash_ring ring, exp;
+	uint32_t got[100], r;
+	uint8_t key[8];
+
+	for (unsigned v = 0; v < NELEM(vnode_hashers); v++) {
+		const struct vnode_compare *vc = &vnode_hashers[v];
+
+		/* Every lane, and the leftovers, match the plain hasher. */
+		for (unsigned m = 0; m < NELEM(members); m++)
+		for (unsigned f = 0; f < NELEM(firsts); f++)
+		for (unsigned n = 0; n < NELEM(ns); n++) {
+			vc->vnodes(members[m], firsts[f], ns[n], got);
+			for (uint32_t i = 0; i < ns[n]; i++) {
+				r = firsts[f] + i;
+				for (int b = 0; b < 4; b++) {
+					key[b] = members[m] >> (8 * b);
+					key[4 + b] = r >> (8 * b);
+				}
+				fail_unless(got[i] == vc->hash(key, sizeof key),
+				    "hasher %u member %#x replica %#x", v,
+				    members[m], r);
+			}
+		}
+
+		/* So rings come out the same. */
+		hash_ring_init(&exp, vc->hash, 100);
+		hash_ring_init(&ring, vc->hash, 100);
+		hash_ring_set_vnode_hasher(&ring, vc->vnodes);
+		for (uint32_t m = 1; m <= 20; m++) {
+			fail_if((hash_ring_add)(&exp, m, 5 * m, malloc(NBYTES),
+			    NBYTES));
+			fail_if((hash_ring_add)(&ring, m, 5 * m, malloc(NBYTES),
+			    NBYTES));
+		}
+		hash_ring_remove(&exp, 7);
+		hash_ring_remove(&ring, 7);
+		check_same_ring(&ring, &exp);
+
+		hash_ring_clean(&ring);
+		hash_ring_clean(&exp);
+	}
+}
+END_TEST
+
+START_TEST(err_index_skewed)
+{
+	struct hash_ring ring;
+
+	/* Every entry lands in the first prefix bucket, and the first leaf. */
+	hash_ring_init(&ring, stupid_hash, 64);
+	add_any(&ring, 1);
+	add_any(&ring, 0x400);
+	add_any(&ring, 0x80000);
+
+	for (unsigned l = 0; l < NELEM(lookups); l++)
+		check_lookup(&ring, lookups[l]);
+
+	hash_ring_clean(&ring);
+}
+END_TEST
+
 START_TEST(err_collisions_add)
 {
 	struct hash_ring ring;
@@ -840,6 +1899,37 @@ START_TEST(err_collisions_add)
 	 */
 	hash_ring_add(&ring, 33);
 	fail_if(ring.hr_ring_used != 64+32);
+	fail_unless(hash_ring_nmembers(&ring) == 2);
+
+	hash_ring_clean(&ring);
+}
+END_TEST
+
+START_TEST(err_collisions_shadowed)
+{
+	struct hash_ring ring;
+	uint32_t bins[2];
+
+	hash_ring_init(&ring, stupid_hash, 64);
+
+	/* 0x100 and 1 hash identically; 1 takes over every entry. */
+	hash_ring_add(&ring, 0x100);
+	fail_unless(hash_ring_nmembers(&ring) == 1);
+	hash_ring_add(&ring, 1);
+	fail_unless(ring.hr_ring_used == 64);
+	fail_unless(hash_ring_nmembers(&ring) == 1);
+	fail_unless(hash_ring_getn(&ring, 0x1234, 2, bins) == ENOENT);
+
+	/* The other way around, the higher member never gets an entry. */
+	hash_ring_add(&ring, 0x10000);
+	fail_unless(hash_ring_nmembers(&ring) == 1);
+
+	hash_ring_add(&ring, 33);
+	fail_unless(hash_ring_nmembers(&ring) == 2);
+	fail_if(hash_ring_getn(&ring, 0x1234, 2, bins));
+
+	hash_ring_remove(&ring, 1);
+	fail_unless(hash_ring_nmembers(&ring) == 1);
 
 	hash_ring_clean(&ring);
 }
@@ -860,7 +1950,50 @@ START_TEST(err_collisions_remove)
 
 	hash_ring_remove(&ring, 1);
 	fail_if(ring.hr_ring_used != 64);
+	fail_unless(hash_ring_nmembers(&ring) == 1);
+
+	hash_ring_clean(&ring);
+}
+END_TEST
+
+/*
+ * A copy is exactly full; remove()'s rehash of it, after the shadows
+ * overflowed, re-adds entries that are already there.
+ */
+START_TEST(err_collisions_copy)
+{
+	struct hr_member members[40];
+	struct hash_ring ring, copy, exp;
+	size_t sz;
 
+	for (unsigned i = 0; i < NELEM(members); i++)
+		members[i] = (struct hr_member){ i + 1, 100 };
+
+	hash_ring_init(&ring, stupid_hash, 64);
+	build_any(&ring, members, NELEM(members));
+	fail_unless(ring.hr_shadow_overflow);
+
+	/*
+	 * A remove that leaves every entry in place forgets the shadows
+	 * without rehashing, so that the copy gets no spare room.
+	 */
+	fail_if((hash_ring_remove)(&ring, 3, 51, malloc(NBYTES), NBYTES));
+	fail_if((hash_ring_remove)(&ring, 3, 50, malloc(NBYTES), NBYTES));
+	fail_unless(ring.hr_shadow_overflow && ring.hr_shadow_used == 0);
+	members[2].hm_weightpct = 50;
+
+	sz = hash_ring_copy(&copy, &ring, NULL, 0);
+	fail_if(hash_ring_copy(&copy, &ring, malloc(sz), sz));
+	fail_unless(copy.hr_ring_capacity == copy.hr_ring_used);
+
+	remove_any(&copy, 18);
+	hash_ring_init(&exp, stupid_hash, 64);
+	members[17] = members[NELEM(members) - 1];
+	build_any(&exp, members, NELEM(members) - 1);
+	check_same_ring(&copy, &exp);
+
+	hash_ring_clean(&exp);
+	hash_ring_clean(&copy);
 	hash_ring_clean(&ring);
 }
 END_TEST
@@ -901,21 +2034,42 @@ main(void)
 	tcase_add_test(t, func_get_two);
 	tcase_add_test(t, func_get_two_quick);
 	tcase_add_test(t, func_get_two_quick2);
+	tcase_add_test(t, func_get_batch);
+	tcase_add_test(t, func_index);
+	tcase_add_test(t, func_search_simd);
+	tcase_add_test(t, func_successors);
+	tcase_add_test(t, func_preflist);
+	tcase_add_test(t, func_build);
+	tcase_add_test(t, func_build_parallel);
+	tcase_add_test(t, func_remove_shadows);
+	tcase_add_test(t, func_grow_shrink);
+	tcase_add_test(t, func_reserve);
+	tcase_add_test(t, func_allocator);
+	tcase_add_test(t, func_vnode_hasher);
 	suite_add_tcase(s, t);
 
 	t = tcase_create("error_tests");
 	tcase_add_test(t, err_get_two_with_one_in_ring);
+	tcase_add_test(t, err_get_batch);
 	tcase_add_test(t, err_idempotent);
 	tcase_add_test(t, err_collisions_add);
+	tcase_add_test(t, err_collisions_shadowed);
+	tcase_add_test(t, err_index_skewed);
 	tcase_add_test(t, err_collisions_remove);
+	tcase_add_test(t, err_collisions_copy);
+	tcase_add_test(t, err_rehash_low_weights);
 	suite_add_tcase(s, t);
 
 	t = tcase_create("keyspace_distribution");
 	tcase_add_test(t, distribution);
+	tcase_add_test(t, interp_vs_bsearch);
 	suite_add_tcase(s, t);
 
 	suite_add_t_bias(s);
 	suite_add_t_weights(s);
+	suite_add_t_rcu(s);
+	suite_add_t_seq(s);
+	suite_add_t_numa(s);
 
 	SRunner *sr = srunner_create(s);
 	srunner_run_all(sr, CK_VERBOSE);
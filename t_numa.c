@@ -0,0 +1,213 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Tests for the per-node replicated wrapper, hashring_numa.h. Three copies
+ * are asked for, whatever the machine, so that every test sees several.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "hashring_numa.h"
+
+#include "t_bias.h"
+
+#define NNODES		3
+#define NREADERS	4
+#define WRITES		200
+#define HOT_MEMBER	100
+
+struct numa_getn {
+	struct hash_ring_numa	*ng_ring;
+	struct hr_numa_reader	*ng_rd;
+};
+
+static int
+numa_getn(void *ctx, uint32_t hash, unsigned n, uint32_t *memb_out)
+{
+	struct numa_getn *ng = ctx;
+
+	return hash_ring_numa_getn(ng->ng_ring, ng->ng_rd, hash, n, memb_out);
+}
+
+/* getn(n=3) on @node's copy in @r and on @exp agree for a spread of hashes. */
+static void
+check_numa_matches(struct hash_ring_numa *r, unsigned node,
+    const struct hash_ring *exp)
+{
+	struct hr_numa_reader rd;
+	struct numa_getn ng = { r, &rd };
+
+	hash_ring_numa_register(r, &rd, node);
+	check_getn_matches(numa_getn, &ng, exp);
+	hash_ring_numa_unregister(r, &rd);
+}
+
+START_TEST(numa_basic)
+{
+	struct hr_member members[16];
+	struct hash_ring_numa r;
+	struct hr_numa_reader rd[NNODES];
+	const struct hash_ring *copy[NNODES];
+	struct hash_ring exp;
+	void *buf;
+	size_t sz;
+
+	for (unsigned i = 0; i < 16; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+
+	fail_if(hash_ring_numa_init(&r, mmh3_32_hasher, 64, NNODES));
+	fail_unless(hash_ring_numa_nnodes(&r) == NNODES);
+	fail_unless(hash_ring_numa_node(&r) < NNODES);
+	fail_unless(hash_ring_numa_bind(&r, NNODES) == EINVAL);
+	hash_ring_init(&exp, mmh3_32_hasher, NULL, 64);
+
+	fail_if(hash_ring_numa_build(&r, members, 16));
+	sz = hash_ring_build(&exp, members, 16, NULL, 0);
+	buf = malloc(sz);
+	fail_if(hash_ring_build(&exp, members, 16, buf, sz));
+
+	fail_if(hash_ring_numa_add(&r, HOT_MEMBER, 100));
+	fail_if(hash_ring_numa_remove(&r, 3, 0));
+	fail_if(hash_ring_numa_remove(&r, 5, 40));
+	fail_if(hash_ring_numa_index(&r, HR_LOOKUP_BTREE));
+	fail_if(hash_ring_numa_successors(&r));
+	fail_if(hash_ring_numa_add(&r, 17, 100));
+
+	sz = hash_ring_add(&exp, HOT_MEMBER, 100, NULL, 0);
+	fail_if(hash_ring_add(&exp, HOT_MEMBER, 100, malloc(sz), sz));
+	sz = hash_ring_remove(&exp, 3, 0, NULL, 0);
+	fail_if(hash_ring_remove(&exp, 3, 0, malloc(sz), sz));
+	sz = hash_ring_remove(&exp, 5, 40, NULL, 0);
+	fail_if(hash_ring_remove(&exp, 5, 40, malloc(sz), sz));
+	sz = hash_ring_add(&exp, 17, 100, NULL, 0);
+	fail_if(hash_ring_add(&exp, 17, 100, malloc(sz), sz));
+
+	/* Every node has its own copy, extras and all, of the same ring. */
+	for (unsigned i = 0; i < NNODES; i++) {
+		check_numa_matches(&r, i, &exp);
+
+		hash_ring_numa_register(&r, &rd[i], i);
+		copy[i] = hash_ring_numa_enter(&r, &rd[i]);
+		fail_unless(copy[i]->hr_lookup == HR_LOOKUP_BTREE);
+		fail_unless(copy[i]->hr_succ != NULL);
+		fail_unless(copy[i]->hr_ring_used == exp.hr_ring_used);
+		fail_if(memcmp(copy[i]->hr_ring_hash, exp.hr_ring_hash,
+		    exp.hr_ring_used * sizeof(uint32_t)) != 0);
+		for (unsigned j = 0; j < i; j++) {
+			fail_if(copy[j] == copy[i]);
+			fail_if(copy[j]->hr_ring_hash == copy[i]->hr_ring_hash);
+		}
+	}
+
+	/* Copies in use survive a mutation; they are freed after. */
+	fail_if(hash_ring_numa_remove(&r, HOT_MEMBER, 0));
+	for (unsigned i = 0; i < NNODES; i++) {
+		fail_unless(copy[i]->hr_ring_used == exp.hr_ring_used);
+		hash_ring_numa_exit(&r, &rd[i]);
+	}
+	fail_unless(r.hrn_retired != NULL);
+	hash_ring_numa_synchronize(&r);
+	fail_unless(r.hrn_retired == NULL);
+
+	for (unsigned i = 0; i < NNODES; i++)
+		hash_ring_numa_unregister(&r, &rd[i]);
+	hash_ring_numa_clean(&r);
+	hash_ring_clean(&exp);
+}
+END_TEST
+
+struct numa_stress {
+	struct stress		 ns_stress;
+	struct hash_ring_numa	*ns_ring;
+	unsigned		 ns_next;	/* Node for the next reader */
+};
+
+/*
+ * Look up in one node's copies while a writer adds and removes HOT_MEMBER:
+ * every answer must name a real member, and within one ring the same hash
+ * must keep its answer.
+ */
+static void *
+numa_stress_reader(void *arg)
+{
+	struct numa_stress *ns = arg;
+	struct hr_numa_reader rd;
+	const struct hash_ring *ring;
+	uint64_t st = (uintptr_t)&rd | 1;
+	unsigned long lookups = 0;
+	unsigned errors = 0, node;
+
+	node = __atomic_fetch_add(&ns->ns_next, 1, __ATOMIC_RELAXED) %
+	    hash_ring_numa_nnodes(ns->ns_ring);
+	if (hash_ring_numa_bind(ns->ns_ring, node) != 0)
+		errors++;
+	hash_ring_numa_register(ns->ns_ring, &rd, node);
+	while (!ns->ns_stress.st_stop) {
+		ring = hash_ring_numa_enter(ns->ns_ring, &rd);
+		errors += check_snapshot(ring, &st, 16, HOT_MEMBER);
+		lookups += SNAPSHOT_LOOKUPS;
+		hash_ring_numa_exit(ns->ns_ring, &rd);
+	}
+	hash_ring_numa_unregister(ns->ns_ring, &rd);
+
+	stress_tally(&ns->ns_stress, errors, lookups);
+	return NULL;
+}
+
+START_TEST(numa_concurrent)
+{
+	struct hr_member members[16];
+	struct hash_ring_numa r;
+	struct numa_stress ns = { { false, 0, 0 }, &r, 0 };
+	pthread_t readers[NREADERS];
+
+	for (unsigned i = 0; i < 16; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+	fail_if(hash_ring_numa_init(&r, mmh3_32_hasher, 256, NNODES));
+	fail_if(hash_ring_numa_build(&r, members, 16));
+
+	for (unsigned i = 0; i < NREADERS; i++)
+		fail_if(pthread_create(&readers[i], NULL, numa_stress_reader,
+		    &ns));
+
+	for (unsigned i = 0; i < WRITES; i++) {
+		if (i % 2 == 0)
+			fail_if(hash_ring_numa_add(&r, HOT_MEMBER, 100));
+		else
+			fail_if(hash_ring_numa_remove(&r, HOT_MEMBER, 0));
+		if (i == WRITES / 2)
+			fail_if(hash_ring_numa_index(&r, HR_LOOKUP_PREFIX));
+	}
+
+	ns.ns_stress.st_stop = true;
+	for (unsigned i = 0; i < NREADERS; i++)
+		fail_if(pthread_join(readers[i], NULL));
+	check_stress(&ns.ns_stress);
+
+	/* With every reader gone, nothing is left to reclaim. */
+	fail_unless(r.hrn_retired == NULL);
+	hash_ring_numa_clean(&r);
+}
+END_TEST
+
+void
+suite_add_t_numa(Suite *s)
+{
+	TCase *t;
+
+	t = tcase_create("numa");
+	tcase_add_test(t, numa_basic);
+	tcase_add_test(t, numa_concurrent);
+	suite_add_tcase(s, t);
+}
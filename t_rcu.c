@@ -0,0 +1,188 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Tests for the RCU-style concurrent wrapper, hashring_rcu.h.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "hashring_rcu.h"
+
+#include "t_bias.h"
+
+#define NREADERS	4
+#define WRITES		200
+#define HOT_MEMBER	100
+
+struct rcu_getn {
+	struct hash_ring_rcu	*rg_ring;
+	struct hr_rcu_reader	*rg_rd;
+};
+
+static int
+rcu_getn(void *ctx, uint32_t hash, unsigned n, uint32_t *memb_out)
+{
+	struct rcu_getn *rg = ctx;
+
+	return hash_ring_rcu_getn(rg->rg_ring, rg->rg_rd, hash, n, memb_out);
+}
+
+/* getn(n=3) on @r and on @exp agree for a spread of hashes. */
+static void
+check_rcu_matches(struct hash_ring_rcu *r, struct hr_rcu_reader *rd,
+    const struct hash_ring *exp)
+{
+	struct rcu_getn rg = { r, rd };
+
+	check_getn_matches(rcu_getn, &rg, exp);
+}
+
+START_TEST(rcu_basic)
+{
+	struct hr_member members[16];
+	struct hash_ring_rcu r;
+	struct hr_rcu_reader rd;
+	struct hash_ring exp;
+	const struct hash_ring *snap;
+	void *buf;
+	size_t sz;
+
+	for (unsigned i = 0; i < 16; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+
+	fail_if(hash_ring_rcu_init(&r, mmh3_32_hasher, 64));
+	hash_ring_rcu_register(&r, &rd);
+	hash_ring_init(&exp, mmh3_32_hasher, NULL, 64);
+
+	fail_if(hash_ring_rcu_build(&r, members, 16));
+	sz = hash_ring_build(&exp, members, 16, NULL, 0);
+	buf = malloc(sz);
+	fail_if(hash_ring_build(&exp, members, 16, buf, sz));
+	check_rcu_matches(&r, &rd, &exp);
+
+	/* Each mutation is a new snapshot; old ones stay as they were. */
+	snap = hash_ring_rcu_enter(&r, &rd);
+	fail_if(hash_ring_rcu_add(&r, HOT_MEMBER, 100) != 0);
+	fail_unless(hash_ring_nmembers(snap) == 16);
+	hash_ring_rcu_exit(&r, &rd);
+
+	fail_if(hash_ring_rcu_remove(&r, 3, 0));
+	fail_if(hash_ring_rcu_remove(&r, 5, 40));
+	fail_if(hash_ring_rcu_index(&r, HR_LOOKUP_BTREE));
+	fail_if(hash_ring_rcu_successors(&r));
+	fail_if(hash_ring_rcu_add(&r, 17, 100));
+
+	sz = hash_ring_add(&exp, HOT_MEMBER, 100, NULL, 0);
+	fail_if(hash_ring_add(&exp, HOT_MEMBER, 100, malloc(sz), sz));
+	sz = hash_ring_remove(&exp, 3, 0, NULL, 0);
+	fail_if(hash_ring_remove(&exp, 3, 0, malloc(sz), sz));
+	sz = hash_ring_remove(&exp, 5, 40, NULL, 0);
+	fail_if(hash_ring_remove(&exp, 5, 40, malloc(sz), sz));
+	sz = hash_ring_add(&exp, 17, 100, NULL, 0);
+	fail_if(hash_ring_add(&exp, 17, 100, malloc(sz), sz));
+	check_rcu_matches(&r, &rd, &exp);
+
+	/* The index and successors carried over to the latest snapshot. */
+	snap = hash_ring_rcu_enter(&r, &rd);
+	fail_unless(snap->hr_lookup == HR_LOOKUP_BTREE);
+	fail_unless(snap->hr_succ != NULL);
+	hash_ring_rcu_exit(&r, &rd);
+
+	hash_ring_rcu_synchronize(&r);
+	fail_unless(r.hrr_retired == NULL);
+
+	hash_ring_rcu_unregister(&r, &rd);
+	hash_ring_rcu_clean(&r);
+	hash_ring_clean(&exp);
+}
+END_TEST
+
+struct rcu_stress {
+	struct stress		 rs_stress;
+	struct hash_ring_rcu	*rs_ring;
+};
+
+/*
+ * Look up in snapshots while a writer adds and removes HOT_MEMBER: every
+ * answer must name a real member, and within one snapshot the same hash must
+ * keep its answer.
+ */
+static void *
+rcu_stress_reader(void *arg)
+{
+	struct rcu_stress *rs = arg;
+	struct hr_rcu_reader rd;
+	const struct hash_ring *snap;
+	uint64_t st = (uintptr_t)&rd | 1;
+	unsigned long lookups = 0;
+	unsigned errors = 0;
+
+	hash_ring_rcu_register(rs->rs_ring, &rd);
+	while (!rs->rs_stress.st_stop) {
+		snap = hash_ring_rcu_enter(rs->rs_ring, &rd);
+		errors += check_snapshot(snap, &st, 16, HOT_MEMBER);
+		lookups += SNAPSHOT_LOOKUPS;
+		hash_ring_rcu_exit(rs->rs_ring, &rd);
+	}
+	hash_ring_rcu_unregister(rs->rs_ring, &rd);
+
+	stress_tally(&rs->rs_stress, errors, lookups);
+	return NULL;
+}
+
+START_TEST(rcu_concurrent)
+{
+	struct hr_member members[16];
+	struct hash_ring_rcu r;
+	struct rcu_stress rs = { { false, 0, 0 }, &r };
+	pthread_t readers[NREADERS];
+
+	for (unsigned i = 0; i < 16; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+	fail_if(hash_ring_rcu_init(&r, mmh3_32_hasher, 256));
+	fail_if(hash_ring_rcu_build(&r, members, 16));
+
+	for (unsigned i = 0; i < NREADERS; i++)
+		fail_if(pthread_create(&readers[i], NULL, rcu_stress_reader,
+		    &rs));
+
+	for (unsigned i = 0; i < WRITES; i++) {
+		if (i % 2 == 0)
+			fail_if(hash_ring_rcu_add(&r, HOT_MEMBER, 100));
+		else
+			fail_if(hash_ring_rcu_remove(&r, HOT_MEMBER, 0));
+		if (i == WRITES / 2)
+			fail_if(hash_ring_rcu_index(&r, HR_LOOKUP_PREFIX));
+	}
+
+	rs.rs_stress.st_stop = true;
+	for (unsigned i = 0; i < NREADERS; i++)
+		fail_if(pthread_join(readers[i], NULL));
+	check_stress(&rs.rs_stress);
+
+	/* With every reader gone, nothing is left to reclaim. */
+	fail_unless(r.hrr_retired == NULL);
+	hash_ring_rcu_clean(&r);
+}
+END_TEST
+
+void
+suite_add_t_rcu(Suite *s)
+{
+	TCase *t;
+
+	t = tcase_create("rcu");
+	tcase_add_test(t, rcu_basic);
+	tcase_add_test(t, rcu_concurrent);
+	suite_add_tcase(s, t);
+}
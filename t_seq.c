@@ -0,0 +1,199 @@
+/*
+ * Copyright (c) 2013 Conrad Meyer <cse.cem@gmail.com>
+ *
+ * This is available for use under the terms of the MIT license, see the
+ * LICENSE file.
+ *
+ * Tests for the sequence-locked wrapper, hashring_seq.h.
+ */
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "hashring_seq.h"
+
+#include "t_bias.h"
+
+#define NREADERS	4
+#define WRITES		400
+#define NSTABLE		16
+#define NCHURN		64	/* members NSTABLE+1 .. NSTABLE+NCHURN */
+
+static int
+seq_getn(void *ctx, uint32_t hash, unsigned n, uint32_t *memb_out)
+{
+
+	return hash_ring_seq_getn(ctx, hash, n, memb_out);
+}
+
+START_TEST(seq_basic)
+{
+	struct hr_member members[NSTABLE];
+	struct hash_ring_seq s;
+	struct hash_ring exp;
+	uint32_t hashes[64], got[64 * 3], want[3];
+	uint64_t st = 11;
+	void *buf;
+	size_t sz;
+
+	for (unsigned i = 0; i < NSTABLE; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+
+	fail_if(hash_ring_seq_init(&s, mmh3_32_hasher, 64));
+	hash_ring_init(&exp, mmh3_32_hasher, NULL, 64);
+
+	fail_if(hash_ring_seq_build(&s, members, NSTABLE));
+	sz = hash_ring_build(&exp, members, NSTABLE, NULL, 0);
+	buf = malloc(sz);
+	fail_if(hash_ring_build(&exp, members, NSTABLE, buf, sz));
+	check_getn_matches(seq_getn, &s, &exp);
+
+	fail_if(hash_ring_seq_add(&s, 100, 100));
+	fail_if(hash_ring_seq_remove(&s, 3, 0));
+	fail_if(hash_ring_seq_remove(&s, 5, 40));
+	fail_if(hash_ring_seq_index(&s, HR_LOOKUP_BTREE));
+	fail_if(hash_ring_seq_successors(&s));
+
+	sz = hash_ring_add(&exp, 100, 100, NULL, 0);
+	fail_if(hash_ring_add(&exp, 100, 100, malloc(sz), sz));
+	sz = hash_ring_remove(&exp, 3, 0, NULL, 0);
+	fail_if(hash_ring_remove(&exp, 3, 0, malloc(sz), sz));
+	sz = hash_ring_remove(&exp, 5, 40, NULL, 0);
+	fail_if(hash_ring_remove(&exp, 5, 40, malloc(sz), sz));
+	check_getn_matches(seq_getn, &s, &exp);
+
+	for (unsigned i = 0; i < 64; i++)
+		hashes[i] = rnd(&st);
+	fail_if(hash_ring_seq_getn_batch(&s, hashes, 64, 3, got));
+	for (unsigned i = 0; i < 64; i++) {
+		fail_if(hash_ring_getn(&exp, hashes[i], 3, want));
+		for (unsigned j = 0; j < 3; j++)
+			fail_unless(got[i * 3 + j] == want[j]);
+	}
+
+	/* Growing retired the old ring; nothing was freed under readers. */
+	fail_unless(s.hrs_retired != NULL);
+	fail_unless(hash_ring_seq_reclaim(&s) > 0);
+	fail_unless(s.hrs_retired == NULL);
+	fail_unless(hash_ring_seq_reclaim(&s) == 0);
+
+	hash_ring_seq_clean(&s);
+	hash_ring_clean(&exp);
+}
+END_TEST
+
+struct seq_stress {
+	struct stress		 ss_stress;
+	struct hash_ring_seq	*ss_ring;
+};
+
+/*
+ * Look up while a writer grows, shrinks and re-indexes the ring: every answer
+ * must be three distinct real members. Every key's first choice among the
+ * stable members can only move to a churning member, never to another stable
+ * one.
+ */
+static void *
+seq_stress_reader(void *arg)
+{
+	struct seq_stress *ss = arg;
+	struct hash_ring stable;
+	struct hr_member members[NSTABLE];
+	uint32_t a[3], first;
+	uint64_t st = (uintptr_t)&a | 1;
+	unsigned long lookups = 0;
+	unsigned errors = 0;
+	size_t sz;
+
+	for (unsigned i = 0; i < NSTABLE; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+	hash_ring_init(&stable, mmh3_32_hasher, NULL, 64);
+	sz = hash_ring_build(&stable, members, NSTABLE, NULL, 0);
+	if (hash_ring_build(&stable, members, NSTABLE, malloc(sz), sz) != 0)
+		abort();
+
+	while (!ss->ss_stress.st_stop) {
+		uint32_t hash = rnd(&st);
+
+		if (hash_ring_seq_getn(ss->ss_ring, hash, 3, a) != 0 ||
+		    hash_ring_getn(&stable, hash, 1, &first) != 0) {
+			errors++;
+			continue;
+		}
+		if (a[0] == a[1] || a[0] == a[2] || a[1] == a[2])
+			errors++;
+		for (unsigned j = 0; j < 3; j++)
+			if (a[j] < 1 || a[j] > NSTABLE + NCHURN)
+				errors++;
+		if (a[0] <= NSTABLE && a[0] != first)
+			errors++;
+		lookups++;
+	}
+
+	hash_ring_clean(&stable);
+	stress_tally(&ss->ss_stress, errors, lookups);
+	return NULL;
+}
+
+START_TEST(seq_concurrent)
+{
+	struct hr_member members[NSTABLE];
+	struct hash_ring_seq s;
+	struct seq_stress ss = { { false, 0, 0 }, &s };
+	pthread_t readers[NREADERS];
+	const struct timespec ts = { 0, 20 * 1000 };
+
+	for (unsigned i = 0; i < NSTABLE; i++) {
+		members[i].hm_member = i + 1;
+		members[i].hm_weightpct = 100;
+	}
+	fail_if(hash_ring_seq_init(&s, mmh3_32_hasher, 64));
+	fail_if(hash_ring_seq_build(&s, members, NSTABLE));
+
+	for (unsigned i = 0; i < NREADERS; i++)
+		fail_if(pthread_create(&readers[i], NULL, seq_stress_reader,
+		    &ss));
+
+	/*
+	 * Add all the churning members and take them away again, over and
+	 * over, so the ring grows and shrinks under the readers.
+	 */
+	for (unsigned i = 0; i < WRITES; i++) {
+		uint32_t m = NSTABLE + 1 + i % NCHURN;
+
+		if ((i / NCHURN) % 2 == 0)
+			fail_if(hash_ring_seq_add(&s, m, 100));
+		else
+			fail_if(hash_ring_seq_remove(&s, m, 0));
+		if (i % 50 == 25)
+			fail_if(hash_ring_seq_index(&s, i % 100 == 25 ?
+			    HR_LOOKUP_PREFIX : HR_LOOKUP_BSEARCH));
+		nanosleep(&ts, NULL);
+	}
+
+	ss.ss_stress.st_stop = true;
+	for (unsigned i = 0; i < NREADERS; i++)
+		fail_if(pthread_join(readers[i], NULL));
+	check_stress(&ss.ss_stress);
+
+	(void)hash_ring_seq_reclaim(&s);
+	hash_ring_seq_clean(&s);
+}
+END_TEST
+
+void
+suite_add_t_seq(Suite *s)
+{
+	TCase *t;
+
+	t = tcase_create("seq");
+	tcase_add_test(t, seq_basic);
+	tcase_add_test(t, seq_concurrent);
+	suite_add_tcase(s, t);
+}
@@ -57,7 +57,7 @@ _hash_ring_dump(struct hash_ring *h)
 	printf("\tring:\n");
 	for (size_t i = 0; i < h->hr_ring_used; i++)
 		printf("\t\t{ hash: %#"PRIx32", bin: %#"PRIx32" }\n",
-		    h->hr_ring[i].kv_hash, h->hr_ring[i].kv_value);
+		    h->hr_ring_hash[i], h->hr_ring_value[i]);
 	printf("\tring capacity: %zu\n", h->hr_ring_capacity);
 }
 #endif
@@ -69,13 +69,27 @@ hash_ring_weight(struct hash_ring *h, uint32_t nreplicas, uint32_t member)
 	unsigned tot = 0;
 
 	for (size_t i = 0; i < h->hr_ring_used; i++) {
-		if ((h->hr_ring[i].kv_value & MASK) == member)
+		if ((h->hr_ring_value[i] & MASK) == member)
 			tot++;
 	}
 
 	return 100 * tot / nreplicas;
 }
 
+/* Whether every ring entry of @member carries weight @weightpct. */
+static bool
+hash_ring_weight_bits(struct hash_ring *h, uint32_t member, unsigned weightpct)
+{
+	const uint32_t MASK = (1<<24)-1;
+
+	for (size_t i = 0; i < h->hr_ring_used; i++) {
+		if ((h->hr_ring_value[i] & MASK) == member &&
+		    (h->hr_ring_value[i] >> 24) != weightpct)
+			return false;
+	}
+	return true;
+}
+
 static bool
 eps_equals(unsigned a, unsigned b, unsigned eps)
 {
@@ -156,6 +170,37 @@ START_TEST(wht_basic_remove)
 }
 END_TEST
 
+START_TEST(wht_ramp)
+{
+	static const unsigned steps[] = { 10, 40, 80, 100, 55, 20, 70 };
+	struct hash_ring ring;
+	uint32_t nreps = 64;
+	unsigned wt, prev = 0;
+
+	hash_ring_init(&ring, isi_hasher64, nreps);
+
+	hash_ring_add(&ring, 0xc0ffee, 50);
+	hash_ring_add(&ring, 0x123456, 100);
+
+	/* Each step rewrites the weight on every entry, and only on those. */
+	for (unsigned i = 0; i < sizeof steps / sizeof steps[0]; i++) {
+		if (steps[i] > prev)
+			hash_ring_add(&ring, 0xdeadbf, steps[i]);
+		else
+			hash_ring_remove(&ring, 0xdeadbf, steps[i]);
+		prev = steps[i];
+
+		wt = hash_ring_weight(&ring, nreps, 0xdeadbf);
+		fail_unless(eps_equals(wt, steps[i], 3), "wt: %u", wt);
+		fail_unless(hash_ring_weight_bits(&ring, 0xdeadbf, steps[i]));
+		fail_unless(hash_ring_weight_bits(&ring, 0xc0ffee, 50));
+		fail_unless(hash_ring_weight_bits(&ring, 0x123456, 100));
+	}
+
+	hash_ring_clean(&ring);
+}
+END_TEST
+
 START_TEST(wht_bigger)
 {
 	struct hash_ring ring;
@@ -252,6 +297,7 @@ suite_add_t_weights(Suite *s)
 	t = tcase_create("weighted_hashing");
 	tcase_add_test(t, wht_basic);
 	tcase_add_test(t, wht_basic_remove);
+	tcase_add_test(t, wht_ramp);
 	tcase_add_test(t, wht_bigger);
 	tcase_add_test_raise_signal(t, wht_bounds1, SIGABRT);
 	tcase_add_test_raise_signal(t, wht_bounds2, SIGABRT);